@@ -15,16 +15,23 @@ PG_MODULE_MAGIC;
 
 static Jsonb *empty_labels;
 
+/* Resolved on first use, since shared memory isn't attached in _PG_init() */
+static PMetricsHandle *commit_handle = NULL;
+static PMetricsHandle *abort_handle = NULL;
+
 static void pmetrics_txn_callback(XactEvent event, void *arg)
 {
 	const char *metric_name;
+	PMetricsHandle **handle;
 
 	switch (event) {
 	case XACT_EVENT_COMMIT:
 		metric_name = "pg_transactions_commit";
+		handle = &commit_handle;
 		break;
 	case XACT_EVENT_ABORT:
 		metric_name = "pg_transactions_abort";
+		handle = &abort_handle;
 		break;
 	default:
 		return;
@@ -32,7 +39,9 @@ static void pmetrics_txn_callback(XactEvent event, void *arg)
 
 	PG_TRY();
 	{
-		pmetrics_increment_counter(metric_name, empty_labels);
+		if (*handle == NULL)
+			*handle = pmetrics_counter_handle(metric_name, empty_labels);
+		pmetrics_counter_add(*handle, 1);
 	}
 	PG_CATCH();
 	{
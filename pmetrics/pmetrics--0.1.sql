@@ -1,18 +1,35 @@
 /** Composite type representing a metric entry */
 CREATE TYPE metric_type AS (name TEXT, labels JSONB, type TEXT, bucket INTEGER, value BIGINT);
 
+/** Composite type representing a metric entry of a snapshot */
+CREATE TYPE metric_snapshot_type AS (generation BIGINT, name TEXT, labels JSONB, type TEXT, bucket INTEGER, value BIGINT);
+
+/** Composite type representing a change to a series since a snapshot */
+CREATE TYPE metric_change_type AS (generation BIGINT, name TEXT, labels JSONB, type TEXT, bucket INTEGER, value BIGINT, removed BOOLEAN);
+
 /** Composite type representing a histogram bucket upper bound */
 CREATE TYPE histogram_buckets_type AS (bucket INTEGER);
 
+/** Composite type representing hash distribution figures of a shared table */
+CREATE TYPE hash_table_stats_type AS (table_name TEXT, entries BIGINT, distinct_hashes BIGINT, colliding_entries BIGINT, used_partitions INTEGER, min_partition_entries BIGINT, max_partition_entries BIGINT);
+
+/** Composite type representing a shared memory figure or the usage of a metric name */
+CREATE TYPE memory_stats_type AS (kind TEXT, name TEXT, entries BIGINT, bytes BIGINT, last_update TIMESTAMPTZ);
+
+/** Composite type representing the estimated quantiles of a histogram */
+CREATE TYPE histogram_quantile_type AS (labels JSONB, count BIGINT, quantiles FLOAT8[]);
+
 /**
  * Increment a counter by 1.
- * Returns the new counter value, or NULL if pmetrics.enabled=false.
+ * Returns the new counter value, or NULL if pmetrics.enabled=false or the update
+ * was buffered (see pmetrics.flush_interval_ms).
  */
 CREATE FUNCTION increment_counter (name TEXT, labels JSONB) RETURNS BIGINT AS '$libdir/pmetrics' LANGUAGE C STRICT;
 
 /**
  * Increment a counter by a specified amount (must be > 0).
- * Returns the new counter value, or NULL if pmetrics.enabled=false.
+ * Returns the new counter value, or NULL if pmetrics.enabled=false or the update
+ * was buffered (see pmetrics.flush_interval_ms).
  */
 CREATE FUNCTION increment_counter_by (name TEXT, labels JSONB, increment INTEGER) RETURNS BIGINT AS '$libdir/pmetrics' LANGUAGE C STRICT;
 
@@ -24,16 +41,30 @@ CREATE FUNCTION set_gauge (name TEXT, labels JSONB, value BIGINT) RETURNS BIGINT
 
 /**
  * Add or subtract from a gauge (value cannot be zero).
- * Returns the new gauge value, or NULL if pmetrics.enabled=false.
+ * Returns the new gauge value, or NULL if pmetrics.enabled=false or the update
+ * was buffered (see pmetrics.flush_interval_ms).
  */
 CREATE FUNCTION add_to_gauge (name TEXT, labels JSONB, value BIGINT) RETURNS BIGINT AS '$libdir/pmetrics' LANGUAGE C STRICT;
 
 /**
  * Record a value to a histogram.
- * Returns the updated bucket count, or NULL if pmetrics.enabled=false.
+ * Returns the updated bucket count, or NULL if pmetrics.enabled=false or the update
+ * was buffered (see pmetrics.flush_interval_ms).
  */
 CREATE FUNCTION record_to_histogram (name TEXT, labels JSONB, value FLOAT) RETURNS BIGINT AS '$libdir/pmetrics' LANGUAGE C STRICT;
 
+/**
+ * Increment counters given as parallel arrays, in a single batch.
+ * Returns the number of increments, or NULL if pmetrics.enabled=false.
+ */
+CREATE FUNCTION increment_counters (names TEXT[], labels JSONB[], amounts BIGINT[]) RETURNS BIGINT AS '$libdir/pmetrics' LANGUAGE C STRICT;
+
+/**
+ * Record every value of an array to a histogram, in a single batch.
+ * Returns the number of values recorded, or NULL if pmetrics.enabled=false.
+ */
+CREATE FUNCTION record_to_histogram_many (name TEXT, labels JSONB, "values" FLOAT8[]) RETURNS BIGINT AS '$libdir/pmetrics' LANGUAGE C STRICT;
+
 /**
  * List all metrics currently stored in shared memory.
  * Histograms have multiple rows (one per non-empty bucket).
@@ -41,11 +72,64 @@ CREATE FUNCTION record_to_histogram (name TEXT, labels JSONB, value FLOAT) RETUR
  */
 CREATE FUNCTION list_metrics () RETURNS SETOF metric_type AS '$libdir/pmetrics' LANGUAGE C STRICT;
 
+/**
+ * Same rows as list_metrics(), with the generation of the snapshot they were
+ * copied in. Each call gets a new generation, which numbers the call: series
+ * are copied one at a time, not as of a single instant.
+ */
+CREATE FUNCTION list_metrics_snapshot () RETURNS SETOF metric_snapshot_type AS '$libdir/pmetrics' LANGUAGE C STRICT;
+
+/**
+ * Rows of list_metrics_snapshot() for the series written to since the
+ * snapshot of a generation, led by one row per series removed since then.
+ * Generation 0 lists every series.
+ */
+CREATE FUNCTION list_metrics_since (generation BIGINT) RETURNS SETOF metric_change_type AS '$libdir/pmetrics' LANGUAGE C STRICT;
+
+/**
+ * List the metrics whose name matches a LIKE pattern, whose labels contain a
+ * JSONB object and whose type is in a list. NULL arguments don't filter.
+ * Filters are applied while scanning shared memory, so non-matching series
+ * are never copied.
+ */
+CREATE FUNCTION list_metrics (name_pattern TEXT, labels_contain JSONB, types TEXT[]) RETURNS SETOF metric_type AS '$libdir/pmetrics', 'list_metrics_filtered' LANGUAGE C;
+
+/**
+ * List the metrics whose labels contain a JSONB object, found through the
+ * label index without scanning shared memory.
+ */
+CREATE FUNCTION list_metrics_matching (labels JSONB) RETURNS SETOF metric_type AS '$libdir/pmetrics' LANGUAGE C STRICT;
+
+/**
+ * All metrics in the Prometheus text exposition format, with cumulative
+ * histogram buckets, rendered in a single pass over shared memory.
+ */
+CREATE FUNCTION prometheus_text () RETURNS TEXT AS '$libdir/pmetrics' LANGUAGE C STRICT;
+
+/**
+ * All metrics in a compact columnar binary layout, as chunks to concatenate
+ * in order. See the README for the layout.
+ */
+CREATE FUNCTION export_binary () RETURNS SETOF BYTEA AS '$libdir/pmetrics' LANGUAGE C STRICT;
+
 /**
  * List all possible histogram bucket upper bounds based on current configuration.
  */
 CREATE FUNCTION list_histogram_buckets () RETURNS SETOF histogram_buckets_type AS '$libdir/pmetrics' LANGUAGE C STRICT;
 
+/**
+ * Estimate quantiles (between 0 and 1) of a histogram from its bucket counts,
+ * interpolating within the exponential buckets.
+ * Returns one estimate per quantile, or NULL if the histogram is missing or empty.
+ */
+CREATE FUNCTION histogram_quantile (name TEXT, labels JSONB, q FLOAT8[]) RETURNS FLOAT8[] AS '$libdir/pmetrics' LANGUAGE C STRICT;
+
+/**
+ * Estimate quantiles of every non-empty histogram of a name, whatever their
+ * labels. One row per histogram, with its number of observations.
+ */
+CREATE FUNCTION histogram_quantile (name TEXT, q FLOAT8[]) RETURNS SETOF histogram_quantile_type AS '$libdir/pmetrics', 'histogram_quantile_any_labels' LANGUAGE C STRICT;
+
 /**
  * Clear all metrics from shared memory.
  * Returns the number of metrics deleted.
@@ -58,34 +142,118 @@ CREATE FUNCTION clear_metrics () RETURNS BIGINT AS '$libdir/pmetrics' LANGUAGE C
  */
 CREATE FUNCTION delete_metric (name TEXT, labels JSONB) RETURNS BIGINT AS '$libdir/pmetrics' LANGUAGE C STRICT;
 
+/**
+ * Delete all metrics with the specified name, whatever their labels.
+ * Returns the number of metrics deleted, or NULL if pmetrics.enabled=false.
+ */
+CREATE FUNCTION delete_metric (name TEXT) RETURNS BIGINT AS '$libdir/pmetrics', 'delete_metric_any_labels' LANGUAGE C STRICT;
+
+/**
+ * Delete all metrics whose labels contain a JSONB object.
+ * Returns the number of metrics deleted, or NULL if pmetrics.enabled=false.
+ */
+CREATE FUNCTION delete_metrics_matching (labels JSONB) RETURNS BIGINT AS '$libdir/pmetrics' LANGUAGE C STRICT;
+
+/**
+ * Age in milliseconds of the oldest update buffered in a backend and not yet
+ * merged into shared memory (see pmetrics.flush_interval_ms). 0 if none.
+ */
+CREATE FUNCTION max_staleness_ms () RETURNS BIGINT AS '$libdir/pmetrics' LANGUAGE C STRICT;
+
+/**
+ * Hash distribution of the shared tables: the metrics table, the table of
+ * interned names and label sets and, with pmetrics.index_labels, the label
+ * index: hash collisions, and how entries spread over the dshash
+ * partitions, as counted by a scan of each table.
+ */
+CREATE FUNCTION hash_table_stats () RETURNS SETOF hash_table_stats_type AS '$libdir/pmetrics' LANGUAGE C STRICT;
+
+/**
+ * Shared memory used by pmetrics: the DSA area, the estimated bucket arrays
+ * of the shared tables, the memory of series, names, label sets and indexes, and
+ * one row per metric name. Read from counters, without scanning the metrics
+ * table.
+ */
+CREATE FUNCTION memory_stats () RETURNS SETOF memory_stats_type AS '$libdir/pmetrics' LANGUAGE C STRICT;
+
 -- Type documentation
 COMMENT ON TYPE metric_type IS 'Composite type representing a metric entry with name, labels, type, bucket (for histograms), and value';
 COMMENT ON TYPE histogram_buckets_type IS 'Composite type representing a histogram bucket upper bound';
+COMMENT ON TYPE metric_snapshot_type IS 'Composite type representing a metric entry of a snapshot, with the generation of the snapshot';
+COMMENT ON TYPE metric_change_type IS 'Composite type representing a change to a series since a snapshot, with the generation of the snapshot and whether the series was removed';
+COMMENT ON TYPE hash_table_stats_type IS 'Composite type representing hash distribution figures of a shared table';
+COMMENT ON TYPE histogram_quantile_type IS 'Composite type representing the estimated quantiles of a histogram, with its labels and number of observations';
+COMMENT ON TYPE memory_stats_type IS 'Composite type representing a shared memory figure of pmetrics, or the usage of a metric name';
 
 -- Function documentation
 COMMENT ON FUNCTION increment_counter(TEXT, JSONB) IS
-'Increment a counter by 1. Returns the new counter value, or NULL if pmetrics.enabled=false.';
+'Increment a counter by 1. Returns the new counter value, or NULL if pmetrics.enabled=false or the update was buffered in this backend (see pmetrics.flush_interval_ms).';
 
 COMMENT ON FUNCTION increment_counter_by(TEXT, JSONB, INTEGER) IS
-'Increment a counter by a specified amount (must be > 0). Returns the new counter value, or NULL if pmetrics.enabled=false.';
+'Increment a counter by a specified amount (must be > 0). Returns the new counter value, or NULL if pmetrics.enabled=false or the update was buffered in this backend (see pmetrics.flush_interval_ms).';
 
 COMMENT ON FUNCTION set_gauge(TEXT, JSONB, BIGINT) IS
 'Set a gauge to an absolute value. Returns the value that was set, or NULL if pmetrics.enabled=false.';
 
 COMMENT ON FUNCTION add_to_gauge(TEXT, JSONB, BIGINT) IS
-'Add or subtract from a gauge (value cannot be zero). Returns the new gauge value, or NULL if pmetrics.enabled=false.';
+'Add or subtract from a gauge (value cannot be zero). Returns the new gauge value, or NULL if pmetrics.enabled=false or the update was buffered in this backend (see pmetrics.flush_interval_ms).';
 
 COMMENT ON FUNCTION record_to_histogram(TEXT, JSONB, FLOAT) IS
-'Record a value to a histogram. Returns the updated bucket count, or NULL if pmetrics.enabled=false.';
+'Record a value to a histogram. Returns the updated bucket count, or NULL if pmetrics.enabled=false or the update was buffered in this backend (see pmetrics.flush_interval_ms).';
+
+COMMENT ON FUNCTION increment_counters(TEXT[], JSONB[], BIGINT[]) IS
+'Increment counters given as parallel arrays of names, labels and amounts (each > 0), in a single batch. Returns the number of increments, or NULL if pmetrics.enabled=false.';
+
+COMMENT ON FUNCTION record_to_histogram_many(TEXT, JSONB, FLOAT8[]) IS
+'Record every value of an array to a histogram, in a single batch. Returns the number of values recorded, or NULL if pmetrics.enabled=false.';
 
 COMMENT ON FUNCTION list_metrics() IS
 'List all metrics currently stored in shared memory. Histograms have multiple rows (one per non-empty bucket). Empty buckets are not returned.';
 
+COMMENT ON FUNCTION list_metrics_snapshot() IS
+'List all metrics like list_metrics(), with the generation of the snapshot they were copied in. Each call gets a new generation numbering the call; series are copied one at a time, not as of a single instant.';
+
+COMMENT ON FUNCTION list_metrics_since(BIGINT) IS
+'List the metrics written to since the snapshot of a generation, after one row per series deleted by name and labels since then. Fails after bulk removals or once removals are forgotten. Pass the generation of the rows to the next call, or 0 to list every series.';
+
+COMMENT ON FUNCTION list_metrics(TEXT, JSONB, TEXT[]) IS
+'List metrics filtered by a LIKE pattern on the name, a JSONB object the labels must contain and a list of types (counter, gauge, histogram, histogram_sum). NULL arguments do not filter.';
+
+COMMENT ON FUNCTION list_metrics_matching(JSONB) IS
+'List metrics whose labels contain a JSONB object, found through the label index.';
+
+COMMENT ON FUNCTION prometheus_text() IS
+'All metrics in the Prometheus text exposition format: one TYPE line per name, labels from the JSONB label sets, and cumulative _bucket, _count and _sum lines for histograms.';
+
+COMMENT ON FUNCTION export_binary() IS
+'All metrics in a columnar binary layout: a name dictionary, a label dictionary, then fixed-width value and histogram bucket arrays. Concatenate the chunks in order to get the whole export.';
+
 COMMENT ON FUNCTION list_histogram_buckets() IS
 'List all possible histogram bucket upper bounds based on current configuration.';
 
+COMMENT ON FUNCTION histogram_quantile(TEXT, JSONB, FLOAT8[]) IS
+'Estimate quantiles (between 0 and 1) of a histogram from its bucket counts. Returns one estimate per quantile, or NULL if the histogram is missing or empty.';
+
+COMMENT ON FUNCTION histogram_quantile(TEXT, FLOAT8[]) IS
+'Estimate quantiles (between 0 and 1) of every non-empty histogram of a name, one row per histogram with its labels and number of observations.';
+
 COMMENT ON FUNCTION clear_metrics() IS
 'Clear all metrics from shared memory. Returns the number of metrics deleted.';
 
 COMMENT ON FUNCTION delete_metric(TEXT, JSONB) IS
 'Delete all metrics with the specified name and labels. Returns the number of metrics deleted, or NULL if pmetrics.enabled=false.';
+
+COMMENT ON FUNCTION delete_metric(TEXT) IS
+'Delete all metrics with the specified name, whatever their labels. Returns the number of metrics deleted, or NULL if pmetrics.enabled=false.';
+
+COMMENT ON FUNCTION delete_metrics_matching(JSONB) IS
+'Delete all metrics whose labels contain a JSONB object. Returns the number of metrics deleted, or NULL if pmetrics.enabled=false.';
+
+COMMENT ON FUNCTION max_staleness_ms() IS
+'Age in milliseconds of the oldest update buffered in a backend and not yet merged into shared memory (see pmetrics.flush_interval_ms). 0 if none.';
+
+COMMENT ON FUNCTION hash_table_stats() IS
+'Hash collisions and entries per dshash partition of the metrics table, of the interned names and label sets table and, with pmetrics.index_labels, of the label index.';
+
+COMMENT ON FUNCTION memory_stats() IS
+'Shared memory used by pmetrics: DSA size, estimated bucket array size of each shared table, bytes and entries of series, names, label sets and indexes, and the series count, label bytes and last update of each metric name.';
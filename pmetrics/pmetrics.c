@@ -5,9 +5,13 @@
  * for counters, gauges and histograms, with labels.
  *
  * Metrics are stored in dynamic shared memory and the hash table grows
- * automatically as needed (no fixed limit).
+ * automatically as needed, up to the optional pmetrics.max_series and
+ * pmetrics.max_memory limits. Updates that would create a series past a limit
+ * go to an overflow series of the same name instead of failing.
  *
- * Each metric is uniquely identified by name, labels, type, and bucket.
+ * Each series is uniquely identified by name, labels and type. A histogram is
+ * a single series holding its sum and all bucket counts, which list_metrics()
+ * expands into one row per bucket plus a sum row.
  *
  * Accepts the following custom options:
  * - pmetrics.enabled: Enable metrics collection. Defaults to true.
@@ -16,9 +20,30 @@
  * - pmetrics.buckets_upper_bound: the limit for the maximum histogram bucket.
  *   Defaults to 30000. Values over this will be truncated and fitted into the
  *   last bucket. A notice is raised whenever this happens.
+ * - pmetrics.flush_interval_ms: when greater than 0, increments, gauge adds
+ *   and histogram observations are buffered in backend-local memory and
+ *   merged into shared memory at transaction end, when the oldest buffered
+ *   update is this old, or when the backend reads metrics. Defaults to 0
+ *   (every update goes straight to shared memory).
+ * - pmetrics.sharded_metrics: comma-separated list of counter and histogram
+ *   names whose series keep one cache-line-padded slot per backend, summed on
+ *   read. Meant for a few very hot series. Defaults to empty.
+ * - pmetrics.save: save all series at shutdown and load them back at the
+ *   next start. Defaults to true.
+ * - pmetrics.checkpoint_interval: when set at server start, a background
+ *   worker saves the series updated since its last full checkpoint this
+ *   often, in seconds, which are loaded back after a crash. Defaults to 0
+ *   (disabled).
+ * - pmetrics.http_port: when set at server start, a background worker serves
+ *   all metrics in the Prometheus text format at http://<address>:<port>/
+ *   metrics. Defaults to 0 (disabled).
+ * - pmetrics.http_listen_address: the address that worker listens on.
+ *   Defaults to localhost.
  *
  * Labels are stored as JSONB for structured key-value data. Names are limited
- * to NAMEDATALEN.
+ * to NAMEDATALEN. Each distinct name and label set is stored once in a shared
+ * dictionary and identified by an integer id, which is what series keys
+ * carry.
  */
 
 #include "postgres.h"
@@ -28,31 +53,132 @@
 #include "fmgr.h"
 #include "funcapi.h"
 #include "lib/dshash.h"
+#include "lib/ilist.h"
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "lib/stringinfo.h"
 #include "miscadmin.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "port/pg_crc32c.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/fd.h"
 #include "storage/ipc.h"
 #include "storage/lwlock.h"
+#include "storage/proc.h"
 #include "storage/shmem.h"
+#include "tcop/tcopprot.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/dsa.h"
 #include "utils/guc.h"
 #include "utils/hsearch.h"
 #include "utils/jsonb.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+#include "utils/varlena.h"
 
 #include "math.h"
+#include <netdb.h>
 #include <stdio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 PG_MODULE_MAGIC;
 
 /* LWLock tranche IDs (must not conflict with other extensions) */
 #define LWTRANCHE_PMETRICS_DSA 43001
 #define LWTRANCHE_PMETRICS 43002
+#define LWTRANCHE_PMETRICS_INTERNED 43004
+#define LWTRANCHE_PMETRICS_LABEL_PAIRS 43005
 
 /* GUC defaults */
 #define DEFAULT_ENABLED true
 #define DEFAULT_BUCKET_VARIABILITY 0.1
 #define DEFAULT_BUCKETS_UPPER_BOUND 30000
+#define DEFAULT_FLUSH_INTERVAL_MS 0
+#define DEFAULT_SHARDED_METRICS ""
+#define DEFAULT_INDEX_LABELS true
+#define DEFAULT_MAX_SERIES 0
+#define DEFAULT_MAX_MEMORY_MB 0
+#define DEFAULT_MAX_SERIES_PER_NAME 0
+#define DEFAULT_EVICTION EVICTION_NONE
+#define DEFAULT_SAVE true
+#define DEFAULT_CHECKPOINT_INTERVAL 0
+#define MAX_FLUSH_INTERVAL_MS 3600000 /* 1 hour */
+#define MAX_CHECKPOINT_INTERVAL 86400   /* 1 day, in seconds */
+#define DEFAULT_HTTP_PORT 0
+#define DEFAULT_HTTP_LISTEN_ADDRESS "localhost"
+#define WORKER_RESTART_TIME 10 /* Seconds, after an error */
+
+/* Limits of the HTTP worker, see serve_http_client() */
+#define HTTP_LISTEN_BACKLOG 16
+#define HTTP_MAX_REQUEST 8192
+#define HTTP_TIMEOUT_MS 5000
+#define PROMETHEUS_CONTENT_TYPE "text/plain; version=0.0.4; charset=utf-8"
+
+/* Buffered series kept between flushes before the buffer is rebuilt */
+#define MAX_PENDING_SERIES 1024
+
+/* Interned values cached per backend before the cache is rebuilt */
+#define MAX_CACHED_INTERNED 4096
+
+/* Interned value ids. Real ids start at 1 and are never reused. */
+#define NO_LABELS_ID 0
+#define UNKNOWN_INTERNED_ID PG_UINT64_MAX
+
+/* Initial number of slots of a SlotIndex */
+#define MIN_INDEX_SLOTS 4
+
+/* Type of a free IndexSlot */
+#define FREE_INDEX_SLOT (-1)
+
+/* Labels of the series taking the updates refused by a series limit */
+#define OVERFLOW_LABELS "{\"pmetrics_overflow\": true}"
+
+/* Metrics dump written at shutdown and loaded at startup */
+#define METRICS_DUMP_FILE PGSTAT_STAT_PERMANENT_DIRECTORY "/pmetrics.stat"
+#define METRICS_DUMP_MAGIC 0x504d4554 /* "PMET" */
+#define METRICS_DUMP_VERSION 1
+
+/* Last full checkpoint and changes since, see pmetrics.checkpoint_interval */
+#define CHECKPOINT_FILE PGSTAT_STAT_PERMANENT_DIRECTORY "/pmetrics.checkpoint"
+#define CHECKPOINT_DELTA_FILE CHECKPOINT_FILE ".delta"
+
+/* Encoded records buffered by a DumpWriter before they are written */
+#define DUMP_BUFFER_SIZE 65536
+
+/* Layout of export_binary() output, see the README */
+#define EXPORT_MAGIC "PMX1"
+#define EXPORT_VERSION 1
+#define EXPORT_NO_LABELS PG_UINT32_MAX
+#define EXPORT_CHUNK_SIZE (1024 * 1024)
+
+/* Removed series remembered for list_metrics_since() */
+#define REMOVAL_LOG_SIZE 4096
+
+/* Share of the evictable series removed by each eviction */
+#define EVICTION_FRACTION 16
+
+/* Values of pmetrics.eviction */
+typedef enum EvictionPolicy {
+	EVICTION_NONE,
+	EVICTION_LEAST_RECENTLY_UPDATED
+} EvictionPolicy;
+
+static const struct config_enum_entry eviction_options[] = {
+    {"none", EVICTION_NONE, false},
+    {"least_recently_updated", EVICTION_LEAST_RECENTLY_UPDATED, false},
+    {NULL, 0, false}};
 
-/* Metric types */
+/*
+ * Metric types. METRIC_TYPE_HISTOGRAM_SUM only appears in list_metrics()
+ * rows, the sum is stored in the histogram series.
+ */
 typedef enum MetricType {
 	METRIC_TYPE_COUNTER = 0,
 	METRIC_TYPE_GAUGE = 1,
@@ -60,41 +186,505 @@ typedef enum MetricType {
 	METRIC_TYPE_HISTOGRAM_SUM = 3
 } MetricType;
 
+/*
+ * Values of a series are stored in cells. Counters and gauges have a single
+ * cell. Histograms have the sum in cell 0 followed by one cell per bucket
+ * index.
+ */
+#define HISTOGRAM_SUM_CELL 0
+#define HISTOGRAM_BUCKET_CELL(index) (1 + (index))
+
+/*
+ * dshash splits its buckets into 2^7 partitions picked by the top bits of the
+ * hash. These are private to dshash.c (DSHASH_NUM_PARTITIONS_LOG2 and
+ * PARTITION_FOR_HASH), copied here as checked against PostgreSQL 17 and 18.
+ * They only feed estimates (memory_stats()) and the sort order of batches,
+ * never anything correctness depends on.
+ */
+#define DSHASH_PARTITIONS_LOG2 7
+#define PARTITION_FOR_HASH(hash) ((hash) >> (32 - DSHASH_PARTITIONS_LOG2))
+
+/* Uses of the DSA memory counted by account_memory() */
+typedef enum MemoryKind {
+	MEMORY_SERIES = 0,     /* Metric entries and their cells */
+	MEMORY_NAMES = 1,      /* Interned names and their NameUsage */
+	MEMORY_LABEL_SETS = 2, /* Interned label sets */
+	MEMORY_INDEXES = 3,    /* Series indexes and label pairs */
+	NUM_MEMORY_KINDS = 4
+} MemoryKind;
+
+typedef struct {
+	pg_atomic_uint64 bytes;
+	pg_atomic_uint64 entries; /* Series, names, label sets or label pairs */
+} MemoryUsage;
+
+/* The shared dshash tables */
+typedef enum SharedTable {
+	TABLE_METRICS = 0,
+	TABLE_INTERNED = 1,
+	TABLE_LABEL_PAIRS = 2,
+	NUM_SHARED_TABLES = 3
+} SharedTable;
+
+/*
+ * Entry counts of a shared table, used to follow the size of its bucket
+ * array, which dshash doesn't expose, see count_table_entry(). Each partition
+ * count is protected by the matching dshash partition lock.
+ */
+typedef struct {
+	pg_atomic_uint64 entries;
+	pg_atomic_uint32 size_log2; /* Of the bucket array, never shrinks */
+	uint32 partition_counts[1 << DSHASH_PARTITIONS_LOG2];
+} TableUsage;
+
 /* Shared state stored in static shared memory */
 typedef struct PMetricsSharedState {
+	/*
+	 * Generation from which updates stamp Metric.modified, 0 until something
+	 * reads it, see track_changes(). Alone on its cache line since every
+	 * update reads it.
+	 */
+	union {
+		pg_atomic_uint64 value;
+		char pad[PG_CACHE_LINE_SIZE];
+	} tracked_since;
 	dsa_handle dsa;
 	dshash_table_handle metrics_handle;
+	dshash_table_handle interned_handle;
+	dshash_table_handle label_pairs_handle; /* With pmetrics.index_labels */
+	pg_atomic_uint64 next_interned_id;
+	pg_atomic_uint64 snapshot_generation; /* Of the last snapshot taken */
+	MemoryUsage memory[NUM_MEMORY_KINDS]; /* See account_memory() */
+	TableUsage tables[NUM_SHARED_TABLES];
+	pg_atomic_flag evicting;              /* Set while a backend evicts */
+	pg_atomic_uint32 last_eviction;       /* Seconds since the epoch */
+	pg_atomic_uint64 series_removed;      /* Series deleted or evicted */
 	LWLock *init_lock;
 	bool initialized;
 } PMetricsSharedState;
 
-typedef enum LabelsLocation {
-	LABELS_NONE = 0,  /* No labels (empty JSONB or null) */
-	LABELS_LOCAL = 1, /* labels.local_ptr is valid (search key) */
-	LABELS_DSA = 2    /* labels.dsa_ptr is valid (stored key) */
-} LabelsLocation;
+/* Per-backend state in static shared memory, indexed by MyProcNumber */
+typedef struct PMetricsBackendState {
+	/* Time of the oldest buffered update not yet flushed, 0 if none */
+	pg_atomic_uint64 pending_since;
+} PMetricsBackendState;
+
+/* Padded to a cache line since each backend writes its own slot */
+typedef union PMetricsBackendSlot {
+	PMetricsBackendState state;
+	char pad[PG_CACHE_LINE_SIZE];
+} PMetricsBackendSlot;
+
+/* Kinds of interned values */
+typedef enum InternedKind {
+	INTERNED_NAME = 1,      /* NUL-terminated metric name */
+	INTERNED_LABELS = 2,    /* JSONB label set */
+	INTERNED_LABEL_PAIR = 3 /* JSONB object with one scalar label */
+} InternedKind;
+
+typedef enum InternedLocation {
+	INTERNED_LOCAL = 1, /* value.local_ptr is valid (search key) */
+	INTERNED_DSA = 2    /* value.dsa_ptr is valid (stored key) */
+} InternedLocation;
 
+/*
+ * Key of the interned value dictionary: the value itself. hash is computed
+ * once from the value and kept in stored keys, so probes only look at values
+ * whose hash matches.
+ */
 typedef struct {
-	char name[NAMEDATALEN];
-	LabelsLocation labels_location;
+	InternedKind kind;
+	InternedLocation location;
 	union {
-		dsa_pointer dsa_ptr; /* When LABELS_DSA */
-		Jsonb *local_ptr;    /* When LABELS_LOCAL */
-	} labels;
+		dsa_pointer dsa_ptr;   /* When INTERNED_DSA */
+		const void *local_ptr; /* When INTERNED_LOCAL */
+	} value;
+	uint64 hash;
+} InternedKey;
+
+/*
+ * An index entry. In the series index of a name or label set, id is the id
+ * of the other half of the series key and type its type. In the posting list
+ * of a label pair, id and value are the id and interned copy of a label set.
+ */
+typedef struct {
+	uint64 id;         /* Next free slot, or -1, when free */
+	dsa_pointer value; /* Posting lists only */
+	int type;          /* MetricType, or FREE_INDEX_SLOT */
+} IndexSlot;
+
+/*
+ * A growable DSA array of IndexSlots, protected by the lock of the entry
+ * holding it. Slots never move: whoever adds one keeps its number to remove
+ * it later, and freed slots are chained in a free list for reuse.
+ */
+typedef struct {
+	dsa_pointer slots; /* InvalidDsaPointer until first used */
+	int capacity;      /* Allocated slots */
+	int used;          /* Slots used so far, live or free */
+	int live;          /* Slots not free */
+	int free_slot;     /* First free slot, -1 if none */
+} SlotIndex;
+
+/*
+ * An interned name or label set. refcount counts the metric entries and
+ * removal log records using it and is protected by the partition lock; the
+ * value is freed when it drops to zero.
+ *
+ * Names and label sets also index the series that use them, so these can be
+ * found without scanning the metrics table. With pmetrics.index_labels, label
+ * sets are also in the posting list of each of their scalar labels, see
+ * LabelPairEntry, and pair_slots holds their slot in each, in the order of
+ * the labels. An error can leave only the first indexed_pairs of them indexed,
+ * see index_label_pairs().
+ */
+typedef struct {
+	InternedKey key;
+	uint64 id;
+	int64 refcount;
+	SlotIndex series;
+	dsa_pointer pair_slots; /* int array, InvalidDsaPointer if none */
+	int indexed_pairs;      /* Slots of pair_slots filled in */
+	bool pairs_indexed;     /* In all the posting lists of its labels */
+	dsa_pointer usage;      /* NameUsage of names, InvalidDsaPointer if not */
+} InternedEntry;
+
+/*
+ * Figures of a metric name for memory_stats(), kept up to date by its series
+ * without taking locks. Allocated with the interned name, so its series can
+ * update it through their name_usage pointer.
+ */
+typedef struct {
+	pg_atomic_uint64 label_bytes; /* Sizes of the label sets of its series */
+	pg_atomic_uint32 last_update; /* Latest last_update of its series */
+} NameUsage;
+
+/*
+ * A scalar label, as a JSONB object with that single key, and the label sets
+ * containing it. Entries are removed with their last label set.
+ */
+typedef struct {
+	InternedKey key; /* Kind INTERNED_LABEL_PAIR */
+	SlotIndex postings;
+} LabelPairEntry;
+
+/* Series key, made of the ids of the interned name and labels */
+typedef struct {
+	uint64 name_id;
+	uint64 labels_id; /* NO_LABELS_ID when there are no labels */
 	MetricType type;
-	int bucket; /* Only used for histograms, 0 for counter/gauge */
 } MetricKey;
 
+/*
+ * Backend-local description of a series, used to find or create it.
+ *
+ * key holds the ids of name and labels as last seen by this backend, or
+ * UNKNOWN_INTERNED_ID. An id can be stale if its value was freed and interned
+ * again since, so ids are only trusted to find existing series; creating one
+ * always interns name and labels again.
+ */
+typedef struct {
+	MetricKey key; /* First, so a search can be used as a hash key */
+	char name[NAMEDATALEN];
+	Jsonb *labels;
+} MetricSearch;
+
+/* Backend-local cache entry mapping a value to its id */
+typedef struct {
+	InternedKey key; /* Local, copied to interned_cache_context */
+	uint64 id;
+} CachedInterned;
+
+/*
+ * A stored metric. Cells are atomic so existing series can be updated under a
+ * shared partition lock, or without any lock through a handle. Counters and
+ * gauges keep their cell in value, histograms in a DSA array pointed to by
+ * cells.
+ *
+ * Sharded series also have one cache-line-aligned copy of their cells per
+ * backend. Each backend adds to its own copy and readers sum them all. Cell
+ * arrays are allocated with the entry and live as long as it does.
+ *
+ * handle_refs counts the handles pinning this entry and is protected by the
+ * partition lock. While it is non-zero the entry is never removed from the
+ * table, so handles can keep a pointer to it. Deleting a pinned entry turns it
+ * into a tombstone instead: it is reset, marked deleted and hidden from
+ * readers until it is written to again or the last handle goes away.
+ */
 typedef struct {
 	MetricKey key;
-	int64 value;
+	pg_atomic_uint64 value;
+	dsa_pointer name;   /* Interned name */
+	dsa_pointer labels; /* Interned JSONB, InvalidDsaPointer if none */
+	dsa_pointer cells;  /* InvalidDsaPointer unless histogram */
+	dsa_pointer shards; /* InvalidDsaPointer unless sharded */
+	int name_slot;      /* Slot in the series index of the name */
+	int labels_slot;    /* Same for the labels, if any */
+	pg_atomic_uint32 last_update; /* See touch_metric() */
+	pg_atomic_uint64 modified;    /* Same, as a snapshot generation */
+	dsa_pointer name_usage;       /* NameUsage of the name */
+	int handle_refs;
+	bool deleted;
 } Metric;
 
+/*
+ * A removed series, see log_removal(). It keeps a reference on its name and
+ * label set until its slot is reused.
+ */
+typedef struct {
+	MetricKey key;
+	dsa_pointer name;
+	dsa_pointer labels; /* InvalidDsaPointer if none */
+	uint64 modified;    /* Generation it was removed in, see touch_metric() */
+} RemovedSeries;
+
+/*
+ * Ring of the last REMOVAL_LOG_SIZE removed series in static shared memory,
+ * protected by lock. lost is the latest generation of the records
+ * overwritten so far.
+ */
+typedef struct {
+	LWLock *lock;
+	uint64 next; /* Records written so far */
+	uint64 lost;
+	RemovedSeries records[REMOVAL_LOG_SIZE];
+} RemovalLog;
+
+/* Backend-local buffered update, see pmetrics.flush_interval_ms */
+typedef struct {
+	MetricSearch search; /* Labels copied to pending_context */
+	bool dirty;          /* Anything to flush? */
+	int64 delta;   /* Value, or sum for histograms */
+	int64 *bucket_deltas; /* Histograms only, one per bucket index */
+} PendingDelta;
+
+
+/* One update of pmetrics_apply_batch(), with its series resolved */
+typedef struct {
+	const PMetricsBatchOp *op;
+	MetricSearch search;
+	int bucket_index; /* Histograms only */
+	uint32 partition;
+	int order; /* Position in the batch */
+} BatchItem;
+
+/* One row of hash_table_stats() output */
+typedef struct {
+	const char *table;
+	int64 entries;
+	int64 distinct_hashes;   /* Distinct 32-bit hashes */
+	int64 colliding_entries; /* Entries sharing their hash with another */
+	int used_partitions;     /* dshash partitions holding entries */
+	int64 min_partition;     /* Entries of the least loaded of them */
+	int64 max_partition;     /* And of the most loaded */
+} HashTableStats;
+
+/*
+ * Start of a metrics dump file. It is followed by records, each a tag byte
+ * and varint-encoded fields (signed values zigzag-encoded first):
+ *
+ * DUMP_NAME, id, length, name bytes
+ * DUMP_LABELS, id, length, JSONB label set
+ * DUMP_SERIES, name id, labels id (NO_LABELS_ID if none), type, value or,
+ *   for histograms, sum, count of non-empty buckets and (bucket index,
+ *   count) for each
+ * DUMP_END, followed by the CRC-32C of everything before it
+ *
+ * Ids are the interned ids at the time of the dump, only used to tie series
+ * to the names and label sets, written right before their first series.
+ * Histogram bucket indexes depend on the bucket settings, which are recorded
+ * to detect changes.
+ */
+typedef struct {
+	uint32 magic;
+	uint32 version;
+	double bucket_variability;
+	int32 max_bucket_exp;
+	TimestampTz checkpoint; /* Start of this full dump, or of the one a
+	                         * checkpoint delta applies to */
+} DumpHeader;
+
+typedef enum DumpTag {
+	DUMP_NAME = 'N',
+	DUMP_LABELS = 'L',
+	DUMP_SERIES = 'S',
+	DUMP_END = 'E'
+} DumpTag;
+
+/* Records are encoded to buf and written to the file in large chunks */
+typedef struct {
+	FILE *file;
+	StringInfoData buf;
+	pg_crc32c crc;        /* Of everything written so far */
+	int64 *bucket_counts; /* Scratch space for one histogram */
+	HTAB *written;        /* Ids of the names and label sets written */
+} DumpWriter;
+
+/* Cursor over a dump file read into memory */
+typedef struct {
+	const uint8 *data;
+	Size len;
+	Size pos;
+	bool failed; /* Set when reading past the end */
+} DumpReader;
+
+/* Name or label set of a dump being loaded, by its id in the dump */
+typedef struct {
+	uint64 dump_id;
+	InternedKind kind;
+	InternedKey key; /* Stored key, see load_interned() */
+	uint64 id;       /* Interned id */
+	bool sharded;    /* Names listed in pmetrics.sharded_metrics */
+} LoadedInterned;
+
+/* What the checkpointer knows of the files it wrote, see write_checkpoint() */
+typedef struct {
+	TimestampTz checkpoint; /* Start of the full checkpoint, 0 if none yet */
+	uint64 since;           /* Snapshot generation it was written in */
+	uint64 removed;         /* series_removed when it started */
+	int64 full_series;      /* Series in the full checkpoint */
+	int64 delta_series;     /* Series in the last delta */
+} CheckpointState;
+
+/* One per-name row of memory_stats() output */
+typedef struct {
+	char *name;
+	int64 series;
+	int64 label_bytes;
+	uint32 last_update; /* 0 if never updated */
+} NameStats;
+
+/* Bit of a row type in MetricFilter.row_types */
+#define METRIC_TYPE_BIT(type) (1 << (type))
+#define ALL_METRIC_TYPES                                                       \
+	(METRIC_TYPE_BIT(METRIC_TYPE_COUNTER) |                                    \
+	 METRIC_TYPE_BIT(METRIC_TYPE_GAUGE) |                                      \
+	 METRIC_TYPE_BIT(METRIC_TYPE_HISTOGRAM) |                                  \
+	 METRIC_TYPE_BIT(METRIC_TYPE_HISTOGRAM_SUM))
+
+/* Keys of series found through the series index of their names */
+typedef struct {
+	MetricKey *keys;
+	int64 count;
+	int64 capacity;
+} SeriesList;
+
+/*
+ * Which list_metrics() rows to return. series holds the series of the
+ * matching names, which are looked up one by one instead of scanning the
+ * table, NULL to accept any name. Labels are matched through the ids of the
+ * interned label sets that match, NULL to accept any.
+ */
+typedef struct {
+	SeriesList *series;
+	HTAB *labels_ids;
+	uint32 row_types;      /* METRIC_TYPE_BITs */
+	uint64 modified_since; /* Generation, 0 to accept any series */
+	uint64 removed_since;  /* Generation, 0 for no removed series */
+} MetricFilter;
+
+/* A list_metrics() row copied out of shared memory */
+typedef struct {
+	Datum name;   /* Text */
+	Datum labels; /* Jsonb, 0 if none */
+	MetricType type;
+	int bucket;
+	int64 value;
+	bool removed; /* Series removed since filter->removed_since */
+} SnapshotRow;
+
+/*
+ * Local copy of an interned value, by id: unlike DSA pointers, ids are never
+ * reused even if the value is freed during the snapshot.
+ */
+typedef struct {
+	uint64 id;
+	Datum datum;
+} SnapshotValue;
+
+/*
+ * Rows of a set of series copied out of shared memory, see take_snapshot().
+ * generation numbers the call that took it: each one gets the next value of
+ * a shared counter. It tells snapshots apart and orders them, but doesn't
+ * make a snapshot a point-in-time view across series.
+ *
+ * With rsinfo set, the rows copied so far are written to its tuplestore and
+ * dropped each time they pass work_mem, see flush_snapshot(), so rows only
+ * holds part of the snapshot.
+ */
+typedef struct {
+	SnapshotRow *rows;
+	int64 count;
+	int64 capacity;
+	HTAB *values; /* SnapshotValues of the names and label sets */
+	MemoryContext values_context; /* Of values and the copies in it */
+	Size value_bytes;             /* Size of the copies */
+	uint64 generation;
+	ReturnSetInfo *rsinfo; /* NULL to keep every row */
+	bool with_generation;  /* Rows have a leading generation column */
+	bool with_removed;     /* And a trailing removed column */
+} MetricSnapshot;
+
+/* Values of an export_binary() dictionary, numbered from 0 */
+typedef struct {
+	HTAB *indexes; /* ExportIndexes, by snapshot copy */
+	Datum *values;
+	uint32 count;
+	uint32 capacity;
+} ExportDictionary;
+
+typedef struct {
+	Datum value;
+	uint32 index;
+} ExportIndex;
+
+/* A series of an export_binary() snapshot */
+typedef struct {
+	int64 last_row; /* Of the series in the snapshot, the sum of histograms */
+	int64 value;    /* Value, or sum for histograms */
+	uint32 name;    /* Dictionary indexes */
+	uint32 labels;  /* EXPORT_NO_LABELS if none */
+	MetricType type;
+} ExportSeries;
+
+/* Bytes of an export_binary() output not returned yet */
+typedef struct {
+	ReturnSetInfo *rsinfo;
+	StringInfoData buf; /* Starts with room for a varlena header */
+	uint64 offset;      /* Bytes of the export written so far */
+} ExportWriter;
+
+/*
+ * Backend-local handle for a single series (see pmetrics.h), pinning its
+ * entry.
+ */
+struct PMetricsHandle {
+	dlist_node node;     /* In handles list */
+	MetricSearch search; /* Labels copied to TopMemoryContext */
+	Metric *entry;
+};
+
 static PMetricsSharedState *shared_state = NULL;
+static PMetricsBackendSlot *backend_slots = NULL;
+static RemovalLog *removal_log = NULL;
 
 /* Backend-local state (not in shared memory) */
 static dsa_area *local_dsa = NULL;
 static dshash_table *local_metrics_table = NULL;
+static dshash_table *local_interned_table = NULL;
+static dshash_table *local_label_pairs_table = NULL; /* NULL if not indexed */
+
+/* Ids of names and label sets seen by this backend, created on first use */
+static MemoryContext interned_cache_context = NULL;
+static HTAB *interned_cache = NULL;
+
+/* Handles created by this backend, released on backend exit */
+static dlist_head handles = DLIST_STATIC_INIT(handles);
+
+/* Buffered updates, created on first use */
+static MemoryContext pending_context = NULL;
+static HTAB *pending_deltas = NULL;
+static TimestampTz pending_since = 0;
 
 /* Hooks */
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
@@ -105,33 +695,319 @@ static shmem_request_hook_type prev_shmem_request_hook = NULL;
 static bool pmetrics_enabled = DEFAULT_ENABLED;
 static double bucket_variability = DEFAULT_BUCKET_VARIABILITY;
 static int buckets_upper_bound = DEFAULT_BUCKETS_UPPER_BOUND;
+static int flush_interval_ms = DEFAULT_FLUSH_INTERVAL_MS;
+static char *sharded_metrics = NULL;
+static const char *sharded_names = NULL; /* See check_sharded_metrics() */
+static bool index_labels = DEFAULT_INDEX_LABELS;
+static int max_series = DEFAULT_MAX_SERIES;
+static int max_memory_mb = DEFAULT_MAX_MEMORY_MB;
+static int max_series_per_name = DEFAULT_MAX_SERIES_PER_NAME;
+static int eviction_policy = DEFAULT_EVICTION;
+static bool save_metrics_on_shutdown = DEFAULT_SAVE;
+static int checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+static int http_port = DEFAULT_HTTP_PORT;
+static char *http_listen_address = NULL;
+
+/* Connection the HTTP worker is serving, closed if serving it fails */
+static pgsocket http_client = PGINVALID_SOCKET;
+
+/* Labels of overflow series, built on first use in TopMemoryContext */
+static Jsonb *overflow_labels = NULL;
 
 static double gamma_val = 0;
 static double log_gamma = 0;
+static int max_bucket_exp = 0;
+
+/*
+ * Upper bound of each bucket index, and the lowest index sharing that bound.
+ * Small indexes round to the same integer bound; observations for them all go
+ * to the lowest one so each bound has a single count.
+ */
+static int *bucket_bounds = NULL;
+static int *bucket_cells = NULL;
+
+/*
+ * Bucket lookup tables, see bucket_index_for(). bucket_thresholds[i] is the
+ * smallest value whose bucket index is at least i, for i up to
+ * max_bucket_exp + 1 (anything from there on is clamped). binade_first[e] and
+ * binade_last[e] are the bucket indexes of 2^e and of the largest double
+ * below 2^(e + 1).
+ */
+static double *bucket_thresholds = NULL;
+static int *binade_first = NULL;
+static int *binade_last = NULL;
 
 /* Function declarations */
 void _PG_init(void);
+PGDLLEXPORT void pmetrics_checkpointer_main(Datum main_arg);
+PGDLLEXPORT void pmetrics_http_main(Datum main_arg);
+static void register_worker(const char *name, const char *function);
 static void metrics_shmem_request(void);
 static void metrics_shmem_startup(void);
 static dshash_table *get_metrics_table(void);
 static void cleanup_metrics_backend(int code, Datum arg);
+static void attach_shared_tables(void);
+static void detach_shared_tables(void);
+static void save_metrics_at_exit(int code, Datum arg);
+static void write_checkpoint(CheckpointState *state);
+static bool save_metrics(const char *path, TimestampTz checkpoint,
+                         uint64 since, int64 *count);
+static bool open_dump(DumpWriter *writer, const char *path);
+static bool close_dump(DumpWriter *writer, const char *path);
+static void dump_flush(DumpWriter *writer);
+static void dump_put_varint(DumpWriter *writer, uint64 value);
+static void dump_put_signed(DumpWriter *writer, int64 value);
+static void dump_interned(DumpWriter *writer, InternedKind kind, uint64 id,
+                          dsa_pointer value);
+static void dump_series(DumpWriter *writer, Metric *entry);
+static void load_metrics(void);
+static void load_dump(const uint8 *data, Size size, const char *path);
+static uint8 *read_dump(const char *path, Size *size);
+static bool valid_dump(const uint8 *data, Size size, const char *path);
+static uint64 dump_get_varint(DumpReader *reader);
+static int64 dump_get_signed(DumpReader *reader);
+static const uint8 *dump_get_bytes(DumpReader *reader, Size len);
+static void load_interned(DumpReader *reader, InternedKind kind,
+                          HTAB *loaded);
+static bool load_series(DumpReader *reader, HTAB *loaded, bool histograms,
+                        int64 *limited);
+static void ref_loaded(const LoadedInterned *loaded);
 static void validate_inputs(const char *name);
-static void init_metric_key(MetricKey *key, const char *name,
-                            Jsonb *labels_jsonb, MetricType type, int bucket);
-static int bucket_for(double value);
+static void init_metric_search(MetricSearch *search, const char *name,
+                               Jsonb *labels_jsonb, MetricType type);
+static bool metric_search_known(const MetricSearch *search);
+static void init_bucket_bounds(void);
+static int bucket_index_reference(double value);
+static double bucket_threshold(int index);
+static int bucket_index_linear(double value);
+static int binade_of(double value);
+static int bucket_index_for(double value);
+static int bucket_upper_bound(int index);
+static void bucket_cell_range(int cell, double *lower, double *upper);
+static int64 copy_bucket_counts(Metric *entry, int64 *counts);
+static void estimate_quantiles(const int64 *counts, int64 total,
+                               const double *quantiles, int nquantiles,
+                               Datum *estimates);
+static double *get_quantiles_arg(FunctionCallInfo fcinfo, int arg,
+                                 int *nquantiles);
+static bool check_sharded_metrics(char **newval, void **extra,
+                                  GucSource source);
+static void assign_sharded_metrics(const char *newval, void *extra);
+static bool metric_is_sharded(const MetricSearch *search);
+static bool name_is_sharded(const char *name);
+static int metric_ncells(MetricType type);
+static Size cells_stride(int ncells);
+static pg_atomic_uint64 *metric_cells(Metric *entry, int backend);
+static int64 metric_add(Metric *entry, int cell, int64 amount);
+static void metric_set(Metric *entry, int64 value);
+static void touch_metric(Metric *entry);
+static uint64 next_generation(void);
+static uint64 track_changes(void);
+static uint32 coarse_time(void);
+static NameUsage *name_usage(Metric *entry);
+static Size metric_memory(MetricType type, bool sharded);
+static void account_memory(MemoryKind kind, int entries, int64 bytes);
+static uint64 memory_used(void);
+static int64 partition_capacity(int size_log2);
+static MemoryKind interned_memory_kind(InternedKind kind);
+static void count_table_entry(SharedTable table, uint32 hash, int delta);
+static int64 metric_cell_value(Metric *entry, int cell);
+static int metric_row_count(Metric *entry);
+static void reset_metric_value(Metric *entry);
+static void free_metric(Metric *entry);
+static bool alloc_metric_cells(MetricType type, bool sharded,
+                               dsa_pointer *cells, dsa_pointer *shards);
+static void free_metric_cells(dsa_pointer cells, dsa_pointer shards);
+static void init_metric(dshash_table *table, Metric *entry, dsa_pointer name,
+                        dsa_pointer labels, dsa_pointer cells,
+                        dsa_pointer shards);
+static void series_oom_error(void);
+static void revive_metric(Metric *entry);
+static void ref_search_values(const MetricSearch *search, MetricKey *key,
+                              dsa_pointer *name, dsa_pointer *labels);
+static void unref_metric_values(dsa_pointer name, dsa_pointer labels);
+static Metric *find_live_metric(dshash_table *table,
+                                const MetricSearch *search);
+static Metric *insert_metric(dshash_table *table, const MetricSearch *search,
+                             MetricKey *key, bool limited);
+static Jsonb *get_overflow_labels(void);
+static bool series_limit_reached(dsa_pointer name);
+static bool name_limit_reached(dsa_pointer name);
+static bool global_limit_reached(void);
+static void evict_idle_series(void);
+static void evict_least_recently_updated(dshash_table *table);
+static bool evictable_metric(const Metric *entry, uint64 overflow_id);
+static int compare_update_times(const void *a, const void *b);
+static void log_removal(Metric *entry);
+static void forget_removals(void);
+static int remove_metric(dshash_table *table, dshash_seq_status *status,
+                         Metric *entry, bool logged);
+static int64 remove_series(dshash_table *table, const SeriesList *series,
+                           bool logged);
+static Metric *pin_metric(dshash_table *table, MetricSearch *search);
+static void unpin_metric(dshash_table *table, const MetricSearch *search);
+static PMetricsHandle *create_handle(const char *name_str, Jsonb *labels_jsonb,
+                                     MetricType type);
+static Metric *handle_entry(PMetricsHandle *handle);
+static int num_backend_states(void);
+static uint32 *collect_hashes(dshash_table *table,
+                              const dshash_parameters *params,
+                              HashTableStats *stats);
+static void count_partition(HashTableStats *stats, int64 entries);
+static void count_hash_collisions(HashTableStats *stats, uint32 *hashes);
+static int compare_hashes(const void *a, const void *b);
+static NameStats *collect_name_stats(int64 *count);
+static void put_memory_row(ReturnSetInfo *rsinfo, const char *kind,
+                           const char *name, int64 entries, int64 bytes,
+                           uint32 last_update);
+static const char *metric_type_name(MetricType type);
+static void put_metric_row(ReturnSetInfo *rsinfo, const SnapshotRow *row,
+                           const MetricSnapshot *snapshot);
+static Datum snapshot_value(MetricSnapshot *snapshot, InternedKind kind,
+                            uint64 id, dsa_pointer value);
+static SnapshotRow *add_snapshot_row(MetricSnapshot *snapshot);
+static void snapshot_metric(MetricSnapshot *snapshot, Metric *metric,
+                            uint32 row_types);
+static void scan_series_keys(dshash_table *table, const MetricFilter *filter,
+                             SeriesList *series);
+static void take_snapshot(MetricSnapshot *snapshot, const MetricFilter *filter,
+                          ReturnSetInfo *rsinfo);
+static void init_snapshot_values(MetricSnapshot *snapshot);
+static bool snapshot_full(const MetricSnapshot *snapshot);
+static void flush_snapshot(MetricSnapshot *snapshot);
+static void snapshot_removals(MetricSnapshot *snapshot, uint64 since);
+static void put_matching_metrics(ReturnSetInfo *rsinfo,
+                                 const MetricFilter *filter,
+                                 bool with_generation, bool with_removed);
+static HTAB *match_interned_ids(InternedKind kind,
+                                bool (*match)(const void *value, Datum arg),
+                                Datum arg, SeriesList *series);
+static bool name_matches_pattern(const void *value, Datum pattern);
+static bool labels_contain(const void *value, Datum labels);
+static void match_names(text *pattern, SeriesList *series);
+static uint32 parse_row_types(Datum *elems, int nelems);
+static MetricType metric_family(MetricType type);
+static int compare_exposition_rows(const void *a, const void *b);
+static int compare_names(const text *a, const text *b);
+static int compare_labels(const void *a, const void *b);
+static void append_prometheus_name(StringInfo out, const char *name, int len,
+                                   bool metric);
+static void append_prometheus_value(StringInfo out, const char *value,
+                                    int len);
+static void append_prometheus_labels(StringInfo out, Datum labels_datum,
+                                     bool histogram);
+static void append_prometheus_sample(StringInfo out, const StringInfo name,
+                                     const char *suffix,
+                                     const StringInfo labels, const char *le,
+                                     int64 value);
+static int64 append_prometheus_histogram(StringInfo out, SnapshotRow **rows,
+                                         int64 first, int64 count,
+                                         const StringInfo name,
+                                         const StringInfo labels);
+static void render_prometheus(StringInfo out);
+static char *label_value_text(const JsonbValue *value, int *len);
+static void init_export_dictionary(ExportDictionary *dictionary,
+                                   const char *name);
+static uint32 export_dictionary_index(ExportDictionary *dictionary,
+                                      Datum value);
+static void export_put(ExportWriter *writer, const void *data, Size len);
+static void export_put_uint32(ExportWriter *writer, uint32 value);
+static void export_put_uint64(ExportWriter *writer, uint64 value);
+static void export_put_string(ExportWriter *writer, const char *value,
+                              int len);
+static void export_pad(ExportWriter *writer);
+static void export_flush(ExportWriter *writer);
+static void export_put_labels(ExportWriter *writer, Datum labels_datum);
+static int export_bucket_index(const int32 *bounds, int nbounds, int bound);
+static pgsocket open_http_socket(void);
+static void serve_http_client(pgsocket listen_socket);
+static void append_http_response(StringInfo response, const char *status,
+                                 const StringInfo body, bool head);
+static bool send_all(pgsocket sock, const char *data, Size len,
+                     TimestampTz deadline);
+static bool wait_http_client(pgsocket sock, int events, TimestampTz deadline);
+static void close_http_client(void);
+static MetricType batch_op_metric_type(const PMetricsBatchOp *op);
+static void validate_batch_op(const PMetricsBatchOp *op);
+static void apply_batch_op(Metric *entry, const BatchItem *item);
+static int compare_batch_items(const void *a, const void *b);
+static bool buffering_enabled(void);
 static int64 increment_by(const char *name_str, Jsonb *labels_jsonb,
-                          MetricType type, int bucket, int64 amount);
+                          MetricType type, int64 amount, bool *buffered);
+static int64 record_observation(const char *name_str, Jsonb *labels_jsonb,
+                                double value, bool *buffered);
+static int64 apply_delta(const MetricSearch *search, int64 amount);
+static int64 apply_observation(const MetricSearch *search, int bucket_index,
+                               int64 value);
+static PendingDelta *pending_delta_for(const MetricSearch *search);
+static void note_pending_update(void);
+static int64 buffer_delta(const MetricSearch *search, int64 amount);
+static int64 buffer_observation(const MetricSearch *search, int bucket_index,
+                                int64 value);
+static void discard_pending_delta(const MetricSearch *search);
+static void flush_pending_deltas(void);
+static void pmetrics_xact_callback(XactEvent event, void *arg);
+static uint32 pending_delta_hash(const void *key, Size keysize);
+static int pending_delta_match(const void *key1, const void *key2,
+                               Size keysize);
 static int64 delete_metrics_by_name_labels(const char *name_str,
                                            Jsonb *labels_jsonb);
+static int64 delete_metrics_by_name(const char *name_str);
+static int64 delete_metrics_matching_labels(Jsonb *labels_jsonb);
 static void extract_metric_args(FunctionCallInfo fcinfo, int name_arg,
                                 int labels_arg, char **name_out,
                                 Jsonb **labels_out);
-static Jsonb *get_labels_jsonb(const MetricKey *key, dsa_area *dsa);
+static int get_array_arg(FunctionCallInfo fcinfo, int arg, Oid elemtype,
+                         Datum **elems_out);
+static uint64 lookup_interned_id(InternedKind kind, const void *value,
+                                 bool use_cache);
+static dsa_pointer ref_interned(InternedKind kind, const void *value,
+                                uint64 *id);
+static void unref_interned(InternedKind kind, dsa_pointer value);
+static void ref_stored_interned(InternedKind kind, dsa_pointer value);
+static InternedEntry *find_stored_interned(InternedKind kind,
+                                           dsa_pointer value, bool exclusive);
+static int index_series(InternedKind kind, dsa_pointer value, uint64 other_id,
+                        MetricType type, dsa_pointer *usage);
+static void unindex_series(InternedKind kind, dsa_pointer value, int slot);
+static bool find_interned_series(InternedKind kind, const void *value,
+                                 SeriesList *series);
+static void append_interned_series(SeriesList *series,
+                                   const InternedEntry *entry);
+static void init_slot_index(SlotIndex *index);
+static IndexSlot *index_slots(const SlotIndex *index);
+static int add_index_slot(SlotIndex *index, uint64 id, dsa_pointer value,
+                          int type);
+static void remove_index_slot(SlotIndex *index, int slot);
+static void free_slot_index(SlotIndex *index);
+static Jsonb **label_pairs(Jsonb *labels, int *npairs);
+static void index_label_pairs(InternedEntry *entry);
+static void unindex_label_pairs(InternedEntry *entry);
+static uint64 *read_posting_ids(Jsonb *pair, int *count);
+static int read_posting_values(Jsonb *pair, const uint64 *ids, int nids,
+                               Jsonb **values);
+static int intersect_ids(uint64 *ids, int nids, const uint64 *other,
+                         int nother);
+static int compare_ids(const void *a, const void *b);
+static void match_labels(Jsonb *labels, SeriesList *series);
+static void cache_interned_id(const InternedKey *key, uint64 id);
+static uint32 interned_cache_hash(const void *key, Size keysize);
+static int interned_cache_match(const void *key1, const void *key2,
+                                Size keysize);
+static void init_interned_key(InternedKey *key, InternedKind kind,
+                              const void *value);
+static const void *get_interned_value(const InternedKey *key, dsa_area *dsa);
+static Size interned_value_size(InternedKind kind, const void *value);
+static uint64 interned_value_hash(InternedKind kind, const void *value);
+static uint32 interned_hash_dshash(const void *key, size_t key_size,
+                                   void *arg);
+static int interned_compare_dshash(const void *a, const void *b,
+                                   size_t key_size, void *arg);
+static void interned_key_copy(void *dst, const void *src, size_t key_size,
+                              void *arg);
 static uint32 metric_hash_dshash(const void *key, size_t key_size, void *arg);
 static int metric_compare_dshash(const void *a, const void *b, size_t key_size,
                                  void *arg);
-static void metric_key_copy(void *dst, const void *src, size_t key_size,
-                            void *arg);
 
 /* dshash parameters (references function pointers declared above) */
 static const dshash_parameters metrics_params = {
@@ -139,16 +1015,44 @@ static const dshash_parameters metrics_params = {
     .entry_size = sizeof(Metric),
     .compare_function = metric_compare_dshash,
     .hash_function = metric_hash_dshash,
-    .copy_function = metric_key_copy,
+    .copy_function = dshash_memcpy,
     .tranche_id = LWTRANCHE_PMETRICS};
 
+static const dshash_parameters interned_params = {
+    .key_size = sizeof(InternedKey),
+    .entry_size = sizeof(InternedEntry),
+    .compare_function = interned_compare_dshash,
+    .hash_function = interned_hash_dshash,
+    .copy_function = interned_key_copy,
+    .tranche_id = LWTRANCHE_PMETRICS_INTERNED};
+
+static const dshash_parameters label_pairs_params = {
+    .key_size = sizeof(InternedKey),
+    .entry_size = sizeof(LabelPairEntry),
+    .compare_function = interned_compare_dshash,
+    .hash_function = interned_hash_dshash,
+    .copy_function = interned_key_copy,
+    .tranche_id = LWTRANCHE_PMETRICS_LABEL_PAIRS};
+
 static void metrics_shmem_request(void)
 {
 	if (prev_shmem_request_hook)
 		prev_shmem_request_hook();
 
 	RequestAddinShmemSpace(MAXALIGN(sizeof(PMetricsSharedState)));
+	RequestAddinShmemSpace(
+	    mul_size(num_backend_states(), sizeof(PMetricsBackendSlot)));
+	RequestAddinShmemSpace(MAXALIGN(sizeof(RemovalLog)));
 	RequestNamedLWLockTranche("pmetrics_init", 1);
+	RequestNamedLWLockTranche("pmetrics_removals", 1);
+}
+
+/*
+ * Number of per-backend slots: regular backends and auxiliary processes.
+ */
+static int num_backend_states(void)
+{
+	return MaxBackends + NUM_AUXILIARY_PROCS;
 }
 
 static void metrics_shmem_startup(void)
@@ -158,12 +1062,40 @@ static void metrics_shmem_startup(void)
 	if (prev_shmem_startup_hook)
 		prev_shmem_startup_hook();
 
+	/* Only postmaster saves the metrics, once every backend has exited */
+	if (!IsUnderPostmaster)
+		on_shmem_exit(save_metrics_at_exit, (Datum)0);
+
+	backend_slots = ShmemInitStruct(
+	    "pmetrics_backend_states",
+	    mul_size(num_backend_states(), sizeof(PMetricsBackendSlot)), &found);
+
+	if (!found) {
+		int i;
+
+		for (i = 0; i < num_backend_states(); i++)
+			pg_atomic_init_u64(&backend_slots[i].state.pending_since, 0);
+	}
+
+	removal_log = ShmemInitStruct("pmetrics_removal_log", sizeof(RemovalLog),
+	                              &found);
+
+	if (!found) {
+		removal_log->lock =
+		    &(GetNamedLWLockTranche("pmetrics_removals")[0].lock);
+		removal_log->next = 0;
+		removal_log->lost = 0;
+	}
+
 	shared_state = ShmemInitStruct("pmetrics_shared_state",
 	                               sizeof(PMetricsSharedState), &found);
 
 	if (!found) {
 		dsa_area *dsa;
 		dshash_table *metrics_table;
+		dshash_table *interned_table;
+		dshash_table *label_pairs_table = NULL;
+		int i;
 
 		dsa = dsa_create(LWTRANCHE_PMETRICS_DSA);
 		shared_state->dsa = dsa_get_handle(dsa);
@@ -178,15 +1110,59 @@ static void metrics_shmem_startup(void)
 		shared_state->metrics_handle =
 		    dshash_get_hash_table_handle(metrics_table);
 
+		interned_table = dshash_create(dsa, &interned_params, NULL);
+		shared_state->interned_handle =
+		    dshash_get_hash_table_handle(interned_table);
+		pg_atomic_init_u64(&shared_state->next_interned_id, NO_LABELS_ID + 1);
+		pg_atomic_init_u64(&shared_state->snapshot_generation, 0);
+		pg_atomic_init_u64(&shared_state->tracked_since.value, 0);
+		for (i = 0; i < NUM_MEMORY_KINDS; i++) {
+			pg_atomic_init_u64(&shared_state->memory[i].bytes, 0);
+			pg_atomic_init_u64(&shared_state->memory[i].entries, 0);
+		}
+		for (i = 0; i < NUM_SHARED_TABLES; i++) {
+			TableUsage *usage = &shared_state->tables[i];
+
+			pg_atomic_init_u64(&usage->entries, 0);
+			/* dshash starts with one bucket per partition */
+			pg_atomic_init_u32(&usage->size_log2, DSHASH_PARTITIONS_LOG2);
+			memset(usage->partition_counts, 0,
+			       sizeof(usage->partition_counts));
+		}
+		pg_atomic_init_flag(&shared_state->evicting);
+		pg_atomic_init_u32(&shared_state->last_eviction, 0);
+		pg_atomic_init_u64(&shared_state->series_removed, 0);
+
+		shared_state->label_pairs_handle = DSHASH_HANDLE_INVALID;
+		if (index_labels) {
+			label_pairs_table = dshash_create(dsa, &label_pairs_params, NULL);
+			shared_state->label_pairs_handle =
+			    dshash_get_hash_table_handle(label_pairs_table);
+		}
+
 		shared_state->init_lock =
 		    &(GetNamedLWLockTranche("pmetrics_init")[0].lock);
 		shared_state->initialized = true;
 
+		/* Restore the series saved at the last shutdown, if any */
+		local_dsa = dsa;
+		local_metrics_table = metrics_table;
+		local_interned_table = interned_table;
+		local_label_pairs_table = label_pairs_table;
+		load_metrics();
+		local_dsa = NULL;
+		local_metrics_table = NULL;
+		local_interned_table = NULL;
+		local_label_pairs_table = NULL;
+
 		/*
 		 * Detach from postmaster so backends don't inherit the attachment
 		 * state. The DSA is pinned so it won't be destroyed.
 		 */
+		if (label_pairs_table != NULL)
+			dshash_detach(label_pairs_table);
 		dshash_detach(metrics_table);
+		dshash_detach(interned_table);
 		dsa_detach(dsa);
 
 		elog(DEBUG1, "pmetrics: initialized with DSA handle %lu",
@@ -196,8 +1172,6 @@ static void metrics_shmem_startup(void)
 
 void _PG_init(void)
 {
-	int max_bucket_exp;
-
 	/*
 	 * Must be loaded via shared_preload_libraries since we allocate shared
 	 * memory and register hooks. Fail if loaded any other way.
@@ -230,21 +1204,141 @@ void _PG_init(void)
 	    &buckets_upper_bound, DEFAULT_BUCKETS_UPPER_BOUND, 1, INT_MAX,
 	    PGC_POSTMASTER, 0, NULL, NULL, NULL);
 
+	DefineCustomIntVariable(
+	    "pmetrics.flush_interval_ms",
+	    "Maximum time updates stay buffered in a backend (0 to disable)",
+	    "When set, increments, gauge additions and histogram observations are "
+	    "accumulated in backend-local memory and merged into shared memory at "
+	    "transaction end or once the oldest buffered update is this old.",
+	    &flush_interval_ms, DEFAULT_FLUSH_INTERVAL_MS, 0, MAX_FLUSH_INTERVAL_MS,
+	    PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomStringVariable(
+	    "pmetrics.sharded_metrics",
+	    "Counter and histogram names stored with one slot per backend",
+	    "Comma-separated list of metric names. Updates to their series go to "
+	    "a per-backend slot and readers sum all slots, so very hot series "
+	    "don't bounce a cache line between backends. Applies to series "
+	    "created after the change.",
+	    &sharded_metrics, DEFAULT_SHARDED_METRICS, PGC_SIGHUP, GUC_LIST_INPUT,
+	    check_sharded_metrics, assign_sharded_metrics, NULL);
+
+	DefineCustomBoolVariable(
+	    "pmetrics.index_labels", "Index label sets by their scalar labels",
+	    "Keeps a posting list of the label sets containing each scalar label, "
+	    "used to find the series matching a set of labels without checking "
+	    "every label set. Requires restart.",
+	    &index_labels, DEFAULT_INDEX_LABELS, PGC_POSTMASTER, 0, NULL, NULL,
+	    NULL);
+
+	DefineCustomIntVariable(
+	    "pmetrics.max_series", "Maximum number of series (0 for no limit)",
+	    "Updates that would create a series past this limit go to the "
+	    "overflow series of their metric name instead.",
+	    &max_series, DEFAULT_MAX_SERIES, 0, INT_MAX, PGC_SIGHUP, 0, NULL,
+	    NULL, NULL);
+
+	DefineCustomIntVariable(
+	    "pmetrics.max_memory",
+	    "Maximum shared memory used by series (0 for no limit)",
+	    "Counts series, names, label sets and their indexes. Updates that "
+	    "would create a series past this limit go to the overflow series of "
+	    "their metric name instead.",
+	    &max_memory_mb, DEFAULT_MAX_MEMORY_MB, 0, INT_MAX, PGC_SIGHUP,
+	    GUC_UNIT_MB, NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+	    "pmetrics.max_series_per_name",
+	    "Maximum number of series of a metric name (0 for no limit)",
+	    "Updates that would create a series of a name past this limit go to "
+	    "the overflow series of the name instead.",
+	    &max_series_per_name, DEFAULT_MAX_SERIES_PER_NAME, 0, INT_MAX,
+	    PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomEnumVariable(
+	    "pmetrics.eviction", "Eviction policy when a series limit is reached",
+	    "With least_recently_updated, reaching pmetrics.max_series or "
+	    "pmetrics.max_memory removes the series not updated for the longest "
+	    "time to make room. With none, new series go to overflow series.",
+	    &eviction_policy, DEFAULT_EVICTION, eviction_options, PGC_SIGHUP, 0,
+	    NULL, NULL, NULL);
+
+	DefineCustomBoolVariable(
+	    "pmetrics.save", "Save metrics across server shutdowns",
+	    "When enabled, series are written to disk at shutdown and loaded "
+	    "back at the next start. Not after a crash.",
+	    &save_metrics_on_shutdown, DEFAULT_SAVE, PGC_SIGHUP, 0, NULL, NULL,
+	    NULL);
+
+	DefineCustomIntVariable(
+	    "pmetrics.checkpoint_interval",
+	    "Time between metrics checkpoints (0 to disable)",
+	    "When set at server start, a background worker periodically saves "
+	    "the series updated since the last full checkpoint, so a crash loses "
+	    "at most this much of the updates.",
+	    &checkpoint_interval, DEFAULT_CHECKPOINT_INTERVAL, 0,
+	    MAX_CHECKPOINT_INTERVAL, PGC_SIGHUP, GUC_UNIT_S, NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+	    "pmetrics.http_port",
+	    "Port of the HTTP endpoint serving /metrics (0 to disable)",
+	    "When set, a background worker serves all metrics in the Prometheus "
+	    "text format at /metrics, without authentication.",
+	    &http_port, DEFAULT_HTTP_PORT, 0, 65535, PGC_POSTMASTER, 0, NULL,
+	    NULL, NULL);
+
+	DefineCustomStringVariable(
+	    "pmetrics.http_listen_address",
+	    "Address the HTTP endpoint listens on",
+	    "Host name or IP address, empty for all interfaces.",
+	    &http_listen_address, DEFAULT_HTTP_LISTEN_ADDRESS, PGC_POSTMASTER, 0,
+	    NULL, NULL, NULL);
+
 	gamma_val = (1 + bucket_variability) / (1 - bucket_variability);
 	log_gamma = log(gamma_val);
 
 	max_bucket_exp = ceil(log(buckets_upper_bound) / log_gamma);
 	buckets_upper_bound = (int)pow(gamma_val, max_bucket_exp);
+	init_bucket_bounds();
 
 	MarkGUCPrefixReserved("pmetrics");
 
 	LWLockRegisterTranche(LWTRANCHE_PMETRICS_DSA, "pmetrics_dsa");
 	LWLockRegisterTranche(LWTRANCHE_PMETRICS, "pmetrics");
+	LWLockRegisterTranche(LWTRANCHE_PMETRICS_INTERNED, "pmetrics_interned");
+	LWLockRegisterTranche(LWTRANCHE_PMETRICS_LABEL_PAIRS,
+	                      "pmetrics_label_pairs");
 
 	prev_shmem_startup_hook = shmem_startup_hook;
 	shmem_startup_hook = metrics_shmem_startup;
 	prev_shmem_request_hook = shmem_request_hook;
 	shmem_request_hook = metrics_shmem_request;
+
+	RegisterXactCallback(pmetrics_xact_callback, NULL);
+
+	if (checkpoint_interval > 0)
+		register_worker("pmetrics checkpointer", "pmetrics_checkpointer_main");
+	if (http_port > 0)
+		register_worker("pmetrics http", "pmetrics_http_main");
+}
+
+/*
+ * Register a background worker attached to shared memory only, restarted
+ * after an error.
+ */
+static void register_worker(const char *name, const char *function)
+{
+	BackgroundWorker worker;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+	worker.bgw_restart_time = WORKER_RESTART_TIME;
+	strlcpy(worker.bgw_library_name, "pmetrics", BGW_MAXLEN);
+	strlcpy(worker.bgw_function_name, function, BGW_MAXLEN);
+	strlcpy(worker.bgw_name, name, BGW_MAXLEN);
+	strlcpy(worker.bgw_type, name, BGW_MAXLEN);
+	RegisterBackgroundWorker(&worker);
 }
 
 static void validate_inputs(const char *name)
@@ -273,64 +1367,87 @@ static void extract_metric_args(FunctionCallInfo fcinfo, int name_arg,
 }
 
 /*
- * Initialize a MetricKey structure with local JSONB pointer
+ * Deconstruct a one-dimensional array argument, which can't contain NULLs.
+ * Returns the number of elements.
  */
-static void init_metric_key(MetricKey *key, const char *name,
-                            Jsonb *labels_jsonb, MetricType type, int bucket)
+static int get_array_arg(FunctionCallInfo fcinfo, int arg, Oid elemtype,
+                         Datum **elems_out)
 {
-	strlcpy(key->name, name, NAMEDATALEN);
+	ArrayType *array = PG_GETARG_ARRAYTYPE_P(arg);
+	int nelems;
 
-	if (labels_jsonb != NULL) {
-		key->labels.local_ptr = labels_jsonb;
-		key->labels_location = LABELS_LOCAL;
-	} else {
-		key->labels.local_ptr = NULL;
-		key->labels_location = LABELS_NONE;
-	}
+	if (ARR_NDIM(array) > 1)
+		elog(ERROR, "multidimensional arrays are not supported");
+
+	if (array_contains_nulls(array))
+		elog(ERROR, "null input not allowed");
+
+	/* No builtin deconstruction for jsonb, it is a plain int-aligned varlena */
+	if (elemtype == JSONBOID)
+		deconstruct_array(array, JSONBOID, -1, false, TYPALIGN_INT, elems_out,
+		                  NULL, &nelems);
+	else
+		deconstruct_array_builtin(array, elemtype, elems_out, NULL, &nelems);
+
+	return nelems;
+}
+
+/*
+ * Initialize a search, resolving the ids of name and labels from the backend
+ * cache or the interned value dictionary.
+ */
+static void init_metric_search(MetricSearch *search, const char *name,
+                               Jsonb *labels_jsonb, MetricType type)
+{
+	strlcpy(search->name, name, NAMEDATALEN);
+	search->labels = labels_jsonb;
+	search->key.type = type;
+	search->key.name_id = lookup_interned_id(INTERNED_NAME, name, true);
+
+	if (labels_jsonb != NULL)
+		search->key.labels_id =
+		    lookup_interned_id(INTERNED_LABELS, labels_jsonb, true);
+	else
+		search->key.labels_id = NO_LABELS_ID;
+}
 
-	key->type = type;
-	key->bucket = bucket;
+/*
+ * Whether both name and labels of a search have an id, so it can be used to
+ * find an existing series.
+ */
+static bool metric_search_known(const MetricSearch *search)
+{
+	return search->key.name_id != UNKNOWN_INTERNED_ID &&
+	       search->key.labels_id != UNKNOWN_INTERNED_ID;
 }
 
 /*
  * Cleanup callback when backend exits.
- * Detach from DSA and hash tables.
+ * Release handles and detach from DSA and hash tables.
  */
 static void cleanup_metrics_backend(int code, Datum arg)
 {
-	if (local_metrics_table != NULL) {
-		dshash_detach(local_metrics_table);
-		local_metrics_table = NULL;
-	}
+	flush_pending_deltas();
 
-	if (local_dsa != NULL) {
-		dsa_detach(local_dsa);
-		local_dsa = NULL;
+	while (!dlist_is_empty(&handles)) {
+		PMetricsHandle *handle =
+		    dlist_head_element(PMetricsHandle, node, &handles);
+
+		pmetrics_release_handle(handle);
 	}
 
+	detach_shared_tables();
+
 	elog(DEBUG1, "pmetrics: backend %d cleaned up", MyProcPid);
 }
 
 /*
- * Get metrics table for this backend.
- * The DSA and hash table are created in postmaster during startup.
- * Each backend must attach to get its own valid pointers.
+ * Attach to the DSA and the shared tables, for the lifetime of the process.
  */
-static dshash_table *get_metrics_table(void)
+static void attach_shared_tables(void)
 {
 	MemoryContext oldcontext;
 
-	/* Already attached in this backend? */
-	if (local_metrics_table != NULL)
-		return local_metrics_table;
-
-	/* Ensure shared state exists and was initialized */
-	if (shared_state == NULL)
-		elog(ERROR, "pmetrics shared state not initialized");
-
-	if (!shared_state->initialized)
-		elog(ERROR, "pmetrics not properly initialized during startup");
-
 	/*
 	 * Switch to TopMemoryContext to ensure the dshash_table structure
 	 * persists for the backend's lifetime and doesn't get freed/reused
@@ -354,718 +1471,6548 @@ static dshash_table *get_metrics_table(void)
 
 	local_metrics_table = dshash_attach(local_dsa, &metrics_params,
 	                                    shared_state->metrics_handle, NULL);
+	local_interned_table = dshash_attach(local_dsa, &interned_params,
+	                                     shared_state->interned_handle, NULL);
+	if (shared_state->label_pairs_handle != DSHASH_HANDLE_INVALID)
+		local_label_pairs_table =
+		    dshash_attach(local_dsa, &label_pairs_params,
+		                  shared_state->label_pairs_handle, NULL);
 
 	MemoryContextSwitchTo(oldcontext);
+}
 
-	elog(DEBUG1, "pmetrics: backend %d attached to tables", MyProcPid);
+static void detach_shared_tables(void)
+{
+	if (local_metrics_table != NULL) {
+		dshash_detach(local_metrics_table);
+		local_metrics_table = NULL;
+	}
 
-	/* Register cleanup callback for when backend exits */
-	on_shmem_exit(cleanup_metrics_backend, 0);
+	if (local_interned_table != NULL) {
+		dshash_detach(local_interned_table);
+		local_interned_table = NULL;
+	}
 
-	return local_metrics_table;
+	if (local_label_pairs_table != NULL) {
+		dshash_detach(local_label_pairs_table);
+		local_label_pairs_table = NULL;
+	}
+
+	if (local_dsa != NULL) {
+		dsa_detach(local_dsa);
+		local_dsa = NULL;
+	}
 }
 
-static int64 increment_by(const char *name_str, Jsonb *labels_jsonb,
-                          MetricType type, int bucket, int64 amount)
+/*
+ * Get metrics table for this backend.
+ * The DSA and hash table are created in postmaster during startup.
+ * Each backend must attach to get its own valid pointers.
+ */
+static dshash_table *get_metrics_table(void)
 {
-	Metric *entry;
-	MetricKey metric_key;
-	bool found;
-	dshash_table *table;
-	int64 result;
+	/* Already attached in this backend? */
+	if (local_metrics_table != NULL)
+		return local_metrics_table;
 
-	table = get_metrics_table();
-	if (table == NULL)
-		elog(ERROR, "pmetrics not initialized");
+	/* Ensure shared state exists and was initialized */
+	if (shared_state == NULL)
+		elog(ERROR, "pmetrics shared state not initialized");
 
-	init_metric_key(&metric_key, name_str, labels_jsonb, type, bucket);
+	if (!shared_state->initialized)
+		elog(ERROR, "pmetrics not properly initialized during startup");
 
-	entry = (Metric *)dshash_find_or_insert(table, &metric_key, &found);
+	attach_shared_tables();
 
-	if (!found)
-		entry->value = 0;
+	elog(DEBUG1, "pmetrics: backend %d attached to tables", MyProcPid);
 
-	entry->value += amount;
-	result = entry->value;
+	/* Register cleanup callback for when backend exits */
+	on_shmem_exit(cleanup_metrics_backend, 0);
 
+	return local_metrics_table;
+}
+
+/*
+ * Whether updates should go through the backend-local buffer, see
+ * pmetrics.flush_interval_ms.
+ */
+static bool buffering_enabled(void)
+{
+	return flush_interval_ms > 0 && MyProcNumber >= 0 &&
+	       MyProcNumber < num_backend_states();
+}
+
+/*
+ * Add amount to a series, either directly in shared memory or through the
+ * backend-local buffer when pmetrics.flush_interval_ms is set. Sets buffered
+ * to which one. When buffered, the returned value is the amount pending in
+ * this backend.
+ */
+static int64 increment_by(const char *name_str, Jsonb *labels_jsonb,
+                          MetricType type, int64 amount, bool *buffered)
+{
+	MetricSearch search;
+
+	init_metric_search(&search, name_str, labels_jsonb, type);
+
+	/* New names and labels are interned right away so buffered keys have ids */
+	*buffered = buffering_enabled() && metric_search_known(&search);
+	if (*buffered)
+		return buffer_delta(&search, amount);
+
+	return apply_delta(&search, amount);
+}
+
+/*
+ * Record one observation in a histogram, like increment_by(). Returns the
+ * count of its bucket, or the count pending in this backend when buffered.
+ */
+static int64 record_observation(const char *name_str, Jsonb *labels_jsonb,
+                                double value, bool *buffered)
+{
+	MetricSearch search;
+	int bucket_index;
+
+	bucket_index = bucket_index_for(value);
+	init_metric_search(&search, name_str, labels_jsonb,
+	                   METRIC_TYPE_HISTOGRAM);
+
+	*buffered = buffering_enabled() && metric_search_known(&search);
+	if (*buffered)
+		return buffer_observation(&search, bucket_index, (int64)value);
+
+	return apply_observation(&search, bucket_index, (int64)value);
+}
+
+/*
+ * Add amount to a counter or gauge in shared memory, creating it if needed.
+ */
+static int64 apply_delta(const MetricSearch *search, int64 amount)
+{
+	Metric *entry;
+	dshash_table *table;
+	int64 result;
+
+	table = get_metrics_table();
+	if (table == NULL)
+		elog(ERROR, "pmetrics not initialized");
+
+	entry = find_live_metric(table, search);
+	touch_metric(entry);
+	result = metric_add(entry, 0, amount);
 	dshash_release_lock(table, entry);
 
 	return result;
 }
 
-PG_FUNCTION_INFO_V1(increment_counter);
-Datum increment_counter(PG_FUNCTION_ARGS)
+/*
+ * Record one observation in a histogram in shared memory, creating it if
+ * needed. Returns the new count of the bucket.
+ */
+static int64 apply_observation(const MetricSearch *search, int bucket_index,
+                               int64 value)
 {
-	Datum new_value;
-	Jsonb *labels_jsonb;
-	char *name_str = NULL;
+	Metric *entry;
+	dshash_table *table;
+	int64 result;
 
-	if (!pmetrics_enabled)
-		PG_RETURN_NULL();
+	table = get_metrics_table();
+	if (table == NULL)
+		elog(ERROR, "pmetrics not initialized");
+
+	entry = find_live_metric(table, search);
+	touch_metric(entry);
+	result = metric_add(entry, HISTOGRAM_BUCKET_CELL(bucket_index), 1);
+	metric_add(entry, HISTOGRAM_SUM_CELL, value);
+	dshash_release_lock(table, entry);
+
+	return result;
+}
+
+/*
+ * Get the buffered update of a series, adding an empty one if needed.
+ */
+static PendingDelta *pending_delta_for(const MetricSearch *search)
+{
+	PendingDelta *pending;
+	bool found;
+
+	/* Attach now, so the exit callback is there to flush what we buffer */
+	(void)get_metrics_table();
+
+	if (pending_deltas == NULL) {
+		HASHCTL ctl;
+
+		if (pending_context == NULL)
+			pending_context = AllocSetContextCreate(
+			    TopMemoryContext, "pmetrics pending deltas",
+			    ALLOCSET_DEFAULT_SIZES);
+
+		ctl.keysize = sizeof(MetricKey);
+		ctl.entrysize = sizeof(PendingDelta);
+		ctl.hash = pending_delta_hash;
+		ctl.match = pending_delta_match;
+		ctl.hcxt = pending_context;
+		pending_deltas = hash_create("pmetrics pending deltas", 64, &ctl,
+		                             HASH_ELEM | HASH_FUNCTION | HASH_COMPARE |
+		                                 HASH_CONTEXT);
+	}
+
+	pending = (PendingDelta *)hash_search(pending_deltas, &search->key,
+	                                      HASH_ENTER, &found);
+
+	if (!found) {
+		/* Only the ids were copied, make the labels outlive the caller's */
+		strlcpy(pending->search.name, search->name, NAMEDATALEN);
+		pending->search.labels = NULL;
+		if (search->labels != NULL) {
+			Jsonb *labels = search->labels;
+
+			pending->search.labels =
+			    MemoryContextAlloc(pending_context, VARSIZE(labels));
+			memcpy(pending->search.labels, labels, VARSIZE(labels));
+		}
+		pending->dirty = false;
+		pending->delta = 0;
+		pending->bucket_deltas = NULL;
+		if (search->key.type == METRIC_TYPE_HISTOGRAM)
+			pending->bucket_deltas = (int64 *)MemoryContextAllocZero(
+			    pending_context, (max_bucket_exp + 1) * sizeof(int64));
+	}
+
+	return pending;
+}
+
+/*
+ * Note that something was buffered. Flushes when the oldest buffered update
+ * reaches pmetrics.flush_interval_ms, or when the buffer holds too many
+ * series.
+ */
+static void note_pending_update(void)
+{
+	TimestampTz now;
+
+	now = GetCurrentTimestamp();
+	if (pending_since == 0) {
+		pending_since = now;
+		pg_atomic_write_u64(&backend_slots[MyProcNumber].state.pending_since,
+		                    (uint64)now);
+	} else if (TimestampDifferenceExceeds(pending_since, now,
+	                                      flush_interval_ms) ||
+	           hash_get_num_entries(pending_deltas) > MAX_PENDING_SERIES) {
+		flush_pending_deltas();
+	}
+}
+
+/*
+ * Accumulate amount for a counter or gauge in the backend-local buffer.
+ */
+static int64 buffer_delta(const MetricSearch *search, int64 amount)
+{
+	PendingDelta *pending;
+	int64 result;
+
+	pending = pending_delta_for(search);
+	pending->delta += amount;
+	pending->dirty = true;
+	result = pending->delta;
+
+	note_pending_update();
+
+	return result;
+}
+
+/*
+ * Accumulate a histogram observation in the backend-local buffer. Returns
+ * the count pending in this backend for the bucket.
+ */
+static int64 buffer_observation(const MetricSearch *search, int bucket_index,
+                                int64 value)
+{
+	PendingDelta *pending;
+	int64 result;
+
+	pending = pending_delta_for(search);
+	pending->delta += value;
+	pending->bucket_deltas[bucket_index]++;
+	pending->dirty = true;
+	result = pending->bucket_deltas[bucket_index];
+
+	note_pending_update();
+
+	return result;
+}
+
+/*
+ * Forget the buffered update of one series, used when a gauge is set since
+ * the new value supersedes anything added before.
+ */
+static void discard_pending_delta(const MetricSearch *search)
+{
+	PendingDelta *pending;
+
+	if (pending_deltas == NULL)
+		return;
+
+	pending = (PendingDelta *)hash_search(pending_deltas, &search->key,
+	                                      HASH_FIND, NULL);
+	if (pending != NULL) {
+		pending->delta = 0;
+		pending->dirty = false;
+	}
+}
+
+/*
+ * Merge all buffered updates into shared memory.
+ *
+ * Entries are kept empty so hot series don't pay for a hash insert and a
+ * labels copy on every flush, unless the buffer grew too large.
+ */
+static void flush_pending_deltas(void)
+{
+	HASH_SEQ_STATUS status;
+	PendingDelta *pending;
+	dshash_table *table;
+
+	if (pending_deltas == NULL || pending_since == 0)
+		return;
+
+	table = get_metrics_table();
+
+	hash_seq_init(&status, pending_deltas);
+	while ((pending = (PendingDelta *)hash_seq_search(&status)) != NULL) {
+		Metric *entry;
+
+		if (!pending->dirty)
+			continue;
+
+		PG_TRY();
+		{
+			entry = find_live_metric(table, &pending->search);
+		}
+		PG_CATCH();
+		{
+			hash_seq_term(&status);
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		touch_metric(entry);
+		if (pending->search.key.type == METRIC_TYPE_HISTOGRAM) {
+			int i;
+
+			metric_add(entry, HISTOGRAM_SUM_CELL, pending->delta);
+			for (i = 0; i <= max_bucket_exp; i++) {
+				if (pending->bucket_deltas[i] != 0)
+					metric_add(entry, HISTOGRAM_BUCKET_CELL(i),
+					           pending->bucket_deltas[i]);
+			}
+			memset(pending->bucket_deltas, 0,
+			       (max_bucket_exp + 1) * sizeof(int64));
+		} else {
+			metric_add(entry, 0, pending->delta);
+		}
+		dshash_release_lock(table, entry);
+
+		pending->delta = 0;
+		pending->dirty = false;
+	}
+
+	pending_since = 0;
+	pg_atomic_write_u64(&backend_slots[MyProcNumber].state.pending_since, 0);
+
+	if (hash_get_num_entries(pending_deltas) > MAX_PENDING_SERIES) {
+		hash_destroy(pending_deltas);
+		pending_deltas = NULL;
+		MemoryContextReset(pending_context);
+	}
+}
+
+/*
+ * Flush buffered updates at transaction end, so backends that go idle don't
+ * keep updates to themselves.
+ *
+ * This runs after the transaction is committed or aborted, where an error
+ * can't be reported normally. On failure, log it, release any partition lock
+ * left behind and keep the remaining updates for the next flush.
+ */
+static void pmetrics_xact_callback(XactEvent event, void *arg)
+{
+	switch (event) {
+	case XACT_EVENT_COMMIT:
+	case XACT_EVENT_PARALLEL_COMMIT:
+	case XACT_EVENT_ABORT:
+	case XACT_EVENT_PARALLEL_ABORT:
+	case XACT_EVENT_PREPARE:
+		break;
+	default:
+		return;
+	}
+
+	if (pending_since == 0)
+		return;
 
 	PG_TRY();
 	{
-		extract_metric_args(fcinfo, 0, 1, &name_str, &labels_jsonb);
-		new_value =
-		    increment_by(name_str, labels_jsonb, METRIC_TYPE_COUNTER, 0, 1);
+		flush_pending_deltas();
 	}
 	PG_CATCH();
 	{
-		if (name_str)
-			pfree(name_str);
-		PG_RE_THROW();
+		EmitErrorReport();
+		FlushErrorState();
+		LWLockReleaseAll();
+	}
+	PG_END_TRY();
+}
+
+static uint32 pending_delta_hash(const void *key, Size keysize)
+{
+	return metric_hash_dshash(key, keysize, NULL);
+}
+
+static int pending_delta_match(const void *key1, const void *key2,
+                               Size keysize)
+{
+	return metric_compare_dshash(key1, key2, keysize, NULL);
+}
+
+/*
+ * GUC check hook for pmetrics.sharded_metrics. The names are parsed once
+ * here into extra: each one NUL-terminated, followed by an empty one, see
+ * name_is_sharded().
+ */
+static bool check_sharded_metrics(char **newval, void **extra,
+                                  GucSource source)
+{
+	char *rawstring;
+	List *elemlist;
+	ListCell *lc;
+	Size size = 1;
+	char *names;
+	char *next;
+
+	rawstring = pstrdup(*newval);
+	if (!SplitGUCList(rawstring, ',', &elemlist)) {
+		GUC_check_errdetail("List syntax is invalid.");
+		list_free(elemlist);
+		pfree(rawstring);
+		return false;
+	}
+
+	foreach (lc, elemlist)
+		size += strlen((char *)lfirst(lc)) + 1;
+
+	names = (char *)guc_malloc(LOG, size);
+	if (names == NULL) {
+		list_free(elemlist);
+		pfree(rawstring);
+		return false;
+	}
+
+	next = names;
+	foreach (lc, elemlist) {
+		strcpy(next, (char *)lfirst(lc));
+		next += strlen(next) + 1;
+	}
+	*next = '\0';
+
+	list_free(elemlist);
+	pfree(rawstring);
+
+	*extra = names;
+	return true;
+}
+
+static void assign_sharded_metrics(const char *newval, void *extra)
+{
+	sharded_names = (const char *)extra;
+}
+
+/*
+ * Whether a new series should be sharded. Only additive series are: gauges
+ * can be set, which a sum of shards can't represent.
+ */
+static bool metric_is_sharded(const MetricSearch *search)
+{
+	if (search->key.type == METRIC_TYPE_GAUGE)
+		return false;
+
+	/* No copy to write to, see metric_add() */
+	if (MyProcNumber < 0 || MyProcNumber >= num_backend_states())
+		return false;
+
+	return name_is_sharded(search->name);
+}
+
+/*
+ * Whether a name is listed in pmetrics.sharded_metrics, from the names
+ * parsed by check_sharded_metrics().
+ */
+static bool name_is_sharded(const char *name)
+{
+	const char *listed;
+
+	if (sharded_names == NULL)
+		return false;
+
+	for (listed = sharded_names; *listed != '\0';
+	     listed += strlen(listed) + 1) {
+		if (strcmp(listed, name) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+static int metric_ncells(MetricType type)
+{
+	if (type == METRIC_TYPE_HISTOGRAM)
+		return HISTOGRAM_BUCKET_CELL(max_bucket_exp) + 1;
+
+	return 1;
+}
+
+/*
+ * Distance between the per-backend copies of the cells of a sharded series,
+ * padded so backends updating the same series don't share cache lines.
+ */
+static Size cells_stride(int ncells)
+{
+	return TYPEALIGN(PG_CACHE_LINE_SIZE, ncells * sizeof(pg_atomic_uint64));
+}
+
+/*
+ * Cells of an entry. With backend >= 0, that backend's copy in a sharded
+ * entry.
+ *
+ * Shard arrays get one extra cache line so they can be aligned, since DSA
+ * allocations are only MAXALIGNed. DSA segments are mapped at page
+ * boundaries, so every backend computes the same offset.
+ */
+static pg_atomic_uint64 *metric_cells(Metric *entry, int backend)
+{
+	char *shards;
+
+	if (backend < 0) {
+		if (DsaPointerIsValid(entry->cells))
+			return (pg_atomic_uint64 *)dsa_get_address(local_dsa,
+			                                           entry->cells);
+		return &entry->value;
+	}
+
+	Assert(DsaPointerIsValid(entry->shards));
+	shards = (char *)CACHELINEALIGN(dsa_get_address(local_dsa, entry->shards));
+
+	return (pg_atomic_uint64 *)(shards + backend * cells_stride(metric_ncells(
+	                                                   entry->key.type)));
+}
+
+/*
+ * Add amount to a cell of an entry. Sharded entries are updated in this
+ * backend's copy and return its value, others return the new value of the
+ * cell. Callers touch_metric() the entry once per update, however many cells
+ * it writes.
+ */
+static int64 metric_add(Metric *entry, int cell, int64 amount)
+{
+	pg_atomic_uint64 *cells;
+
+	if (DsaPointerIsValid(entry->shards) && MyProcNumber >= 0 &&
+	    MyProcNumber < num_backend_states())
+		cells = metric_cells(entry, MyProcNumber);
+	else
+		cells = metric_cells(entry, -1);
+
+	return (int64)pg_atomic_add_fetch_u64(&cells[cell], amount);
+}
+
+/*
+ * Set the value of a gauge. Like metric_add(), doesn't touch the entry.
+ */
+static void metric_set(Metric *entry, int64 value)
+{
+	pg_atomic_write_u64(&entry->value, (uint64)value);
+}
+
+/*
+ * Record that an entry was just written to, for eviction and in the
+ * NameUsage of its name. The time comes from coarse_time() and is only stored
+ * when it changes, so hot series write it at most once a second.
+ *
+ * Once changes are tracked, modified is the generation of the first snapshot
+ * that may have missed the write, for list_metrics_since() and checkpoint
+ * deltas. It only moves forward, and is only written once per snapshot taken.
+ */
+static void touch_metric(Metric *entry)
+{
+	uint32 now = coarse_time();
+	NameUsage *usage;
+
+	if (pg_atomic_read_u64(&shared_state->tracked_since.value) != 0) {
+		uint64 generation = next_generation();
+		uint64 modified = pg_atomic_read_u64(&entry->modified);
+
+		while (modified < generation &&
+		       !pg_atomic_compare_exchange_u64(&entry->modified, &modified,
+		                                       generation))
+			;
+	}
+
+	if (pg_atomic_read_u32(&entry->last_update) == now)
+		return;
+
+	pg_atomic_write_u32(&entry->last_update, now);
+
+	usage = name_usage(entry);
+	if (pg_atomic_read_u32(&usage->last_update) != now)
+		pg_atomic_write_u32(&usage->last_update, now);
+}
+
+/*
+ * Generation of the next snapshot. A write seen by a snapshot taken before it
+ * also has this generation, so it is repeated by the next
+ * list_metrics_since() call rather than missed.
+ */
+static uint64 next_generation(void)
+{
+	return pg_atomic_read_u64(&shared_state->snapshot_generation) + 1;
+}
+
+/*
+ * Start stamping updates with their generation, if not done yet, and return
+ * the generation from which they are. Series not written to since may have
+ * been written before it without being stamped.
+ */
+static uint64 track_changes(void)
+{
+	uint64 since = pg_atomic_read_u64(&shared_state->tracked_since.value);
+	uint64 expected = 0;
+
+	if (since != 0)
+		return since;
+
+	since = next_generation();
+	if (!pg_atomic_compare_exchange_u64(&shared_state->tracked_since.value,
+	                                    &expected, since))
+		since = expected;
+
+	return since;
+}
+
+/*
+ * Current time in seconds since the epoch, as kept by touch_metric(). In a
+ * transaction it is the start of the current statement, converted once per
+ * statement, so that updates don't read the clock. It lags behind during long
+ * statements, which only makes their series look idle earlier to eviction.
+ */
+static uint32 coarse_time(void)
+{
+	static TimestampTz statement_start = 0;
+	static uint32 statement_time = 0;
+	TimestampTz start;
+
+	if (!IsTransactionState())
+		return (uint32)time(NULL);
+
+	start = GetCurrentStatementStartTimestamp();
+	if (start != statement_start) {
+		statement_start = start;
+		statement_time = (uint32)timestamptz_to_time_t(start);
+	}
+
+	return statement_time;
+}
+
+static NameUsage *name_usage(Metric *entry)
+{
+	return (NameUsage *)dsa_get_address(local_dsa, entry->name_usage);
+}
+
+/*
+ * DSA memory owned by an entry of the given type: the entry itself and its
+ * cell arrays.
+ */
+static Size metric_memory(MetricType type, bool sharded)
+{
+	int ncells = metric_ncells(type);
+	Size size = sizeof(Metric);
+
+	if (type == METRIC_TYPE_HISTOGRAM)
+		size = add_size(size, ncells * sizeof(pg_atomic_uint64));
+
+	if (sharded)
+		size = add_size(size, add_size(mul_size(num_backend_states(),
+		                                        cells_stride(ncells)),
+		                               PG_CACHE_LINE_SIZE));
+
+	return size;
+}
+
+/*
+ * Track DSA memory allocated (positive bytes) or freed (negative) for a use,
+ * and the number of entries it holds, for pmetrics.max_memory and
+ * memory_stats(). This counts entries, interned values and indexes but not
+ * allocator overhead or the hash tables' bucket arrays.
+ */
+static void account_memory(MemoryKind kind, int entries, int64 bytes)
+{
+	MemoryUsage *usage = &shared_state->memory[kind];
+
+	pg_atomic_fetch_add_u64(&usage->bytes, bytes);
+	if (entries != 0)
+		pg_atomic_fetch_add_u64(&usage->entries, entries);
+}
+
+/*
+ * DSA memory counted by account_memory(), all uses together.
+ */
+static uint64 memory_used(void)
+{
+	uint64 bytes = 0;
+	int i;
+
+	for (i = 0; i < NUM_MEMORY_KINDS; i++)
+		bytes += pg_atomic_read_u64(&shared_state->memory[i].bytes);
+
+	return bytes;
+}
+
+/*
+ * Memory use of an interned value of a kind.
+ */
+static MemoryKind interned_memory_kind(InternedKind kind)
+{
+	if (kind == INTERNED_NAME)
+		return MEMORY_NAMES;
+	if (kind == INTERNED_LABELS)
+		return MEMORY_LABEL_SETS;
+	return MEMORY_INDEXES;
+}
+
+/*
+ * Entries a dshash partition can hold before the table is doubled: dshash
+ * grows when an insert finds a partition holding more than 3/4 of its
+ * buckets (MAX_COUNT_PER_PARTITION in dshash.c, PostgreSQL 17 and 18). A
+ * different policy only makes the modeled sizes wrong.
+ */
+static int64 partition_capacity(int size_log2)
+{
+	int64 per_partition = INT64CONST(1) << (size_log2 - DSHASH_PARTITIONS_LOG2);
+
+	return per_partition / 2 + per_partition / 4;
+}
+
+/*
+ * Count an entry inserted into (delta 1) or deleted from (delta -1) a shared
+ * table, and grow its modeled bucket array the way dshash grows the real
+ * one. Called with the partition lock of the entry held.
+ */
+static void count_table_entry(SharedTable table, uint32 hash, int delta)
+{
+	TableUsage *usage = &shared_state->tables[table];
+	uint32 *count = &usage->partition_counts[PARTITION_FOR_HASH(hash)];
+	uint32 size_log2 = pg_atomic_read_u32(&usage->size_log2);
+	uint32 grown = size_log2;
+
+	if (delta > 0) {
+		while (grown < 32 && *count > partition_capacity(grown))
+			grown++;
+		/* Retried if another partition grew the table meanwhile */
+		while (grown > size_log2 &&
+		       !pg_atomic_compare_exchange_u32(&usage->size_log2, &size_log2,
+		                                       grown))
+			;
+	}
+
+	*count += delta;
+	pg_atomic_fetch_add_u64(&usage->entries, delta);
+}
+
+/*
+ * Current value of a cell, summing all copies of sharded entries.
+ */
+static int64 metric_cell_value(Metric *entry, int cell)
+{
+	uint64 value;
+
+	value = pg_atomic_read_u64(&metric_cells(entry, -1)[cell]);
+
+	if (DsaPointerIsValid(entry->shards)) {
+		int i;
+
+		for (i = 0; i < num_backend_states(); i++)
+			value += pg_atomic_read_u64(&metric_cells(entry, i)[cell]);
+	}
+
+	return (int64)value;
+}
+
+/*
+ * Number of list_metrics() rows for an entry: one for counters and gauges,
+ * the sum and each non-empty bucket for histograms.
+ */
+static int metric_row_count(Metric *entry)
+{
+	int rows = 1;
+	int i;
+
+	if (entry->key.type != METRIC_TYPE_HISTOGRAM)
+		return rows;
+
+	for (i = 0; i <= max_bucket_exp; i++) {
+		if (bucket_cells[i] == i &&
+		    metric_cell_value(entry, HISTOGRAM_BUCKET_CELL(i)) != 0)
+			rows++;
+	}
+
+	return rows;
+}
+
+static void reset_metric_value(Metric *entry)
+{
+	int ncells = metric_ncells(entry->key.type);
+	pg_atomic_uint64 *cells;
+	int i;
+	int j;
+
+	cells = metric_cells(entry, -1);
+	for (j = 0; j < ncells; j++)
+		pg_atomic_write_u64(&cells[j], 0);
+
+	if (DsaPointerIsValid(entry->shards)) {
+		for (i = 0; i < num_backend_states(); i++) {
+			cells = metric_cells(entry, i);
+			for (j = 0; j < ncells; j++)
+				pg_atomic_write_u64(&cells[j], 0);
+		}
+	}
+}
+
+/*
+ * Free the DSA memory owned by an entry, before removing it from the table.
+ */
+static void free_metric(Metric *entry)
+{
+	if (DsaPointerIsValid(entry->labels))
+		pg_atomic_fetch_sub_u64(
+		    &name_usage(entry)->label_bytes,
+		    VARSIZE(dsa_get_address(local_dsa, entry->labels)));
+	unindex_series(INTERNED_NAME, entry->name, entry->name_slot);
+	if (DsaPointerIsValid(entry->labels))
+		unindex_series(INTERNED_LABELS, entry->labels, entry->labels_slot);
+	unref_metric_values(entry->name, entry->labels);
+	free_metric_cells(entry->cells, entry->shards);
+
+	count_table_entry(TABLE_METRICS,
+	                  metric_hash_dshash(&entry->key, sizeof(MetricKey), NULL),
+	                  -1);
+	account_memory(MEMORY_SERIES, -1,
+	               -(int64)metric_memory(entry->key.type,
+	                                     DsaPointerIsValid(entry->shards)));
+}
+
+/*
+ * Allocate the cells of a new histogram and the per-backend copies of a new
+ * sharded series, before its entry is inserted so an entry is never visible
+ * without them. Returns false, with nothing allocated, if DSA is out of
+ * memory.
+ */
+static bool alloc_metric_cells(MetricType type, bool sharded,
+                               dsa_pointer *cells, dsa_pointer *shards)
+{
+	int ncells = metric_ncells(type);
+	pg_atomic_uint64 *values;
+	char *aligned;
+	int i;
+	int j;
+
+	*cells = InvalidDsaPointer;
+	*shards = InvalidDsaPointer;
+
+	if (type == METRIC_TYPE_HISTOGRAM) {
+		*cells = dsa_allocate_extended(
+		    local_dsa, ncells * sizeof(pg_atomic_uint64), DSA_ALLOC_NO_OOM);
+		if (!DsaPointerIsValid(*cells))
+			return false;
+		values = (pg_atomic_uint64 *)dsa_get_address(local_dsa, *cells);
+		for (j = 0; j < ncells; j++)
+			pg_atomic_init_u64(&values[j], 0);
+	}
+
+	if (sharded) {
+		*shards = dsa_allocate_extended(
+		    local_dsa,
+		    add_size(mul_size(num_backend_states(), cells_stride(ncells)),
+		             PG_CACHE_LINE_SIZE),
+		    DSA_ALLOC_NO_OOM);
+		if (!DsaPointerIsValid(*shards)) {
+			free_metric_cells(*cells, InvalidDsaPointer);
+			*cells = InvalidDsaPointer;
+			return false;
+		}
+		/* Same layout as metric_cells() */
+		aligned = (char *)CACHELINEALIGN(dsa_get_address(local_dsa, *shards));
+		for (i = 0; i < num_backend_states(); i++) {
+			values = (pg_atomic_uint64 *)(aligned + i * cells_stride(ncells));
+			for (j = 0; j < ncells; j++)
+				pg_atomic_init_u64(&values[j], 0);
+		}
+	}
+
+	return true;
+}
+
+static void free_metric_cells(dsa_pointer cells, dsa_pointer shards)
+{
+	if (DsaPointerIsValid(cells))
+		dsa_free(local_dsa, cells);
+	if (DsaPointerIsValid(shards))
+		dsa_free(local_dsa, shards);
+}
+
+/*
+ * Initialize the non-key part of a freshly inserted entry, which takes over
+ * a reference on its name and label set and the cells from
+ * alloc_metric_cells().
+ *
+ * If the series indexes can't grow, the entry is removed again, its
+ * references and cells dropped, and an error raised. Nothing else is
+ * accounted for before then, and the only other failure, in
+ * find_stored_interned(), means shared memory is corrupt anyway.
+ */
+static void init_metric(dshash_table *table, Metric *entry, dsa_pointer name,
+                        dsa_pointer labels, dsa_pointer cells,
+                        dsa_pointer shards)
+{
+	pg_atomic_init_u64(&entry->value, 0);
+	entry->name = name;
+	entry->labels = labels;
+	entry->cells = cells;
+	entry->shards = shards;
+	entry->handle_refs = 0;
+	entry->deleted = false;
+	pg_atomic_init_u32(&entry->last_update, 0);
+	pg_atomic_init_u64(&entry->modified, 0);
+
+	entry->name_slot = index_series(INTERNED_NAME, name, entry->key.labels_id,
+	                                entry->key.type, &entry->name_usage);
+	entry->labels_slot = -1;
+	if (entry->name_slot >= 0 && DsaPointerIsValid(labels)) {
+		entry->labels_slot = index_series(INTERNED_LABELS, labels,
+		                                  entry->key.name_id, entry->key.type,
+		                                  NULL);
+		if (entry->labels_slot < 0) {
+			unindex_series(INTERNED_NAME, name, entry->name_slot);
+			entry->name_slot = -1;
+		}
+	}
+
+	if (entry->name_slot < 0) {
+		dshash_delete_entry(table, entry);
+		free_metric_cells(cells, shards);
+		unref_metric_values(name, labels);
+		series_oom_error();
+	}
+
+	touch_metric(entry);
+	if (DsaPointerIsValid(labels))
+		pg_atomic_fetch_add_u64(&name_usage(entry)->label_bytes,
+		                        VARSIZE(dsa_get_address(local_dsa, labels)));
+
+	count_table_entry(TABLE_METRICS,
+	                  metric_hash_dshash(&entry->key, sizeof(MetricKey), NULL),
+	                  1);
+	account_memory(MEMORY_SERIES, 1,
+	               metric_memory(entry->key.type, DsaPointerIsValid(shards)));
+}
+
+/*
+ * Raise the error for a series that couldn't be created for lack of shared
+ * memory.
+ */
+static void series_oom_error(void)
+{
+	ereport(ERROR,
+	        (errcode(ERRCODE_OUT_OF_MEMORY), errmsg("out of shared memory"),
+	         errdetail("pmetrics could not allocate a new series.")));
+}
+
+/*
+ * Bring a tombstone back to life as an empty series. Caller must hold the
+ * partition lock exclusively.
+ */
+static void revive_metric(Metric *entry)
+{
+	reset_metric_value(entry);
+	touch_metric(entry);
+	entry->deleted = false;
+}
+
+/*
+ * Find the live entry for key, creating or reviving it if needed. Returns it
+ * with its partition lock held, which the caller must release.
+ *
+ * Existing series are returned under a shared partition lock and updated
+ * atomically, so backends updating series in the same partition don't
+ * serialize. Only the first update of a series (or of a tombstone) takes the
+ * lock exclusively.
+ *
+ * A series that would go over a series limit isn't created, the update goes
+ * to the overflow series of its name instead.
+ */
+static Metric *find_live_metric(dshash_table *table,
+                                const MetricSearch *search)
+{
+	Metric *entry;
+	MetricKey key;
+	MetricSearch overflow;
+
+	if (metric_search_known(search)) {
+		entry = (Metric *)dshash_find(table, &search->key, false);
+		if (entry != NULL) {
+			if (!entry->deleted)
+				return entry;
+			dshash_release_lock(table, entry);
+		}
+	}
+
+	entry = insert_metric(table, search, &key, true);
+	if (entry == NULL) {
+		init_metric_search(&overflow, search->name, get_overflow_labels(),
+		                   search->key.type);
+		entry = insert_metric(table, &overflow, &key, false);
+	}
+
+	return entry;
+}
+
+/*
+ * Find or create the entry for a search, reviving it if it is a tombstone,
+ * and set key to its current ids. Returns it with its partition lock held
+ * exclusively.
+ *
+ * If limited is set and creating the series would go over a series limit,
+ * an existing series is still returned but nothing is created: returns NULL
+ * with no lock held.
+ */
+static Metric *insert_metric(dshash_table *table, const MetricSearch *search,
+                             MetricKey *key, bool limited)
+{
+	Metric *entry;
+	dsa_pointer name;
+	dsa_pointer labels;
+	dsa_pointer cells = InvalidDsaPointer;
+	dsa_pointer shards = InvalidDsaPointer;
+	bool found;
+	bool sharded;
+
+	/* Decided before locking, this scans pmetrics.sharded_metrics */
+	sharded = metric_is_sharded(search);
+
+	ref_search_values(search, key, &name, &labels);
+
+	if (limited && series_limit_reached(name)) {
+		entry = (Metric *)dshash_find(table, key, true);
+		if (entry == NULL) {
+			unref_metric_values(name, labels);
+			return NULL;
+		}
+		found = true;
+	} else {
+		/* Usually a new series, the caller didn't find it */
+		if (!alloc_metric_cells(search->key.type, sharded, &cells, &shards)) {
+			unref_metric_values(name, labels);
+			series_oom_error();
+		}
+		entry = (Metric *)dshash_find_or_insert(table, key, &found);
+		if (found)
+			free_metric_cells(cells, shards);
+	}
+
+	if (!found) {
+		init_metric(table, entry, name, labels, cells, shards);
+	} else {
+		if (entry->deleted)
+			revive_metric(entry);
+		/* The entry already holds references */
+		unref_metric_values(name, labels);
+	}
+
+	return entry;
+}
+
+/*
+ * Labels of the overflow series, see pmetrics.max_series.
+ */
+static Jsonb *get_overflow_labels(void)
+{
+	MemoryContext oldcontext;
+
+	if (overflow_labels == NULL) {
+		oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+		overflow_labels = DatumGetJsonbP(DirectFunctionCall1(
+		    jsonb_in, CStringGetDatum(OVERFLOW_LABELS)));
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	return overflow_labels;
+}
+
+/*
+ * Whether a new series of an interned name would go over one of the series
+ * limits. When a limit on the whole table is reached and
+ * pmetrics.eviction allows it, idle series are evicted to make room first.
+ *
+ * Limits are checked without a lock, so concurrent backends can go slightly
+ * over them. Must not be called while holding a metrics partition lock.
+ */
+static bool series_limit_reached(dsa_pointer name)
+{
+	if (name_limit_reached(name))
+		return true;
+
+	if (!global_limit_reached())
+		return false;
+
+	if (eviction_policy == EVICTION_NONE)
+		return true;
+
+	evict_idle_series();
+
+	return global_limit_reached();
+}
+
+/*
+ * Whether an interned name has pmetrics.max_series_per_name series.
+ */
+static bool name_limit_reached(dsa_pointer name)
+{
+	InternedEntry *entry;
+	int live;
+
+	if (max_series_per_name <= 0)
+		return false;
+
+	entry = find_stored_interned(INTERNED_NAME, name, false);
+	live = entry->series.live;
+	dshash_release_lock(local_interned_table, entry);
+
+	return live >= max_series_per_name;
+}
+
+/*
+ * Whether pmetrics.max_series or pmetrics.max_memory is reached.
+ */
+static bool global_limit_reached(void)
+{
+	if (max_series > 0 &&
+	    pg_atomic_read_u64(&shared_state->memory[MEMORY_SERIES].entries) >=
+	        (uint64)max_series)
+		return true;
+
+	if (max_memory_mb > 0 &&
+	    memory_used() >= (uint64)max_memory_mb * 1024 * 1024)
+		return true;
+
+	return false;
+}
+
+/*
+ * Evict idle series following pmetrics.eviction. Only one backend evicts at
+ * a time and at most once a second, the others go on and find the limit
+ * still reached until then.
+ */
+static void evict_idle_series(void)
+{
+	dshash_table *table = get_metrics_table();
+	uint32 now = (uint32)time(NULL);
+
+	if (pg_atomic_read_u32(&shared_state->last_eviction) == now ||
+	    !pg_atomic_test_set_flag(&shared_state->evicting))
+		return;
+
+	pg_atomic_write_u32(&shared_state->last_eviction, now);
+
+	PG_TRY();
+	{
+		evict_least_recently_updated(table);
+	}
+	PG_FINALLY();
+	{
+		pg_atomic_clear_flag(&shared_state->evicting);
+	}
+	PG_END_TRY();
+}
+
+/*
+ * Remove the least recently updated 1/EVICTION_FRACTION of the evictable
+ * series. A first shared scan collects their update times to find the
+ * cutoff, then an exclusive scan removes the series not updated since.
+ */
+static void evict_least_recently_updated(dshash_table *table)
+{
+	dshash_seq_status status;
+	Metric *entry;
+	uint32 *times;
+	int64 capacity;
+	int64 count = 0;
+	int64 target;
+	int64 evicted = 0;
+	uint64 overflow_id;
+	uint32 cutoff;
+
+	overflow_id =
+	    lookup_interned_id(INTERNED_LABELS, get_overflow_labels(), false);
+
+	capacity = Max(
+	    pg_atomic_read_u64(&shared_state->memory[MEMORY_SERIES].entries), 1);
+	times = palloc_extended(capacity * sizeof(uint32), MCXT_ALLOC_HUGE);
+
+	dshash_seq_init(&status, table, false);
+	while ((entry = (Metric *)dshash_seq_next(&status)) != NULL) {
+		if (!evictable_metric(entry, overflow_id))
+			continue;
+		if (count == capacity) {
+			capacity *= 2;
+			times = repalloc_huge(times, capacity * sizeof(uint32));
+		}
+		times[count++] = pg_atomic_read_u32(&entry->last_update);
+	}
+	dshash_seq_term(&status);
+
+	if (count == 0) {
+		pfree(times);
+		return;
+	}
+
+	qsort(times, count, sizeof(uint32), compare_update_times);
+	target = Max(count / EVICTION_FRACTION, 1);
+	cutoff = times[target - 1];
+	pfree(times);
+
+	dshash_seq_init(&status, table, true);
+	while (evicted < target &&
+	       (entry = (Metric *)dshash_seq_next(&status)) != NULL) {
+		if (evictable_metric(entry, overflow_id) &&
+		    pg_atomic_read_u32(&entry->last_update) <= cutoff) {
+			remove_metric(table, &status, entry, false);
+			evicted++;
+		}
+	}
+	dshash_seq_term(&status);
+
+	if (evicted > 0)
+		forget_removals();
+
+	elog(DEBUG1, "pmetrics: evicted " INT64_FORMAT " series", evicted);
+}
+
+/*
+ * Whether eviction may remove an entry: not pinned by a handle, not already
+ * a tombstone and not an overflow series.
+ */
+static bool evictable_metric(const Metric *entry, uint64 overflow_id)
+{
+	return entry->handle_refs == 0 && !entry->deleted &&
+	       entry->key.labels_id != overflow_id;
+}
+
+static int compare_update_times(const void *a, const void *b)
+{
+	uint32 t1 = *(const uint32 *)a;
+	uint32 t2 = *(const uint32 *)b;
+
+	if (t1 != t2)
+		return (t1 < t2) ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Take a reference on the name and label set of a search, for an entry about
+ * to be created, and set key to their current ids. Labels are set to
+ * InvalidDsaPointer if the search has none.
+ *
+ * This goes through the dictionary even if the search has ids, since they
+ * can be stale. Must not be called while holding a metrics partition lock.
+ */
+static void ref_search_values(const MetricSearch *search, MetricKey *key,
+                              dsa_pointer *name, dsa_pointer *labels)
+{
+	key->type = search->key.type;
+	key->labels_id = NO_LABELS_ID;
+	*labels = InvalidDsaPointer;
+
+	*name = ref_interned(INTERNED_NAME, search->name, &key->name_id);
+
+	if (search->labels != NULL)
+		*labels =
+		    ref_interned(INTERNED_LABELS, search->labels, &key->labels_id);
+}
+
+/*
+ * Drop the references an entry holds, or was about to take over.
+ */
+static void unref_metric_values(dsa_pointer name, dsa_pointer labels)
+{
+	unref_interned(INTERNED_NAME, name);
+	if (DsaPointerIsValid(labels))
+		unref_interned(INTERNED_LABELS, labels);
+}
+
+/*
+ * Delete an entry, either the current entry of an exclusive sequential scan
+ * or, when status is NULL, an entry found with an exclusive lock, which is
+ * released. Entries pinned by handles are turned into tombstones instead.
+ * Returns the number of list_metrics() rows removed, 0 if the entry was
+ * already a tombstone.
+ *
+ * The removal is logged for list_metrics_since() if logged is set. Callers
+ * removing many series call forget_removals() once they are done instead.
+ */
+static int remove_metric(dshash_table *table, dshash_seq_status *status,
+                         Metric *entry, bool logged)
+{
+	int rows = 0;
+
+	if (!entry->deleted) {
+		rows = metric_row_count(entry);
+		pg_atomic_fetch_add_u64(&shared_state->series_removed, 1);
+		if (logged)
+			log_removal(entry);
+
+		if (entry->handle_refs > 0) {
+			reset_metric_value(entry);
+			entry->deleted = true;
+		} else {
+			free_metric(entry);
+			if (status != NULL)
+				dshash_delete_current(status);
+			else
+				dshash_delete_entry(table, entry);
+			return rows;
+		}
+	}
+
+	if (status == NULL)
+		dshash_release_lock(table, entry);
+
+	return rows;
+}
+
+/*
+ * Remember a series being removed for list_metrics_since(), in place of the
+ * oldest one remembered. Called with its partition lock held exclusively.
+ */
+static void log_removal(Metric *entry)
+{
+	RemovedSeries *record;
+
+	LWLockAcquire(removal_log->lock, LW_EXCLUSIVE);
+
+	record = &removal_log->records[removal_log->next % REMOVAL_LOG_SIZE];
+	if (removal_log->next >= REMOVAL_LOG_SIZE) {
+		removal_log->lost = Max(removal_log->lost, record->modified);
+		unref_metric_values(record->name, record->labels);
+	}
+
+	record->key = entry->key;
+	record->name = entry->name;
+	record->labels = entry->labels;
+	record->modified = next_generation();
+	ref_stored_interned(INTERNED_NAME, entry->name);
+	if (DsaPointerIsValid(entry->labels))
+		ref_stored_interned(INTERNED_LABELS, entry->labels);
+	removal_log->next++;
+
+	LWLockRelease(removal_log->lock);
+}
+
+/*
+ * Stand for series removed without being logged: list_metrics_since() calls
+ * from snapshots that may have seen them fail, and their consumers list every
+ * series again. Called once the series are removed, so that snapshots taken
+ * from now on don't have them.
+ */
+static void forget_removals(void)
+{
+	uint64 generation =
+	    pg_atomic_read_u64(&shared_state->snapshot_generation);
+
+	LWLockAcquire(removal_log->lock, LW_EXCLUSIVE);
+	removal_log->lost = Max(removal_log->lost, generation);
+	LWLockRelease(removal_log->lock);
+}
+
+/*
+ * Delete the series in a list that still exist, see remove_metric().
+ */
+static int64 remove_series(dshash_table *table, const SeriesList *series,
+                           bool logged)
+{
+	Metric *entry;
+	int64 deleted_count = 0;
+	int64 i;
+
+	for (i = 0; i < series->count; i++) {
+		entry = (Metric *)dshash_find(table, &series->keys[i], true);
+		if (entry != NULL)
+			deleted_count += remove_metric(table, NULL, entry, logged);
+	}
+
+	if (!logged)
+		forget_removals();
+
+	return deleted_count;
+}
+
+/*
+ * Find or create the entry for a search and pin it for a handle. Updates the
+ * ids of the search, which stay valid while the entry is pinned.
+ */
+static Metric *pin_metric(dshash_table *table, MetricSearch *search)
+{
+	Metric *entry;
+
+	entry = insert_metric(table, search, &search->key, true);
+	if (entry == NULL) {
+		Jsonb *labels = get_overflow_labels();
+
+		/* Over a series limit, the handle writes to the overflow series */
+		if (search->labels != NULL)
+			pfree(search->labels);
+		search->labels = MemoryContextAlloc(TopMemoryContext, VARSIZE(labels));
+		memcpy(search->labels, labels, VARSIZE(labels));
+
+		entry = insert_metric(table, search, &search->key, false);
+	}
+
+	entry->handle_refs++;
+
+	dshash_release_lock(table, entry);
+
+	return entry;
+}
+
+/*
+ * Drop a handle pin. A tombstone losing its last pin is removed for real.
+ */
+static void unpin_metric(dshash_table *table, const MetricSearch *search)
+{
+	Metric *entry;
+
+	entry = (Metric *)dshash_find(table, &search->key, true);
+	if (entry == NULL)
+		elog(ERROR, "pmetrics: pinned metric \"%s\" not found",
+		     search->name);
+
+	Assert(entry->handle_refs > 0);
+	entry->handle_refs--;
+
+	if (entry->handle_refs == 0 && entry->deleted) {
+		free_metric(entry);
+		dshash_delete_entry(table, entry);
+	} else {
+		dshash_release_lock(table, entry);
+	}
+}
+
+PG_FUNCTION_INFO_V1(increment_counter);
+Datum increment_counter(PG_FUNCTION_ARGS)
+{
+	Datum new_value;
+	Jsonb *labels_jsonb;
+	char *name_str = NULL;
+	bool buffered;
+
+	if (!pmetrics_enabled)
+		PG_RETURN_NULL();
+
+	PG_TRY();
+	{
+		extract_metric_args(fcinfo, 0, 1, &name_str, &labels_jsonb);
+		new_value = increment_by(name_str, labels_jsonb, METRIC_TYPE_COUNTER,
+		                         1, &buffered);
+	}
+	PG_CATCH();
+	{
+		if (name_str)
+			pfree(name_str);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pfree(name_str);
+
+	/* Only this backend's pending amount is known */
+	if (buffered)
+		PG_RETURN_NULL();
+
+	return new_value;
+}
+
+PG_FUNCTION_INFO_V1(increment_counter_by);
+Datum increment_counter_by(PG_FUNCTION_ARGS)
+{
+	Datum new_value;
+	Jsonb *labels_jsonb;
+	char *name_str = NULL;
+	int increment;
+	bool buffered;
+
+	if (!pmetrics_enabled)
+		PG_RETURN_NULL();
+
+	PG_TRY();
+	{
+		extract_metric_args(fcinfo, 0, 1, &name_str, &labels_jsonb);
+		increment = PG_GETARG_INT32(2);
+
+		if (increment <= 0)
+			elog(ERROR, "increment must be greater than 0");
+
+		new_value = increment_by(name_str, labels_jsonb, METRIC_TYPE_COUNTER,
+		                         increment, &buffered);
+	}
+	PG_CATCH();
+	{
+		if (name_str)
+			pfree(name_str);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pfree(name_str);
+
+	/* Only this backend's pending amount is known */
+	if (buffered)
+		PG_RETURN_NULL();
+
+	return new_value;
+}
+
+PG_FUNCTION_INFO_V1(set_gauge);
+Datum set_gauge(PG_FUNCTION_ARGS)
+{
+	Jsonb *labels_jsonb;
+	char *name_str = NULL;
+	int64 new_value;
+	int64 result;
+
+	if (!pmetrics_enabled)
+		PG_RETURN_NULL();
+
+	PG_TRY();
+	{
+		extract_metric_args(fcinfo, 0, 1, &name_str, &labels_jsonb);
+		new_value = PG_GETARG_INT64(2);
+
+		result = pmetrics_set_gauge(name_str, labels_jsonb, new_value);
+	}
+	PG_CATCH();
+	{
+		if (name_str)
+			pfree(name_str);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pfree(name_str);
+	PG_RETURN_INT64(result);
+}
+
+PG_FUNCTION_INFO_V1(add_to_gauge);
+Datum add_to_gauge(PG_FUNCTION_ARGS)
+{
+	Datum new_value;
+	Jsonb *labels_jsonb;
+	char *name_str = NULL;
+	int increment;
+	bool buffered;
+
+	if (!pmetrics_enabled)
+		PG_RETURN_NULL();
+
+	PG_TRY();
+	{
+		extract_metric_args(fcinfo, 0, 1, &name_str, &labels_jsonb);
+		increment = PG_GETARG_INT32(2);
+
+		if (increment == 0)
+			elog(ERROR, "value can't be 0");
+
+		new_value = increment_by(name_str, labels_jsonb, METRIC_TYPE_GAUGE,
+		                         increment, &buffered);
+	}
+	PG_CATCH();
+	{
+		if (name_str)
+			pfree(name_str);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pfree(name_str);
+
+	/* Only this backend's pending amount is known */
+	if (buffered)
+		PG_RETURN_NULL();
+
+	return new_value;
+}
+
+static const char *metric_type_name(MetricType type)
+{
+	switch (type) {
+	case METRIC_TYPE_COUNTER:
+		return "counter";
+	case METRIC_TYPE_GAUGE:
+		return "gauge";
+	case METRIC_TYPE_HISTOGRAM:
+		return "histogram";
+	case METRIC_TYPE_HISTOGRAM_SUM:
+		return "histogram_sum";
+	default:
+		return "unknown";
+	}
+}
+
+static void put_metric_row(ReturnSetInfo *rsinfo, const SnapshotRow *row,
+                           const MetricSnapshot *snapshot)
+{
+	Datum values[7];
+	bool nulls[7] = {false, false, false, false, false, false, false};
+	int col = 0;
+
+	if (snapshot->with_generation)
+		values[col++] = Int64GetDatum((int64)snapshot->generation);
+	values[col++] = row->name;
+	nulls[col] = row->labels == (Datum)0;
+	values[col++] = row->labels;
+	values[col++] = CStringGetTextDatum(metric_type_name(row->type));
+	nulls[col] = row->removed;
+	values[col++] = Int32GetDatum(row->bucket);
+	nulls[col] = row->removed;
+	values[col++] = Int64GetDatum(row->value);
+	if (snapshot->with_removed)
+		values[col++] = BoolGetDatum(row->removed);
+
+	tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+}
+
+/*
+ * Local copy of an interned name (as text) or label set, made once per
+ * snapshot.
+ */
+static Datum snapshot_value(MetricSnapshot *snapshot, InternedKind kind,
+                            uint64 id, dsa_pointer value)
+{
+	SnapshotValue *copy;
+	bool found;
+
+	copy = (SnapshotValue *)hash_search(snapshot->values, &id, HASH_ENTER,
+	                                    &found);
+	if (!found) {
+		const void *shared = dsa_get_address(local_dsa, value);
+		MemoryContext oldcontext;
+
+		oldcontext = MemoryContextSwitchTo(snapshot->values_context);
+		if (kind == INTERNED_NAME) {
+			copy->datum = CStringGetTextDatum((const char *)shared);
+		} else {
+			void *labels = palloc(VARSIZE(shared));
+
+			memcpy(labels, shared, VARSIZE(shared));
+			copy->datum = PointerGetDatum(labels);
+		}
+		MemoryContextSwitchTo(oldcontext);
+
+		snapshot->value_bytes +=
+		    sizeof(SnapshotValue) + VARSIZE(DatumGetPointer(copy->datum));
+	}
+
+	return copy->datum;
+}
+
+static SnapshotRow *add_snapshot_row(MetricSnapshot *snapshot)
+{
+	if (snapshot->count == snapshot->capacity) {
+		snapshot->capacity *= 2;
+		snapshot->rows = (SnapshotRow *)repalloc_huge(
+		    snapshot->rows, snapshot->capacity * sizeof(SnapshotRow));
+	}
+
+	snapshot->rows[snapshot->count].removed = false;
+
+	return &snapshot->rows[snapshot->count++];
+}
+
+/*
+ * Copy the rows of an entry among row_types: one for counters and gauges,
+ * one per non-empty bucket and one for the sum for histograms. Runs under
+ * the partition lock of the entry, so only copies values.
+ */
+static void snapshot_metric(MetricSnapshot *snapshot, Metric *metric,
+                            uint32 row_types)
+{
+	Datum name;
+	Datum labels = (Datum)0;
+	SnapshotRow *row;
+	int i;
+
+	if (metric->key.type == METRIC_TYPE_HISTOGRAM) {
+		if ((row_types &
+		     (METRIC_TYPE_BIT(METRIC_TYPE_HISTOGRAM) |
+		      METRIC_TYPE_BIT(METRIC_TYPE_HISTOGRAM_SUM))) == 0)
+			return;
+	} else if ((row_types & METRIC_TYPE_BIT(metric->key.type)) == 0) {
+		return;
+	}
+
+	name = snapshot_value(snapshot, INTERNED_NAME, metric->key.name_id,
+	                      metric->name);
+	if (DsaPointerIsValid(metric->labels))
+		labels = snapshot_value(snapshot, INTERNED_LABELS,
+		                        metric->key.labels_id, metric->labels);
+
+	if (metric->key.type != METRIC_TYPE_HISTOGRAM) {
+		row = add_snapshot_row(snapshot);
+		row->name = name;
+		row->labels = labels;
+		row->type = metric->key.type;
+		row->bucket = 0;
+		row->value = metric_cell_value(metric, 0);
+		return;
+	}
+
+	for (i = 0; i <= max_bucket_exp &&
+	            (row_types & METRIC_TYPE_BIT(METRIC_TYPE_HISTOGRAM)) != 0;
+	     i++) {
+		int64 bucket_count;
+
+		if (bucket_cells[i] != i)
+			continue;
+
+		bucket_count = metric_cell_value(metric, HISTOGRAM_BUCKET_CELL(i));
+		if (bucket_count == 0)
+			continue;
+
+		row = add_snapshot_row(snapshot);
+		row->name = name;
+		row->labels = labels;
+		row->type = METRIC_TYPE_HISTOGRAM;
+		row->bucket = bucket_upper_bound(i);
+		row->value = bucket_count;
+	}
+
+	if ((row_types & METRIC_TYPE_BIT(METRIC_TYPE_HISTOGRAM_SUM)) != 0) {
+		row = add_snapshot_row(snapshot);
+		row->name = name;
+		row->labels = labels;
+		row->type = METRIC_TYPE_HISTOGRAM_SUM;
+		row->bucket = 0;
+		row->value = metric_cell_value(metric, HISTOGRAM_SUM_CELL);
+	}
+}
+
+/*
+ * Append the keys of the live series accepted by filter to a list, allocated
+ * in CurrentMemoryContext, scanning the whole table. Each partition is held
+ * shared only while its keys are copied.
+ */
+static void scan_series_keys(dshash_table *table, const MetricFilter *filter,
+                             SeriesList *series)
+{
+	dshash_seq_status status;
+	Metric *metric;
+
+	dshash_seq_init(&status, table, false); /* false = shared lock */
+	while ((metric = (Metric *)dshash_seq_next(&status)) != NULL) {
+		/* Tombstones kept alive by handles are not visible */
+		if (metric->deleted)
+			continue;
+
+		if (pg_atomic_read_u64(&metric->modified) < filter->modified_since)
+			continue;
+
+		if (filter->labels_ids != NULL &&
+		    hash_search(filter->labels_ids, &metric->key.labels_id,
+		                HASH_FIND, NULL) == NULL)
+			continue;
+
+		if (series->count == series->capacity) {
+			series->capacity = Max(series->capacity * 2, 1024);
+			if (series->keys == NULL)
+				series->keys = (MetricKey *)palloc(series->capacity *
+				                                   sizeof(MetricKey));
+			else
+				series->keys = (MetricKey *)repalloc_huge(
+				    series->keys, series->capacity * sizeof(MetricKey));
+		}
+		series->keys[series->count++] = metric->key;
+	}
+	dshash_seq_term(&status);
+}
+
+/*
+ * Copy the rows of the entries accepted by filter into a snapshot, allocated
+ * in CurrentMemoryContext. The series of the matching names are looked up
+ * one by one when the filter has them. Otherwise the keys of every series
+ * are collected by a table scan first, and then looked up the same way.
+ *
+ * Each series is copied under the shared partition lock of its own lookup,
+ * held only to copy its cell values and, once per snapshot, its name and
+ * label set. Updates of existing series take partition locks shared too, so
+ * they never wait for readers; writers creating or removing series wait at
+ * most for one series to be copied. Since series are copied one at a time,
+ * the snapshot isn't a point-in-time view: each value is as of its own
+ * lookup.
+ *
+ * With rsinfo, memory stays bounded apart from the keys: the rows copied so
+ * far are written out, between lookups, when they pass work_mem, so the
+ * tuplestore spills to disk as usual. Without it, as for exports that need
+ * every row at once, all of them are kept.
+ */
+static void take_snapshot(MetricSnapshot *snapshot, const MetricFilter *filter,
+                          ReturnSetInfo *rsinfo)
+{
+	dshash_table *table;
+	SeriesList scanned = {NULL, 0, 0};
+	const SeriesList *series = filter->series;
+	Metric *metric;
+	int64 i;
+
+	table = get_metrics_table();
+
+	/* Make this backend's own buffered updates visible */
+	flush_pending_deltas();
+
+	snapshot->rsinfo = rsinfo;
+	snapshot->values_context = AllocSetContextCreate(
+	    CurrentMemoryContext, "pmetrics snapshot values",
+	    ALLOCSET_DEFAULT_SIZES);
+	init_snapshot_values(snapshot);
+	snapshot->capacity = 1024;
+	snapshot->count = 0;
+	snapshot->rows =
+	    (SnapshotRow *)palloc(snapshot->capacity * sizeof(SnapshotRow));
+	snapshot->generation =
+	    pg_atomic_add_fetch_u64(&shared_state->snapshot_generation, 1);
+
+	/*
+	 * Removals are copied after the generation moves on and before the
+	 * series, so a series removed then created again is listed removed
+	 * first, and one removed while series are copied is in the next
+	 * snapshot.
+	 */
+	if (filter->removed_since > 0)
+		snapshot_removals(snapshot, filter->removed_since);
+
+	if (series == NULL) {
+		scan_series_keys(table, filter, &scanned);
+		series = &scanned;
+	}
+
+	for (i = 0; i < series->count; i++) {
+		const MetricKey *key = &series->keys[i];
+
+		if (filter->labels_ids != NULL &&
+		    hash_search(filter->labels_ids, &key->labels_id, HASH_FIND,
+		                NULL) == NULL)
+			continue;
+
+		/* No lock is held between lookups */
+		if (snapshot_full(snapshot))
+			flush_snapshot(snapshot);
+
+		metric = (Metric *)dshash_find(table, key, false);
+		if (metric == NULL)
+			continue;
+
+		if (!metric->deleted &&
+		    pg_atomic_read_u64(&metric->modified) >= filter->modified_since)
+			snapshot_metric(snapshot, metric, filter->row_types);
+		dshash_release_lock(table, metric);
+	}
+
+	if (scanned.keys != NULL)
+		pfree(scanned.keys);
+}
+
+/*
+ * Create the table of the copies of the names and label sets of a snapshot,
+ * in its values_context.
+ */
+static void init_snapshot_values(MetricSnapshot *snapshot)
+{
+	HASHCTL ctl;
+
+	ctl.keysize = sizeof(uint64);
+	ctl.entrysize = sizeof(SnapshotValue);
+	ctl.hcxt = snapshot->values_context;
+	snapshot->values = hash_create("pmetrics snapshot values", 256, &ctl,
+	                               HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	snapshot->value_bytes = 0;
+}
+
+/*
+ * Whether the rows and values copied into a snapshot written out as it is
+ * taken have reached work_mem.
+ */
+static bool snapshot_full(const MetricSnapshot *snapshot)
+{
+	return snapshot->rsinfo != NULL &&
+	       snapshot->count * sizeof(SnapshotRow) + snapshot->value_bytes >=
+	           (Size)work_mem * 1024;
+}
+
+/*
+ * Write the rows copied into a snapshot so far to its tuplestore, then drop
+ * them and the copies of their names and label sets. Does nothing for
+ * snapshots keeping every row. Runs between lookups, with no partition lock
+ * held.
+ */
+static void flush_snapshot(MetricSnapshot *snapshot)
+{
+	MemoryContext oldcontext;
+	int64 i;
+
+	if (snapshot->rsinfo == NULL || snapshot->count == 0)
+		return;
+
+	/* The type names are built for each row, free them with the copies */
+	oldcontext = MemoryContextSwitchTo(snapshot->values_context);
+	for (i = 0; i < snapshot->count; i++)
+		put_metric_row(snapshot->rsinfo, &snapshot->rows[i], snapshot);
+	MemoryContextSwitchTo(oldcontext);
+
+	snapshot->count = 0;
+	MemoryContextReset(snapshot->values_context);
+	init_snapshot_values(snapshot);
+}
+
+/*
+ * Add a row for each series removed in generation since or later, see
+ * log_removal(). Fails if some of them are no longer remembered.
+ */
+static void snapshot_removals(MetricSnapshot *snapshot, uint64 since)
+{
+	uint64 i;
+
+	LWLockAcquire(removal_log->lock, LW_SHARED);
+
+	if (since <= removal_log->lost) {
+		LWLockRelease(removal_log->lock);
+		ereport(ERROR,
+		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		         errmsg("series removed since generation " UINT64_FORMAT
+		                " are no longer known",
+		                since),
+		         errhint("Call list_metrics_since(0) and replace all "
+		                 "series.")));
+	}
+
+	i = removal_log->next > REMOVAL_LOG_SIZE
+	        ? removal_log->next - REMOVAL_LOG_SIZE
+	        : 0;
+	for (; i < removal_log->next; i++) {
+		RemovedSeries *record = &removal_log->records[i % REMOVAL_LOG_SIZE];
+		SnapshotRow *row;
+
+		if (record->modified < since)
+			continue;
+
+		row = add_snapshot_row(snapshot);
+		row->name = snapshot_value(snapshot, INTERNED_NAME,
+		                           record->key.name_id, record->name);
+		row->labels = DsaPointerIsValid(record->labels)
+		                  ? snapshot_value(snapshot, INTERNED_LABELS,
+		                                   record->key.labels_id,
+		                                   record->labels)
+		                  : (Datum)0;
+		row->type = record->key.type;
+		row->bucket = 0;
+		row->value = 0;
+		row->removed = true;
+	}
+
+	LWLockRelease(removal_log->lock);
+}
+
+/*
+ * Write the rows of the entries accepted by filter, from a snapshot. Rows
+ * go to a tuplestore, which spills to disk past work_mem, as they are
+ * copied, see take_snapshot().
+ */
+static void put_matching_metrics(ReturnSetInfo *rsinfo,
+                                 const MetricFilter *filter,
+                                 bool with_generation, bool with_removed)
+{
+	MemoryContext snapshot_context;
+	MemoryContext oldcontext;
+	MetricSnapshot snapshot;
+
+	snapshot_context = AllocSetContextCreate(CurrentMemoryContext,
+	                                         "pmetrics snapshot",
+	                                         ALLOCSET_DEFAULT_SIZES);
+	oldcontext = MemoryContextSwitchTo(snapshot_context);
+
+	snapshot.with_generation = with_generation;
+	snapshot.with_removed = with_removed;
+	take_snapshot(&snapshot, filter, rsinfo);
+	flush_snapshot(&snapshot);
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(snapshot_context);
+}
+
+/*
+ * Set of the ids of the interned values of a kind accepted by match. match
+ * runs under a partition lock of the dictionary, in a memory context reset
+ * after each value. The keys of the series of the matching values are also
+ * appended to series if not NULL.
+ */
+static HTAB *match_interned_ids(InternedKind kind,
+                                bool (*match)(const void *value, Datum arg),
+                                Datum arg, SeriesList *series)
+{
+	HTAB *ids;
+	HASHCTL ctl;
+	dshash_seq_status status;
+	InternedEntry *entry;
+	MemoryContext match_context;
+	MemoryContext oldcontext;
+
+	ctl.keysize = sizeof(uint64);
+	ctl.entrysize = sizeof(uint64);
+	ctl.hcxt = CurrentMemoryContext;
+	ids = hash_create("pmetrics matching ids", 64, &ctl,
+	                  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	match_context = AllocSetContextCreate(
+	    CurrentMemoryContext, "pmetrics filter", ALLOCSET_SMALL_SIZES);
+
+	(void)get_metrics_table();
+
+	dshash_seq_init(&status, local_interned_table, false);
+	while ((entry = (InternedEntry *)dshash_seq_next(&status)) != NULL) {
+		bool matches;
+
+		if (entry->key.kind != kind)
+			continue;
+
+		oldcontext = MemoryContextSwitchTo(match_context);
+		matches =
+		    match(dsa_get_address(local_dsa, entry->key.value.dsa_ptr), arg);
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(match_context);
+
+		if (!matches)
+			continue;
+
+		hash_search(ids, &entry->id, HASH_ENTER, NULL);
+		if (series != NULL)
+			append_interned_series(series, entry);
+	}
+	dshash_seq_term(&status);
+
+	MemoryContextDelete(match_context);
+
+	return ids;
+}
+
+static bool name_matches_pattern(const void *value, Datum pattern)
+{
+	return DatumGetBool(DirectFunctionCall2Coll(
+	    textlike, C_COLLATION_OID, CStringGetTextDatum((const char *)value),
+	    pattern));
+}
+
+static bool labels_contain(const void *value, Datum labels)
+{
+	return DatumGetBool(DirectFunctionCall2(
+	    jsonb_contains, PointerGetDatum(value), labels));
+}
+
+/*
+ * Append the keys of the series of the names matching a LIKE pattern to a
+ * list. A pattern without wildcards is looked up directly instead of being
+ * matched against every name.
+ */
+static void match_names(text *pattern, SeriesList *series)
+{
+	char *pattern_str = text_to_cstring(pattern);
+
+	if (strpbrk(pattern_str, "%_\\") != NULL) {
+		hash_destroy(match_interned_ids(INTERNED_NAME, name_matches_pattern,
+		                                PointerGetDatum(pattern), series));
+		return;
+	}
+
+	if (strlen(pattern_str) < NAMEDATALEN)
+		(void)find_interned_series(INTERNED_NAME, pattern_str, series);
+}
+
+/*
+ * METRIC_TYPE_BITs of an array of list_metrics() type names.
+ */
+static uint32 parse_row_types(Datum *elems, int nelems)
+{
+	uint32 row_types = 0;
+	int i;
+
+	for (i = 0; i < nelems; i++) {
+		char *type_str = TextDatumGetCString(elems[i]);
+		MetricType type;
+
+		for (type = METRIC_TYPE_COUNTER; type <= METRIC_TYPE_HISTOGRAM_SUM;
+		     type++) {
+			if (strcmp(type_str, metric_type_name(type)) == 0)
+				break;
+		}
+
+		if (type > METRIC_TYPE_HISTOGRAM_SUM)
+			elog(ERROR, "unknown metric type \"%s\"", type_str);
+
+		row_types |= METRIC_TYPE_BIT(type);
+	}
+
+	return row_types;
+}
+
+PG_FUNCTION_INFO_V1(list_metrics);
+Datum list_metrics(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	MetricFilter filter = {NULL, NULL, ALL_METRIC_TYPES};
+
+	InitMaterializedSRF(fcinfo, 0);
+	put_matching_metrics(rsinfo, &filter, false, false);
+
+	return (Datum)0;
+}
+
+/*
+ * list_metrics_snapshot(): the rows of list_metrics(), led by the generation
+ * of the snapshot they were copied in.
+ */
+PG_FUNCTION_INFO_V1(list_metrics_snapshot);
+Datum list_metrics_snapshot(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	MetricFilter filter = {NULL, NULL, ALL_METRIC_TYPES};
+
+	InitMaterializedSRF(fcinfo, 0);
+	put_matching_metrics(rsinfo, &filter, true, false);
+
+	return (Datum)0;
+}
+
+/*
+ * list_metrics_since(generation): the rows of list_metrics_snapshot() for
+ * the series written to since the snapshot of that generation was taken, led
+ * by the series removed since then. Generation 0 lists every series. The
+ * generation of the rows is the one to pass to the next call.
+ */
+PG_FUNCTION_INFO_V1(list_metrics_since);
+Datum list_metrics_since(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	MetricFilter filter = {NULL, NULL, ALL_METRIC_TYPES, 0, 0};
+	int64 since = PG_GETARG_INT64(0);
+	uint64 tracked_since;
+
+	if (since < 0)
+		elog(ERROR, "generation must not be negative");
+
+	if ((uint64)since >
+	    pg_atomic_read_u64(&shared_state->snapshot_generation))
+		ereport(ERROR,
+		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		         errmsg("generation " INT64_FORMAT " was not taken yet",
+		                since),
+		         errhint("Call list_metrics_since(0) and replace all "
+		                 "series.")));
+
+	/*
+	 * Updates from before changes were tracked aren't stamped, nor those
+	 * that raced with the first call tracking them, so every series is
+	 * listed until the generation of that call is passed.
+	 */
+	tracked_since = track_changes();
+	if ((uint64)since > tracked_since)
+		filter.modified_since = (uint64)since;
+	filter.removed_since = (uint64)since;
+
+	InitMaterializedSRF(fcinfo, 0);
+	put_matching_metrics(rsinfo, &filter, true, true);
+
+	return (Datum)0;
+}
+
+/*
+ * list_metrics(name_pattern, labels_contain, types): only the rows whose name
+ * matches a LIKE pattern, whose labels contain a JSONB object and whose type
+ * is listed. NULL arguments don't filter.
+ *
+ * Patterns and containment are evaluated once per distinct interned name and
+ * label set. The series of the matching names, or of the matching label sets
+ * without a name pattern, are found through their index instead of scanning
+ * the table. Series without labels never match a labels filter, like a NULL
+ * in SQL.
+ */
+PG_FUNCTION_INFO_V1(list_metrics_filtered);
+Datum list_metrics_filtered(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	MetricFilter filter = {NULL, NULL, ALL_METRIC_TYPES};
+	SeriesList series = {NULL, 0, 0};
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	if (!PG_ARGISNULL(2)) {
+		Datum *types;
+		int ntypes;
+
+		ntypes = get_array_arg(fcinfo, 2, TEXTOID, &types);
+		filter.row_types = parse_row_types(types, ntypes);
+	}
+
+	/* Series created by this backend's buffered updates are indexed */
+	if (!PG_ARGISNULL(0) || !PG_ARGISNULL(1))
+		flush_pending_deltas();
+
+	if (!PG_ARGISNULL(0)) {
+		filter.series = &series;
+		match_names(PG_GETARG_TEXT_PP(0), &series);
+		if (series.count == 0)
+			return (Datum)0;
+	} else if (!PG_ARGISNULL(1)) {
+		filter.series = &series;
+		match_labels(PG_GETARG_JSONB_P(1), &series);
+		if (series.count == 0)
+			return (Datum)0;
+	}
+
+	if (!PG_ARGISNULL(0) && !PG_ARGISNULL(1)) {
+		filter.labels_ids =
+		    match_interned_ids(INTERNED_LABELS, labels_contain,
+		                       PointerGetDatum(PG_GETARG_JSONB_P(1)), NULL);
+		if (hash_get_num_entries(filter.labels_ids) == 0)
+			return (Datum)0;
+	}
+
+	if (filter.row_types != 0)
+		put_matching_metrics(rsinfo, &filter, false, false);
+
+	return (Datum)0;
+}
+
+/*
+ * list_metrics_matching(labels): the rows of the series whose labels contain
+ * a JSONB object, see match_labels().
+ */
+PG_FUNCTION_INFO_V1(list_metrics_matching);
+Datum list_metrics_matching(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	MetricFilter filter = {NULL, NULL, ALL_METRIC_TYPES};
+	SeriesList series = {NULL, 0, 0};
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	/* Series created by this backend's buffered updates are indexed */
+	flush_pending_deltas();
+
+	match_labels(PG_GETARG_JSONB_P(0), &series);
+
+	filter.series = &series;
+	put_matching_metrics(rsinfo, &filter, false, false);
+
+	return (Datum)0;
+}
+
+/*
+ * Type of the series a list_metrics() row type belongs to.
+ */
+static MetricType metric_family(MetricType type)
+{
+	return type == METRIC_TYPE_HISTOGRAM_SUM ? METRIC_TYPE_HISTOGRAM : type;
+}
+
+/*
+ * Order of the rows of a snapshot in the exposition format: grouped by name,
+ * then by series, each histogram bucket rows first. Rows of a series are
+ * adjacent in the snapshot and already in order.
+ */
+static int compare_exposition_rows(const void *a, const void *b)
+{
+	const SnapshotRow *row_a = *(SnapshotRow *const *)a;
+	const SnapshotRow *row_b = *(SnapshotRow *const *)b;
+	MetricType family_a;
+	MetricType family_b;
+	int cmp;
+
+	if (row_a->name != row_b->name) {
+		cmp = compare_names(DatumGetTextPP(row_a->name),
+		                    DatumGetTextPP(row_b->name));
+		if (cmp != 0)
+			return cmp;
+	}
+
+	family_a = metric_family(row_a->type);
+	family_b = metric_family(row_b->type);
+	if (family_a != family_b)
+		return family_a < family_b ? -1 : 1;
+
+	/* Label sets are copied once per snapshot, so series share the datum */
+	if (row_a->labels != row_b->labels) {
+		if (row_a->labels == (Datum)0 || row_b->labels == (Datum)0)
+			return row_a->labels == (Datum)0 ? -1 : 1;
+		cmp = compare_labels(DatumGetPointer(row_a->labels),
+		                     DatumGetPointer(row_b->labels));
+		if (cmp != 0)
+			return cmp;
+	}
+
+	return row_a < row_b ? -1 : row_a > row_b;
+}
+
+/*
+ * Byte order of names copied as text, which doesn't depend on a collation so
+ * it can be used outside a transaction.
+ */
+static int compare_names(const text *a, const text *b)
+{
+	int len_a = VARSIZE_ANY_EXHDR(a);
+	int len_b = VARSIZE_ANY_EXHDR(b);
+	int cmp = memcmp(VARDATA_ANY(a), VARDATA_ANY(b), Min(len_a, len_b));
+
+	if (cmp != 0)
+		return cmp;
+
+	return len_a < len_b ? -1 : len_a > len_b;
+}
+
+/*
+ * Total order of label sets, by their JSONB bytes.
+ */
+static int compare_labels(const void *a, const void *b)
+{
+	Size size_a = VARSIZE(a);
+	Size size_b = VARSIZE(b);
+	int cmp = memcmp(a, b, Min(size_a, size_b));
+
+	if (cmp != 0)
+		return cmp;
+
+	return size_a < size_b ? -1 : size_a > size_b;
+}
+
+/*
+ * Append a metric or label name, replacing the characters Prometheus doesn't
+ * accept with underscores. Colons are only valid in metric names.
+ */
+static void append_prometheus_name(StringInfo out, const char *name, int len,
+                                   bool metric)
+{
+	int i;
+
+	/* ASCII only, whatever the locale */
+	if (len == 0 || (name[0] >= '0' && name[0] <= '9'))
+		appendStringInfoChar(out, '_');
+
+	for (i = 0; i < len; i++) {
+		char c = name[i];
+
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		    (c >= '0' && c <= '9') || c == '_' || (metric && c == ':'))
+			appendStringInfoChar(out, c);
+		else
+			appendStringInfoChar(out, '_');
+	}
+}
+
+/*
+ * Append a label value, escaping backslashes, quotes and newlines.
+ */
+static void append_prometheus_value(StringInfo out, const char *value,
+                                    int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		switch (value[i]) {
+		case '\\':
+			appendStringInfoString(out, "\\\\");
+			break;
+		case '"':
+			appendStringInfoString(out, "\\\"");
+			break;
+		case '\n':
+			appendStringInfoString(out, "\\n");
+			break;
+		default:
+			appendStringInfoChar(out, value[i]);
+			break;
+		}
+	}
+}
+
+/*
+ * Append the labels of a series without their closing brace, so a le label
+ * can be added: "{key="value",...". Nothing if the series has no labels.
+ * Strings are written as is, other scalars as in JSON and nested values as
+ * JSON text. Label sets that aren't objects are written as one "labels"
+ * label.
+ *
+ * Prometheus rejects samples with the same label twice. Keys that are the
+ * same once sanitized are only written the first time, in JSONB key order,
+ * and a le key of a histogram is renamed exported_le, as Prometheus does for
+ * labels that clash with its own.
+ */
+static void append_prometheus_labels(StringInfo out, Datum labels_datum,
+                                     bool histogram)
+{
+	Jsonb *labels = (Jsonb *)DatumGetPointer(labels_datum);
+	JsonbIterator *it;
+	JsonbIteratorToken token;
+	JsonbValue key;
+	JsonbValue value;
+	StringInfoData label;
+	List *written = NIL;
+	ListCell *lc;
+	char *text;
+	int len;
+	bool first = true;
+
+	if (labels == NULL)
+		return;
+
+	if (!JB_ROOT_IS_OBJECT(labels)) {
+		text = JsonbToCString(NULL, &labels->root, VARSIZE(labels));
+		appendStringInfoString(out, "{labels=\"");
+		append_prometheus_value(out, text, strlen(text));
+		appendStringInfoChar(out, '"');
+		return;
+	}
+
+	initStringInfo(&label);
+	it = JsonbIteratorInit(&labels->root);
+	while ((token = JsonbIteratorNext(&it, &key, true)) != WJB_DONE) {
+		bool duplicate = false;
+
+		if (token != WJB_KEY)
+			continue;
+
+		token = JsonbIteratorNext(&it, &value, true);
+		Assert(token == WJB_VALUE);
+
+		resetStringInfo(&label);
+		if (histogram && key.val.string.len == 2 &&
+		    memcmp(key.val.string.val, "le", 2) == 0)
+			appendStringInfoString(&label, "exported_");
+		append_prometheus_name(&label, key.val.string.val,
+		                       key.val.string.len, false);
+
+		foreach (lc, written) {
+			if (strcmp((char *)lfirst(lc), label.data) == 0) {
+				duplicate = true;
+				break;
+			}
+		}
+		if (duplicate)
+			continue;
+		written = lappend(written, pstrdup(label.data));
+
+		appendStringInfoChar(out, first ? '{' : ',');
+		first = false;
+
+		appendBinaryStringInfo(out, label.data, label.len);
+		appendStringInfoString(out, "=\"");
+		text = label_value_text(&value, &len);
+		append_prometheus_value(out, text, len);
+		appendStringInfoChar(out, '"');
+	}
+}
+
+/*
+ * Text of a label value: strings as is, other scalars as in JSON and nested
+ * values as JSON text. Empty for JSON null.
+ */
+static char *label_value_text(const JsonbValue *value, int *len)
+{
+	char *text;
+
+	switch (value->type) {
+	case jbvString:
+		*len = value->val.string.len;
+		return value->val.string.val;
+	case jbvNumeric:
+		text = DatumGetCString(DirectFunctionCall1(
+		    numeric_out, NumericGetDatum(value->val.numeric)));
+		break;
+	case jbvBool:
+		text = value->val.boolean ? "true" : "false";
+		break;
+	case jbvBinary:
+		text = JsonbToCString(NULL, value->val.binary.data,
+		                      value->val.binary.len);
+		break;
+	default:
+		text = "";
+		break;
+	}
+
+	*len = strlen(text);
+	return text;
+}
+
+/*
+ * Append a sample line: the family name with a suffix, the labels of the
+ * series, an optional le label and the value.
+ */
+static void append_prometheus_sample(StringInfo out, const StringInfo name,
+                                     const char *suffix,
+                                     const StringInfo labels, const char *le,
+                                     int64 value)
+{
+	char buf[MAXINT8LEN + 1];
+	int len;
+
+	appendBinaryStringInfo(out, name->data, name->len);
+	appendStringInfoString(out, suffix);
+
+	if (labels->len > 0 || le != NULL) {
+		appendBinaryStringInfo(out, labels->data, labels->len);
+		if (le != NULL) {
+			appendStringInfoString(out, labels->len > 0 ? ",le=\"" : "{le=\"");
+			appendStringInfoString(out, le);
+			appendStringInfoChar(out, '"');
+		}
+		appendStringInfoChar(out, '}');
+	}
+
+	appendStringInfoChar(out, ' ');
+	len = pg_lltoa(value, buf);
+	appendBinaryStringInfo(out, buf, len);
+	appendStringInfoChar(out, '\n');
+}
+
+/*
+ * Append the lines of the histogram whose rows start at rows[first]: a
+ * cumulative _bucket line for every bucket bound, then +Inf, _count and
+ * _sum. Returns the index of the first row past the histogram.
+ */
+static int64 append_prometheus_histogram(StringInfo out, SnapshotRow **rows,
+                                         int64 first, int64 count,
+                                         const StringInfo name,
+                                         const StringInfo labels)
+{
+	int64 next = first;
+	int64 cumulative = 0;
+	int64 sum = 0;
+	char le[MAXINT8LEN + 1];
+	int i;
+
+	for (i = 0; i <= max_bucket_exp; i++) {
+		int bound;
+
+		if (bucket_cells[i] != i)
+			continue;
+
+		bound = bucket_upper_bound(i);
+		while (next < count && rows[next]->type == METRIC_TYPE_HISTOGRAM &&
+		       rows[next]->name == rows[first]->name &&
+		       rows[next]->labels == rows[first]->labels &&
+		       rows[next]->bucket == bound) {
+			cumulative += rows[next]->value;
+			next++;
+		}
+
+		pg_lltoa(bound, le);
+		append_prometheus_sample(out, name, "_bucket", labels, le,
+		                         cumulative);
+	}
+
+	append_prometheus_sample(out, name, "_bucket", labels, "+Inf",
+	                         cumulative);
+	append_prometheus_sample(out, name, "_count", labels, NULL, cumulative);
+
+	if (next < count && rows[next]->type == METRIC_TYPE_HISTOGRAM_SUM &&
+	    rows[next]->name == rows[first]->name &&
+	    rows[next]->labels == rows[first]->labels)
+		sum = rows[next++]->value;
+	append_prometheus_sample(out, name, "_sum", labels, NULL, sum);
+
+	return next;
+}
+
+/*
+ * Append every series in the Prometheus text exposition format, with one
+ * TYPE line per name and cumulative buckets for histograms.
+ *
+ * The rows are copied out of shared memory like list_metrics() does, then
+ * sorted so each name is rendered in one go. Label sets are only rendered
+ * once per series. Names should have a single type: the TYPE line is the
+ * one of their first series.
+ */
+static void render_prometheus(StringInfo out)
+{
+	MemoryContext render_context;
+	MemoryContext oldcontext;
+	MetricFilter filter = {NULL, NULL, ALL_METRIC_TYPES};
+	MetricSnapshot snapshot;
+	SnapshotRow **rows;
+	StringInfoData name;
+	StringInfoData labels;
+	Datum current_name = (Datum)0;
+	int64 i;
+
+	render_context = AllocSetContextCreate(CurrentMemoryContext,
+	                                       "pmetrics render",
+	                                       ALLOCSET_DEFAULT_SIZES);
+	oldcontext = MemoryContextSwitchTo(render_context);
+
+	take_snapshot(&snapshot, &filter, NULL);
+
+	rows = (SnapshotRow **)palloc_extended(
+	    Max(snapshot.count, 1) * sizeof(SnapshotRow *), MCXT_ALLOC_HUGE);
+	for (i = 0; i < snapshot.count; i++)
+		rows[i] = &snapshot.rows[i];
+	qsort(rows, snapshot.count, sizeof(SnapshotRow *),
+	      compare_exposition_rows);
+
+	initStringInfo(&name);
+	initStringInfo(&labels);
+
+	i = 0;
+	while (i < snapshot.count) {
+		SnapshotRow *row = rows[i];
+
+		if (row->name != current_name) {
+			current_name = row->name;
+			resetStringInfo(&name);
+			append_prometheus_name(
+			    &name, VARDATA_ANY(DatumGetPointer(row->name)),
+			    VARSIZE_ANY_EXHDR(DatumGetPointer(row->name)), true);
+
+			appendStringInfoString(out, "# TYPE ");
+			appendBinaryStringInfo(out, name.data, name.len);
+			appendStringInfoChar(out, ' ');
+			appendStringInfoString(out,
+			                       metric_type_name(metric_family(row->type)));
+			appendStringInfoChar(out, '\n');
+		}
+
+		resetStringInfo(&labels);
+		append_prometheus_labels(&labels, row->labels,
+		                         metric_family(row->type) ==
+		                             METRIC_TYPE_HISTOGRAM);
+
+		if (row->type == METRIC_TYPE_HISTOGRAM ||
+		    row->type == METRIC_TYPE_HISTOGRAM_SUM) {
+			i = append_prometheus_histogram(out, rows, i, snapshot.count,
+			                                &name, &labels);
+		} else {
+			append_prometheus_sample(out, &name, "", &labels, NULL,
+			                         row->value);
+			i++;
+		}
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(render_context);
+}
+
+/*
+ * prometheus_text(): every series in the Prometheus text exposition format,
+ * as a single text value. The text is built in place, with room for its
+ * header, so it is not copied again.
+ */
+PG_FUNCTION_INFO_V1(prometheus_text);
+Datum prometheus_text(PG_FUNCTION_ARGS)
+{
+	StringInfoData out;
+
+	initStringInfo(&out);
+	appendStringInfoSpaces(&out, VARHDRSZ);
+
+	render_prometheus(&out);
+
+	SET_VARSIZE(out.data, out.len);
+	PG_RETURN_TEXT_P((text *)out.data);
+}
+
+/*
+ * Entry point of the HTTP background worker, see pmetrics.http_port. Serves
+ * one request at a time, rendering from shared memory without a database
+ * connection or a transaction.
+ *
+ * An error while serving a request only drops its connection: like the
+ * auxiliary processes of core, the worker reports it, cleans up and goes on
+ * listening.
+ */
+void pmetrics_http_main(Datum main_arg)
+{
+	sigjmp_buf local_sigjmp_buf;
+	MemoryContext context;
+	pgsocket listen_socket;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	(void)get_metrics_table();
+
+	listen_socket = open_http_socket();
+	context = AllocSetContextCreate(TopMemoryContext, "pmetrics http",
+	                                ALLOCSET_DEFAULT_SIZES);
+
+	if (sigsetjmp(local_sigjmp_buf, 1) != 0) {
+		error_context_stack = NULL;
+		HOLD_INTERRUPTS();
+
+		EmitErrorReport();
+		LWLockReleaseAll();
+		close_http_client();
+
+		MemoryContextSwitchTo(TopMemoryContext);
+		FlushErrorState();
+		MemoryContextReset(context);
+
+		RESUME_INTERRUPTS();
+	}
+	PG_exception_stack = &local_sigjmp_buf;
+
+	for (;;) {
+		int rc;
+
+		/* Before waiting, serving a client may have reset the latch */
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending) {
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		rc = WaitLatchOrSocket(MyLatch,
+		                       WL_LATCH_SET | WL_SOCKET_READABLE |
+		                           WL_EXIT_ON_PM_DEATH,
+		                       listen_socket, -1, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		if (rc & WL_SOCKET_READABLE) {
+			MemoryContext oldcontext = MemoryContextSwitchTo(context);
+
+			serve_http_client(listen_socket);
+			MemoryContextSwitchTo(oldcontext);
+			MemoryContextReset(context);
+		}
+	}
+}
+
+/*
+ * Listen on pmetrics.http_listen_address and pmetrics.http_port, with a
+ * non-blocking socket.
+ */
+static pgsocket open_http_socket(void)
+{
+	struct addrinfo hints;
+	struct addrinfo *addrs;
+	struct addrinfo *addr;
+	char port[16];
+	pgsocket sock = PGINVALID_SOCKET;
+	int one = 1;
+	int ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	snprintf(port, sizeof(port), "%d", http_port);
+
+	ret = getaddrinfo(http_listen_address[0] != '\0' ? http_listen_address
+	                                                 : NULL,
+	                  port, &hints, &addrs);
+	if (ret != 0)
+		ereport(ERROR,
+		        (errmsg("pmetrics: could not resolve \"%s\": %s",
+		                http_listen_address, gai_strerror(ret))));
+
+	for (addr = addrs; addr != NULL; addr = addr->ai_next) {
+		sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		if (sock == PGINVALID_SOCKET)
+			continue;
+
+		(void)setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		if (bind(sock, addr->ai_addr, addr->ai_addrlen) == 0 &&
+		    listen(sock, HTTP_LISTEN_BACKLOG) == 0 &&
+		    pg_set_noblock(sock))
+			break;
+
+		close(sock);
+		sock = PGINVALID_SOCKET;
+	}
+
+	freeaddrinfo(addrs);
+
+	if (sock == PGINVALID_SOCKET)
+		ereport(ERROR,
+		        (errcode_for_socket_access(),
+		         errmsg("pmetrics: could not listen on \"%s\" port %d: %m",
+		                http_listen_address, http_port)));
+
+	ereport(LOG, (errmsg("pmetrics: serving metrics on \"%s\" port %d",
+	                     http_listen_address, http_port)));
+
+	return sock;
+}
+
+/*
+ * Accept a connection and answer its request. Only GET and HEAD of /metrics
+ * are served, and the connection is closed after the response. Clients get
+ * HTTP_TIMEOUT_MS in all to send their request, and again to read the
+ * response, or they are dropped, so one can't stall the worker.
+ */
+static void serve_http_client(pgsocket listen_socket)
+{
+	pgsocket sock;
+	TimestampTz deadline;
+	char request[HTTP_MAX_REQUEST];
+	Size len = 0;
+	char *path;
+	char *end;
+	bool head;
+	StringInfoData body;
+	StringInfoData response;
+
+	sock = accept(listen_socket, NULL, NULL);
+	if (sock == PGINVALID_SOCKET)
+		return;
+	http_client = sock;
+
+	/* Whether it inherits O_NONBLOCK from the listen socket varies by OS */
+	if (!pg_set_noblock(sock)) {
+		close_http_client();
+		return;
+	}
+
+	deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+	                                       HTTP_TIMEOUT_MS);
+
+	/* Only the request line matters, read up to the end of the headers */
+	while (len < sizeof(request) - 1) {
+		ssize_t received = recv(sock, request + len, sizeof(request) - 1 - len,
+		                        0);
+
+		if (received < 0 &&
+		    (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			if (!wait_http_client(sock, WL_SOCKET_READABLE, deadline)) {
+				close_http_client();
+				return;
+			}
+			continue;
+		}
+		if (received <= 0) {
+			close_http_client();
+			return;
+		}
+		len += received;
+		request[len] = '\0';
+		if (strstr(request, "\r\n\r\n") != NULL)
+			break;
+	}
+
+	initStringInfo(&response);
+	initStringInfo(&body);
+
+	head = strncmp(request, "HEAD ", 5) == 0;
+	if (!head && strncmp(request, "GET ", 4) != 0) {
+		append_http_response(&response, "405 Method Not Allowed", &body,
+		                     false);
+	} else {
+		path = strchr(request, ' ') + 1;
+		end = path + strcspn(path, " ?\r\n");
+
+		if (end - path == strlen("/metrics") &&
+		    strncmp(path, "/metrics", end - path) == 0) {
+			render_prometheus(&body);
+			append_http_response(&response, "200 OK", &body, head);
+		} else {
+			append_http_response(&response, "404 Not Found", &body, false);
+		}
+	}
+
+	deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+	                                       HTTP_TIMEOUT_MS);
+	(void)send_all(sock, response.data, response.len, deadline);
+	close_http_client();
+}
+
+/*
+ * Append a whole response, with its status, headers and, unless only the
+ * headers were asked for, its body.
+ */
+static void append_http_response(StringInfo response, const char *status,
+                                 const StringInfo body, bool head)
+{
+	appendStringInfo(response,
+	                 "HTTP/1.1 %s\r\n"
+	                 "Content-Type: " PROMETHEUS_CONTENT_TYPE "\r\n"
+	                 "Content-Length: %d\r\n"
+	                 "Connection: close\r\n"
+	                 "\r\n",
+	                 status, body->len);
+
+	if (!head)
+		appendBinaryStringInfo(response, body->data, body->len);
+}
+
+/*
+ * Send a buffer in full on a non-blocking socket, by deadline. Returns false
+ * if the client went away or is too slow to read it.
+ */
+static bool send_all(pgsocket sock, const char *data, Size len,
+                     TimestampTz deadline)
+{
+	while (len > 0) {
+		ssize_t sent = send(sock, data, len, 0);
+
+		if (sent < 0 &&
+		    (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			if (!wait_http_client(sock, WL_SOCKET_WRITEABLE, deadline))
+				return false;
+			continue;
+		}
+		if (sent <= 0)
+			return false;
+
+		data += sent;
+		len -= sent;
+	}
+
+	return true;
+}
+
+/*
+ * Wait until a client socket may be ready for events, or the latch is set,
+ * for at most the time left before deadline. Returns false once the deadline
+ * has passed. Interrupts are processed, so shutdown isn't held up by a
+ * client.
+ */
+static bool wait_http_client(pgsocket sock, int events, TimestampTz deadline)
+{
+	long timeout;
+	int rc;
+
+	timeout = TimestampDifferenceMilliseconds(GetCurrentTimestamp(), deadline);
+	if (timeout <= 0)
+		return false;
+
+	rc = WaitLatchOrSocket(MyLatch,
+	                       WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH |
+	                           events,
+	                       sock, timeout, PG_WAIT_EXTENSION);
+	if (rc & WL_LATCH_SET) {
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	return true;
+}
+
+static void close_http_client(void)
+{
+	if (http_client != PGINVALID_SOCKET) {
+		close(http_client);
+		http_client = PGINVALID_SOCKET;
+	}
+}
+
+/*
+ * Initialize a dictionary of the values of a snapshot, in
+ * CurrentMemoryContext.
+ */
+static void init_export_dictionary(ExportDictionary *dictionary,
+                                   const char *name)
+{
+	HASHCTL ctl;
+
+	ctl.keysize = sizeof(Datum);
+	ctl.entrysize = sizeof(ExportIndex);
+	ctl.hcxt = CurrentMemoryContext;
+	dictionary->indexes = hash_create(name, 256, &ctl,
+	                                  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	dictionary->capacity = 256;
+	dictionary->count = 0;
+	dictionary->values =
+	    (Datum *)palloc(dictionary->capacity * sizeof(Datum));
+}
+
+/*
+ * Index of a value in a dictionary, added if needed. Snapshots copy each
+ * name and label set once, so values are found by address.
+ */
+static uint32 export_dictionary_index(ExportDictionary *dictionary,
+                                      Datum value)
+{
+	ExportIndex *index;
+	bool found;
+
+	index = (ExportIndex *)hash_search(dictionary->indexes, &value,
+	                                   HASH_ENTER, &found);
+	if (!found) {
+		if (dictionary->count == dictionary->capacity) {
+			dictionary->capacity *= 2;
+			dictionary->values = (Datum *)repalloc_huge(
+			    dictionary->values, dictionary->capacity * sizeof(Datum));
+		}
+		index->index = dictionary->count;
+		dictionary->values[dictionary->count++] = value;
+	}
+
+	return index->index;
+}
+
+/*
+ * Append bytes to the export, returning a chunk each time EXPORT_CHUNK_SIZE
+ * bytes are buffered. The buffer starts with room for the varlena header, so
+ * chunks are returned without another copy.
+ */
+static void export_put(ExportWriter *writer, const void *data, Size len)
+{
+	appendBinaryStringInfo(&writer->buf, (const char *)data, len);
+	writer->offset += len;
+
+	if (writer->buf.len - VARHDRSZ >= EXPORT_CHUNK_SIZE)
+		export_flush(writer);
+}
+
+static void export_put_uint32(ExportWriter *writer, uint32 value)
+{
+	uint8 bytes[4];
+	int i;
+
+	for (i = 0; i < 4; i++)
+		bytes[i] = (uint8)(value >> (8 * i));
+	export_put(writer, bytes, sizeof(bytes));
+}
+
+static void export_put_uint64(ExportWriter *writer, uint64 value)
+{
+	uint8 bytes[8];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		bytes[i] = (uint8)(value >> (8 * i));
+	export_put(writer, bytes, sizeof(bytes));
+}
+
+/*
+ * Append a string as its uint32 length and bytes.
+ */
+static void export_put_string(ExportWriter *writer, const char *value,
+                              int len)
+{
+	export_put_uint32(writer, (uint32)len);
+	export_put(writer, value, len);
+}
+
+/*
+ * Append zero bytes up to the next multiple of 8 from the start of the
+ * export, so fixed-width arrays can be read in place.
+ */
+static void export_pad(ExportWriter *writer)
+{
+	static const uint8 zeros[8] = {0};
+
+	if (writer->offset % 8 != 0)
+		export_put(writer, zeros, 8 - writer->offset % 8);
+}
+
+/*
+ * Return the buffered bytes as a chunk, if any.
+ */
+static void export_flush(ExportWriter *writer)
+{
+	bool null = false;
+	Datum chunk;
+
+	if (writer->buf.len == VARHDRSZ)
+		return;
+
+	SET_VARSIZE(writer->buf.data, writer->buf.len);
+	chunk = PointerGetDatum(writer->buf.data);
+	tuplestore_putvalues(writer->rsinfo->setResult, writer->rsinfo->setDesc,
+	                     &chunk, &null);
+
+	resetStringInfo(&writer->buf);
+	appendStringInfoSpaces(&writer->buf, VARHDRSZ);
+}
+
+/*
+ * Append a label set of the label dictionary: its number of labels, then
+ * each key and value as strings, see label_value_text(). Label sets that
+ * aren't objects are exported as one "labels" label, like in
+ * prometheus_text().
+ */
+static void export_put_labels(ExportWriter *writer, Datum labels_datum)
+{
+	Jsonb *labels = (Jsonb *)DatumGetPointer(labels_datum);
+	JsonbIterator *it;
+	JsonbIteratorToken token;
+	JsonbValue key;
+	JsonbValue value;
+	char *text;
+	int len;
+
+	if (!JB_ROOT_IS_OBJECT(labels)) {
+		text = JsonbToCString(NULL, &labels->root, VARSIZE(labels));
+		export_put_uint32(writer, 1);
+		export_put_string(writer, "labels", strlen("labels"));
+		export_put_string(writer, text, strlen(text));
+		return;
+	}
+
+	export_put_uint32(writer, JB_ROOT_COUNT(labels));
+
+	it = JsonbIteratorInit(&labels->root);
+	while ((token = JsonbIteratorNext(&it, &key, true)) != WJB_DONE) {
+		if (token != WJB_KEY)
+			continue;
+
+		token = JsonbIteratorNext(&it, &value, true);
+		Assert(token == WJB_VALUE);
+
+		export_put_string(writer, key.val.string.val, key.val.string.len);
+		text = label_value_text(&value, &len);
+		export_put_string(writer, text, len);
+	}
+}
+
+/*
+ * Index of a histogram bucket bound in bounds, which is sorted.
+ */
+static int export_bucket_index(const int32 *bounds, int nbounds, int bound)
+{
+	int low = 0;
+	int high = nbounds - 1;
+
+	while (low < high) {
+		int middle = (low + high) / 2;
+
+		if (bounds[middle] < bound)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+/*
+ * export_binary(): every series in the columnar layout documented in the
+ * README, as a stream of bytea chunks to concatenate in order.
+ *
+ * The rows are copied out of shared memory like list_metrics() does, then
+ * grouped back into series, whose names and label sets are numbered in
+ * dictionaries. The export is written in about EXPORT_CHUNK_SIZE chunks, so
+ * only one of them is buffered at a time besides the snapshot.
+ */
+PG_FUNCTION_INFO_V1(export_binary);
+Datum export_binary(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	MemoryContext export_context;
+	MemoryContext oldcontext;
+	MetricFilter filter = {NULL, NULL, ALL_METRIC_TYPES};
+	MetricSnapshot snapshot;
+	ExportDictionary names;
+	ExportDictionary label_sets;
+	ExportSeries *series;
+	ExportWriter writer;
+	int32 *bounds;
+	int nbounds = 0;
+	int64 *counts;
+	uint32 nseries = 0;
+	uint32 nhistograms = 0;
+	uint32 i;
+	int64 row;
+	int j;
+
+	/* A set of a scalar type has no row type of its own */
+	InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+
+	export_context = AllocSetContextCreate(CurrentMemoryContext,
+	                                       "pmetrics export",
+	                                       ALLOCSET_DEFAULT_SIZES);
+	oldcontext = MemoryContextSwitchTo(export_context);
+
+	take_snapshot(&snapshot, &filter, NULL);
+
+	bounds = (int32 *)palloc((max_bucket_exp + 1) * sizeof(int32));
+	for (j = 0; j <= max_bucket_exp; j++) {
+		if (bucket_cells[j] == j)
+			bounds[nbounds++] = bucket_upper_bound(j);
+	}
+
+	/* Histograms have their bucket rows then their sum row */
+	init_export_dictionary(&names, "pmetrics export names");
+	init_export_dictionary(&label_sets, "pmetrics export label sets");
+	series = (ExportSeries *)palloc_extended(
+	    Max(snapshot.count, 1) * sizeof(ExportSeries), MCXT_ALLOC_HUGE);
+	for (row = 0; row < snapshot.count; row++) {
+		SnapshotRow *current = &snapshot.rows[row];
+		ExportSeries *entry;
+
+		if (current->type == METRIC_TYPE_HISTOGRAM)
+			continue;
+
+		entry = &series[nseries++];
+		entry->type = metric_family(current->type);
+		entry->value = current->value;
+		entry->name = export_dictionary_index(&names, current->name);
+		entry->labels =
+		    current->labels != (Datum)0
+		        ? export_dictionary_index(&label_sets, current->labels)
+		        : EXPORT_NO_LABELS;
+		entry->last_row = row;
+	}
+
+	writer.rsinfo = rsinfo;
+	writer.offset = 0;
+	initStringInfo(&writer.buf);
+	appendStringInfoSpaces(&writer.buf, VARHDRSZ);
+
+	export_put(&writer, EXPORT_MAGIC, strlen(EXPORT_MAGIC));
+	export_put_uint32(&writer, EXPORT_VERSION);
+	export_put_uint64(&writer, snapshot.generation);
+	export_put_uint32(&writer, names.count);
+	export_put_uint32(&writer, label_sets.count);
+	export_put_uint32(&writer, nseries);
+	export_put_uint32(&writer, (uint32)nbounds);
+
+	for (j = 0; j < nbounds; j++)
+		export_put_uint32(&writer, (uint32)bounds[j]);
+
+	for (i = 0; i < names.count; i++) {
+		const text *name = (const text *)DatumGetPointer(names.values[i]);
+
+		export_put_string(&writer, VARDATA_ANY(name),
+		                  VARSIZE_ANY_EXHDR(name));
+	}
+
+	for (i = 0; i < label_sets.count; i++)
+		export_put_labels(&writer, label_sets.values[i]);
+
+	export_pad(&writer);
+
+	for (i = 0; i < nseries; i++)
+		export_put_uint64(&writer, (uint64)series[i].value);
+	for (i = 0; i < nseries; i++)
+		export_put_uint32(&writer, series[i].name);
+	for (i = 0; i < nseries; i++)
+		export_put_uint32(&writer, series[i].labels);
+	for (i = 0; i < nseries; i++) {
+		uint8 type = (uint8)series[i].type;
+
+		export_put(&writer, &type, 1);
+		if (series[i].type == METRIC_TYPE_HISTOGRAM)
+			nhistograms++;
+	}
+
+	export_pad(&writer);
+
+	/* Dense bucket counts of each histogram, from its non-empty rows */
+	counts = (int64 *)palloc(Max(nbounds, 1) * sizeof(int64));
+	row = 0;
+	for (i = 0; i < nseries && nhistograms > 0; i++) {
+		if (series[i].type != METRIC_TYPE_HISTOGRAM) {
+			row = series[i].last_row + 1;
+			continue;
+		}
+
+		memset(counts, 0, nbounds * sizeof(int64));
+		for (; row < series[i].last_row; row++)
+			counts[export_bucket_index(bounds, nbounds,
+			                           snapshot.rows[row].bucket)] +=
+			    snapshot.rows[row].value;
+		row = series[i].last_row + 1;
+
+		for (j = 0; j < nbounds; j++)
+			export_put_uint64(&writer, (uint64)counts[j]);
+	}
+
+	export_flush(&writer);
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(export_context);
+
+	return (Datum)0;
+}
+
+/*
+ * C API functions for other extensions to call
+ * These are marked with visibility("default") to be externally accessible
+ */
+
+__attribute__((visibility("default"))) int64
+pmetrics_increment_counter(const char *name_str, Jsonb *labels_jsonb)
+{
+	bool buffered;
+
+	validate_inputs(name_str);
+	return increment_by(name_str, labels_jsonb, METRIC_TYPE_COUNTER, 1,
+	                    &buffered);
+}
+
+__attribute__((visibility("default"))) int64 pmetrics_increment_counter_by(
+    const char *name_str, Jsonb *labels_jsonb, int64 amount)
+{
+	bool buffered;
+
+	validate_inputs(name_str);
+
+	if (amount <= 0)
+		elog(ERROR, "increment must be greater than 0");
+
+	return increment_by(name_str, labels_jsonb, METRIC_TYPE_COUNTER, amount,
+	                    &buffered);
+}
+
+__attribute__((visibility("default"))) int64
+pmetrics_set_gauge(const char *name_str, Jsonb *labels_jsonb, int64 value)
+{
+	Metric *entry;
+	MetricSearch search;
+	dshash_table *table;
+
+	validate_inputs(name_str);
+
+	table = get_metrics_table();
+	if (table == NULL)
+		elog(ERROR, "pmetrics not initialized");
+
+	init_metric_search(&search, name_str, labels_jsonb, METRIC_TYPE_GAUGE);
+
+	/* The new value supersedes additions still buffered in this backend */
+	discard_pending_delta(&search);
+
+	entry = find_live_metric(table, &search);
+	touch_metric(entry);
+	metric_set(entry, value);
+	dshash_release_lock(table, entry);
+
+	return value;
+}
+
+__attribute__((visibility("default"))) int64
+pmetrics_add_to_gauge(const char *name_str, Jsonb *labels_jsonb, int64 amount)
+{
+	bool buffered;
+
+	validate_inputs(name_str);
+
+	if (amount == 0)
+		elog(ERROR, "value can't be 0");
+
+	return increment_by(name_str, labels_jsonb, METRIC_TYPE_GAUGE, amount,
+	                    &buffered);
+}
+
+__attribute__((visibility("default"))) int64 pmetrics_record_to_histogram(
+    const char *name_str, Jsonb *labels_jsonb, double value)
+{
+	bool buffered;
+
+	validate_inputs(name_str);
+
+	return record_observation(name_str, labels_jsonb, value, &buffered);
+}
+
+__attribute__((visibility("default"))) int
+pmetrics_histogram_bucket(double value)
+{
+	return bucket_upper_bound(bucket_index_for(value));
+}
+
+static MetricType batch_op_metric_type(const PMetricsBatchOp *op)
+{
+	switch (op->type) {
+	case PMETRICS_INCREMENT_COUNTER:
+		return METRIC_TYPE_COUNTER;
+	case PMETRICS_SET_GAUGE:
+	case PMETRICS_ADD_TO_GAUGE:
+		return METRIC_TYPE_GAUGE;
+	case PMETRICS_RECORD_TO_HISTOGRAM:
+		return METRIC_TYPE_HISTOGRAM;
+	}
+
+	elog(ERROR, "pmetrics: unknown batch operation %d", (int)op->type);
+	return METRIC_TYPE_COUNTER; /* keep compiler quiet */
+}
+
+/*
+ * Check a batch update with the same rules as the individual functions.
+ */
+static void validate_batch_op(const PMetricsBatchOp *op)
+{
+	validate_inputs(op->name_str);
+
+	if (op->type == PMETRICS_INCREMENT_COUNTER && op->value <= 0)
+		elog(ERROR, "increment must be greater than 0");
+
+	if (op->type == PMETRICS_ADD_TO_GAUGE && op->value == 0)
+		elog(ERROR, "value can't be 0");
+}
+
+static void apply_batch_op(Metric *entry, const BatchItem *item)
+{
+	const PMetricsBatchOp *op = item->op;
+
+	switch (op->type) {
+	case PMETRICS_INCREMENT_COUNTER:
+	case PMETRICS_ADD_TO_GAUGE:
+		metric_add(entry, 0, op->value);
+		break;
+	case PMETRICS_SET_GAUGE:
+		metric_set(entry, op->value);
+		break;
+	case PMETRICS_RECORD_TO_HISTOGRAM:
+		metric_add(entry, HISTOGRAM_BUCKET_CELL(item->bucket_index), 1);
+		metric_add(entry, HISTOGRAM_SUM_CELL, (int64)op->observation);
+		break;
+	}
+}
+
+/*
+ * Order batch items by partition, then series, then position in the batch so
+ * updates of a series are adjacent and keep their order. The partition is
+ * only a locality hint: one partition lock is held at a time, so a wrong
+ * guess can't deadlock.
+ */
+static int compare_batch_items(const void *a, const void *b)
+{
+	const BatchItem *item1 = (const BatchItem *)a;
+	const BatchItem *item2 = (const BatchItem *)b;
+	int cmp;
+
+	if (item1->partition != item2->partition)
+		return (item1->partition < item2->partition) ? -1 : 1;
+
+	cmp = metric_compare_dshash(&item1->search.key, &item2->search.key,
+	                            sizeof(MetricKey), NULL);
+	if (cmp != 0)
+		return cmp;
+
+	return item1->order - item2->order;
+}
+
+/*
+ * dshash takes a partition lock for each lookup and can't hold one across
+ * lookups, so batching can't share a lock between series. Instead updates
+ * are resolved up front and sorted, so that each series is looked up once
+ * and partitions are visited in order.
+ */
+__attribute__((visibility("default"))) void
+pmetrics_apply_batch(const PMetricsBatchOp *ops, int nops)
+{
+	BatchItem *items;
+	MetricSearch last;
+	bool have_last = false;
+	dshash_table *table;
+	int nitems = 0;
+	int i;
+	int next;
+
+	if (nops <= 0)
+		return;
+
+	for (i = 0; i < nops; i++)
+		validate_batch_op(&ops[i]);
+
+	table = get_metrics_table();
+	if (table == NULL)
+		elog(ERROR, "pmetrics not initialized");
+
+	items = (BatchItem *)palloc(nops * sizeof(BatchItem));
+
+	for (i = 0; i < nops; i++) {
+		const PMetricsBatchOp *op = &ops[i];
+		BatchItem *item = &items[nitems];
+		MetricSearch *search = &item->search;
+		MetricType type = batch_op_metric_type(op);
+
+		item->op = op;
+		item->order = i;
+		item->bucket_index = 0;
+
+		if (have_last && op->labels_jsonb != NULL &&
+		    op->labels_jsonb == last.labels && metric_search_known(&last)) {
+			/* Same labels as the previous update, only resolve the name */
+			*search = last;
+			search->key.type = type;
+			if (strcmp(op->name_str, last.name) != 0) {
+				strlcpy(search->name, op->name_str, NAMEDATALEN);
+				search->key.name_id =
+				    lookup_interned_id(INTERNED_NAME, op->name_str, true);
+			}
+		} else {
+			init_metric_search(search, op->name_str, op->labels_jsonb, type);
+		}
+
+		if (type == METRIC_TYPE_HISTOGRAM)
+			item->bucket_index = bucket_index_for(op->observation);
+
+		/* items[nitems] is reused unless kept below, so keep a copy */
+		last = *search;
+		have_last = true;
+
+		if (op->type == PMETRICS_SET_GAUGE) {
+			/* Supersedes additions still buffered in this backend */
+			discard_pending_delta(search);
+		} else if (buffering_enabled() && metric_search_known(search)) {
+			if (type == METRIC_TYPE_HISTOGRAM)
+				buffer_observation(search, item->bucket_index,
+				                   (int64)op->observation);
+			else
+				buffer_delta(search, op->value);
+			continue;
+		}
+
+		if (!metric_search_known(search)) {
+			Metric *entry;
+
+			/*
+			 * New name or label set. Create the series right away, which
+			 * interns them so later updates in the batch find their ids.
+			 */
+			entry = find_live_metric(table, search);
+			touch_metric(entry);
+			apply_batch_op(entry, item);
+			dshash_release_lock(table, entry);
+			continue;
+		}
+
+		item->partition = PARTITION_FOR_HASH(metric_hash_dshash(
+		    &search->key, sizeof(MetricKey), NULL));
+		nitems++;
+	}
+
+	qsort(items, nitems, sizeof(BatchItem), compare_batch_items);
+
+	for (i = 0; i < nitems; i = next) {
+		Metric *entry;
+
+		entry = find_live_metric(table, &items[i].search);
+		touch_metric(entry);
+		for (next = i; next < nitems &&
+		               metric_compare_dshash(&items[next].search.key,
+		                                     &items[i].search.key,
+		                                     sizeof(MetricKey), NULL) == 0;
+		     next++)
+			apply_batch_op(entry, &items[next]);
+		dshash_release_lock(table, entry);
+	}
+
+	pfree(items);
+}
+
+PG_FUNCTION_INFO_V1(record_to_histogram);
+Datum record_to_histogram(PG_FUNCTION_ARGS)
+{
+	int64 result;
+	Jsonb *labels_jsonb;
+	char *name_str = NULL;
+	double value;
+	bool buffered;
+
+	if (!pmetrics_enabled)
+		PG_RETURN_NULL();
+
+	PG_TRY();
+	{
+		extract_metric_args(fcinfo, 0, 1, &name_str, &labels_jsonb);
+		value = PG_GETARG_FLOAT8(2);
+		validate_inputs(name_str);
+		result =
+		    record_observation(name_str, labels_jsonb, value, &buffered);
+	}
+	PG_CATCH();
+	{
+		if (name_str)
+			pfree(name_str);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pfree(name_str);
+
+	/* Only this backend's pending count is known */
+	if (buffered)
+		PG_RETURN_NULL();
+
+	PG_RETURN_INT64(result);
+}
+
+/*
+ * Increment counters given as parallel arrays of names, labels and amounts, in
+ * a single batch. Returns the number of increments.
+ */
+PG_FUNCTION_INFO_V1(increment_counters);
+Datum increment_counters(PG_FUNCTION_ARGS)
+{
+	Datum *names;
+	Datum *labels;
+	Datum *amounts;
+	PMetricsBatchOp *ops;
+	int nops;
+	int i;
+
+	if (!pmetrics_enabled)
+		PG_RETURN_NULL();
+
+	nops = get_array_arg(fcinfo, 0, TEXTOID, &names);
+	if (get_array_arg(fcinfo, 1, JSONBOID, &labels) != nops ||
+	    get_array_arg(fcinfo, 2, INT8OID, &amounts) != nops)
+		elog(ERROR, "arrays must have the same length");
+
+	ops = (PMetricsBatchOp *)palloc(Max(nops, 1) * sizeof(PMetricsBatchOp));
+	for (i = 0; i < nops; i++) {
+		ops[i].type = PMETRICS_INCREMENT_COUNTER;
+		ops[i].name_str = TextDatumGetCString(names[i]);
+		ops[i].labels_jsonb = DatumGetJsonbP(labels[i]);
+		ops[i].value = DatumGetInt64(amounts[i]);
+		ops[i].observation = 0;
+	}
+
+	pmetrics_apply_batch(ops, nops);
+
+	PG_RETURN_INT64(nops);
+}
+
+/*
+ * Record every value of an array to one histogram, in a single batch. Returns
+ * the number of values recorded.
+ */
+PG_FUNCTION_INFO_V1(record_to_histogram_many);
+Datum record_to_histogram_many(PG_FUNCTION_ARGS)
+{
+	Jsonb *labels_jsonb;
+	char *name_str;
+	Datum *values;
+	PMetricsBatchOp *ops;
+	int nops;
+	int i;
+
+	if (!pmetrics_enabled)
+		PG_RETURN_NULL();
+
+	extract_metric_args(fcinfo, 0, 1, &name_str, &labels_jsonb);
+	nops = get_array_arg(fcinfo, 2, FLOAT8OID, &values);
+
+	/* Same name and labels pointers, resolved once by the batch */
+	ops = (PMetricsBatchOp *)palloc(Max(nops, 1) * sizeof(PMetricsBatchOp));
+	for (i = 0; i < nops; i++) {
+		ops[i].type = PMETRICS_RECORD_TO_HISTOGRAM;
+		ops[i].name_str = name_str;
+		ops[i].labels_jsonb = labels_jsonb;
+		ops[i].value = 0;
+		ops[i].observation = DatumGetFloat8(values[i]);
+	}
+
+	pmetrics_apply_batch(ops, nops);
+
+	PG_RETURN_INT64(nops);
+}
+
+PG_FUNCTION_INFO_V1(list_histogram_buckets);
+Datum list_histogram_buckets(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	int *buckets;
+	int current_idx;
+
+	if (SRF_IS_FIRSTCALL()) {
+		MemoryContext oldcontext;
+		TupleDesc tupdesc;
+		int num_buckets;
+		int i;
+		int count;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			ereport(ERROR,
+			        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			         errmsg("function returning record called in context "
+			                "that cannot accept type record")));
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		num_buckets = max_bucket_exp + 1;
+
+		buckets = (int *)palloc(num_buckets * sizeof(int));
+
+		/* Generate unique bucket values */
+		count = 0;
+		buckets[count++] = 0;
+		for (i = 1; i <= max_bucket_exp; i++) {
+			int bucket_value = bucket_upper_bound(i);
+			if (bucket_value != buckets[count - 1])
+				buckets[count++] = bucket_value;
+		}
+
+		funcctx->user_fctx = buckets;
+		funcctx->max_calls = count;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	buckets = (int *)funcctx->user_fctx;
+	current_idx = funcctx->call_cntr;
+
+	if (current_idx < funcctx->max_calls) {
+		Datum values[1];
+		bool nulls[1] = {false};
+		HeapTuple tuple;
+		Datum result;
+
+		values[0] = Int32GetDatum(buckets[current_idx]);
+
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+		result = HeapTupleGetDatum(tuple);
+		SRF_RETURN_NEXT(funcctx, result);
+	} else {
+		SRF_RETURN_DONE(funcctx);
+	}
+}
+
+/*
+ * Range of values counted by a bucket cell: the indexes folded into it, see
+ * init_bucket_bounds(). The first cell also counts the values below 1.0, its
+ * range starts at 0.
+ */
+static void bucket_cell_range(int cell, double *lower, double *upper)
+{
+	int last = cell;
+
+	while (last < max_bucket_exp && bucket_cells[last + 1] == cell)
+		last++;
+
+	*lower = cell == 0 ? 0.0 : bucket_thresholds[cell];
+	*upper = bucket_thresholds[last + 1];
+}
+
+/*
+ * Copy the bucket counts of a histogram entry, indexed by cell, and return
+ * their total. Caller must hold the partition lock of the entry.
+ */
+static int64 copy_bucket_counts(Metric *entry, int64 *counts)
+{
+	int64 total = 0;
+	int i;
+
+	for (i = 0; i <= max_bucket_exp; i++) {
+		counts[i] = 0;
+		if (bucket_cells[i] != i)
+			continue;
+		counts[i] = metric_cell_value(entry, HISTOGRAM_BUCKET_CELL(i));
+		total += counts[i];
+	}
+
+	return total;
+}
+
+/*
+ * Estimate quantiles from bucket counts copied by copy_bucket_counts().
+ *
+ * Like Prometheus' histogram_quantile(), find the bucket holding the rank of
+ * each quantile and interpolate within it. Buckets are exponential, so the
+ * interpolation is geometric, which keeps the same relative error bound as
+ * the buckets. The first bucket starts at 0 and is interpolated linearly.
+ */
+static void estimate_quantiles(const int64 *counts, int64 total,
+                               const double *quantiles, int nquantiles,
+                               Datum *estimates)
+{
+	int i;
+
+	for (i = 0; i < nquantiles; i++) {
+		double rank = quantiles[i] * total;
+		int64 below = 0;
+		int cell;
+
+		for (cell = 0; cell <= max_bucket_exp; cell++) {
+			double lower;
+			double upper;
+			double fraction;
+
+			if (counts[cell] == 0)
+				continue;
+
+			if (below + counts[cell] < rank && cell < max_bucket_exp) {
+				below += counts[cell];
+				continue;
+			}
+
+			bucket_cell_range(cell, &lower, &upper);
+			fraction = Min((rank - below) / counts[cell], 1.0);
+			if (lower == 0.0)
+				estimates[i] = Float8GetDatum(upper * fraction);
+			else
+				estimates[i] = Float8GetDatum(lower *
+				                              pow(upper / lower, fraction));
+			break;
+		}
+	}
+}
+
+/*
+ * Quantiles of an array argument, which must be between 0 and 1.
+ */
+static double *get_quantiles_arg(FunctionCallInfo fcinfo, int arg,
+                                 int *nquantiles)
+{
+	Datum *elems;
+	double *quantiles;
+	int i;
+
+	*nquantiles = get_array_arg(fcinfo, arg, FLOAT8OID, &elems);
+	quantiles = (double *)palloc(Max(*nquantiles, 1) * sizeof(double));
+
+	for (i = 0; i < *nquantiles; i++) {
+		quantiles[i] = DatumGetFloat8(elems[i]);
+		if (!(quantiles[i] >= 0.0 && quantiles[i] <= 1.0))
+			elog(ERROR, "quantile must be between 0 and 1");
+	}
+
+	return quantiles;
+}
+
+/*
+ * histogram_quantile(name, labels, q): estimated quantiles of a histogram,
+ * in the order of q. NULL if the histogram doesn't exist or is empty.
+ *
+ * Only the bucket counts are copied under the partition lock.
+ */
+PG_FUNCTION_INFO_V1(histogram_quantile);
+Datum histogram_quantile(PG_FUNCTION_ARGS)
+{
+	dshash_table *metrics_table;
+	Jsonb *labels_jsonb;
+	char *name_str;
+	double *quantiles;
+	int nquantiles;
+	MetricKey key;
+	Metric *entry;
+	int64 *counts;
+	int64 total = 0;
+	Datum *estimates;
+
+	extract_metric_args(fcinfo, 0, 1, &name_str, &labels_jsonb);
+	quantiles = get_quantiles_arg(fcinfo, 2, &nquantiles);
+
+	metrics_table = get_metrics_table();
+
+	/* Make this backend's own buffered observations visible */
+	flush_pending_deltas();
+
+	/* Skip the cache, a stale id would miss the series */
+	key.name_id = lookup_interned_id(INTERNED_NAME, name_str, false);
+	key.labels_id = lookup_interned_id(INTERNED_LABELS, labels_jsonb, false);
+	key.type = METRIC_TYPE_HISTOGRAM;
+	if (key.name_id == UNKNOWN_INTERNED_ID ||
+	    key.labels_id == UNKNOWN_INTERNED_ID)
+		PG_RETURN_NULL();
+
+	counts = (int64 *)palloc((max_bucket_exp + 1) * sizeof(int64));
+
+	entry = (Metric *)dshash_find(metrics_table, &key, false);
+	if (entry == NULL)
+		PG_RETURN_NULL();
+	if (!entry->deleted)
+		total = copy_bucket_counts(entry, counts);
+	dshash_release_lock(metrics_table, entry);
+
+	if (total == 0)
+		PG_RETURN_NULL();
+
+	estimates = (Datum *)palloc(Max(nquantiles, 1) * sizeof(Datum));
+	estimate_quantiles(counts, total, quantiles, nquantiles, estimates);
+
+	PG_RETURN_ARRAYTYPE_P(
+	    construct_array_builtin(estimates, nquantiles, FLOAT8OID));
+}
+
+/*
+ * histogram_quantile(name, q): one row per non-empty histogram of a name,
+ * with its labels, its number of observations and its estimated quantiles.
+ * The series are found through the series index of the name.
+ */
+PG_FUNCTION_INFO_V1(histogram_quantile_any_labels);
+Datum histogram_quantile_any_labels(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	dshash_table *metrics_table;
+	SeriesList series = {NULL, 0, 0};
+	char *name_str;
+	double *quantiles;
+	int nquantiles;
+	int64 *counts;
+	Datum *estimates;
+	int64 i;
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	name_str = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	validate_inputs(name_str);
+	quantiles = get_quantiles_arg(fcinfo, 1, &nquantiles);
+
+	metrics_table = get_metrics_table();
+
+	/* Series created by this backend's buffered updates are indexed */
+	flush_pending_deltas();
+
+	if (!find_interned_series(INTERNED_NAME, name_str, &series))
+		return (Datum)0;
+
+	counts = (int64 *)palloc((max_bucket_exp + 1) * sizeof(int64));
+	estimates = (Datum *)palloc(Max(nquantiles, 1) * sizeof(Datum));
+
+	for (i = 0; i < series.count; i++) {
+		Metric *entry;
+		Jsonb *labels = NULL;
+		int64 total = 0;
+		Datum values[3];
+		bool nulls[3] = {false, false, false};
+
+		if (series.keys[i].type != METRIC_TYPE_HISTOGRAM)
+			continue;
+
+		entry = (Metric *)dshash_find(metrics_table, &series.keys[i], false);
+		if (entry == NULL)
+			continue;
+
+		if (!entry->deleted) {
+			total = copy_bucket_counts(entry, counts);
+			if (total > 0 && DsaPointerIsValid(entry->labels)) {
+				const Jsonb *shared =
+				    dsa_get_address(local_dsa, entry->labels);
+
+				labels = (Jsonb *)palloc(VARSIZE(shared));
+				memcpy(labels, shared, VARSIZE(shared));
+			}
+		}
+		dshash_release_lock(metrics_table, entry);
+
+		if (total == 0)
+			continue;
+
+		estimate_quantiles(counts, total, quantiles, nquantiles, estimates);
+
+		nulls[0] = labels == NULL;
+		values[0] = PointerGetDatum(labels);
+		values[1] = Int64GetDatum(total);
+		values[2] = PointerGetDatum(
+		    construct_array_builtin(estimates, nquantiles, FLOAT8OID));
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values,
+		                     nulls);
+	}
+
+	return (Datum)0;
+}
+
+__attribute__((visibility("default"))) int64 pmetrics_clear_metrics(void)
+{
+	dshash_table *metrics_table;
+	dshash_seq_status status;
+	Metric *entry;
+	int64 deleted_count = 0;
+
+	metrics_table = get_metrics_table();
+
+	/* Buffered updates from this backend happened before the clear */
+	flush_pending_deltas();
+
+	dshash_seq_init(&status, metrics_table, true);
+	while ((entry = dshash_seq_next(&status)) != NULL)
+		deleted_count += remove_metric(metrics_table, &status, entry, false);
+	dshash_seq_term(&status);
+
+	forget_removals();
+
+	return deleted_count;
+}
+
+PG_FUNCTION_INFO_V1(clear_metrics);
+Datum clear_metrics(PG_FUNCTION_ARGS)
+{
+	int64 deleted_count;
+
+	deleted_count = pmetrics_clear_metrics();
+
+	PG_RETURN_INT64(deleted_count);
+}
+
+/*
+ * Delete the series of a name and label set. A series is keyed by them and
+ * its type, so this looks up each type directly.
+ */
+static int64 delete_metrics_by_name_labels(const char *name_str,
+                                           Jsonb *labels_jsonb)
+{
+	dshash_table *metrics_table;
+	MetricKey keys[3];
+	SeriesList series = {keys, 0, lengthof(keys)};
+	MetricType type;
+	uint64 name_id;
+	uint64 labels_id = NO_LABELS_ID;
+
+	metrics_table = get_metrics_table();
+	if (metrics_table == NULL)
+		elog(ERROR, "pmetrics not initialized");
+
+	/* Buffered updates from this backend happened before the delete */
+	flush_pending_deltas();
+
+	/* Skip the cache, a stale id would miss the series */
+	name_id = lookup_interned_id(INTERNED_NAME, name_str, false);
+	if (name_id == UNKNOWN_INTERNED_ID)
+		return 0;
+
+	if (labels_jsonb != NULL) {
+		labels_id = lookup_interned_id(INTERNED_LABELS, labels_jsonb, false);
+		if (labels_id == UNKNOWN_INTERNED_ID)
+			return 0;
+	}
+
+	for (type = METRIC_TYPE_COUNTER; type <= METRIC_TYPE_HISTOGRAM; type++) {
+		keys[series.count].name_id = name_id;
+		keys[series.count].labels_id = labels_id;
+		keys[series.count].type = type;
+		series.count++;
+	}
+
+	return remove_series(metrics_table, &series, true);
+}
+
+/*
+ * Delete all the series of a name, found through its series index.
+ */
+static int64 delete_metrics_by_name(const char *name_str)
+{
+	dshash_table *metrics_table;
+	SeriesList series = {NULL, 0, 0};
+	int64 deleted_count;
+
+	metrics_table = get_metrics_table();
+	if (metrics_table == NULL)
+		elog(ERROR, "pmetrics not initialized");
+
+	/* Buffered updates from this backend happened before the delete */
+	flush_pending_deltas();
+
+	if (!find_interned_series(INTERNED_NAME, name_str, &series))
+		return 0;
+
+	deleted_count = remove_series(metrics_table, &series, false);
+	pfree(series.keys);
+
+	return deleted_count;
+}
+
+/*
+ * Delete all the series whose labels contain a JSONB object, see
+ * match_labels().
+ */
+static int64 delete_metrics_matching_labels(Jsonb *labels_jsonb)
+{
+	dshash_table *metrics_table;
+	SeriesList series = {NULL, 0, 0};
+
+	metrics_table = get_metrics_table();
+	if (metrics_table == NULL)
+		elog(ERROR, "pmetrics not initialized");
+
+	/* Buffered updates from this backend happened before the delete */
+	flush_pending_deltas();
+
+	match_labels(labels_jsonb, &series);
+
+	return remove_series(metrics_table, &series, false);
+}
+
+__attribute__((visibility("default"))) int64
+pmetrics_delete_metric(const char *name_str, Jsonb *labels_jsonb)
+{
+	validate_inputs(name_str);
+	return delete_metrics_by_name_labels(name_str, labels_jsonb);
+}
+
+__attribute__((visibility("default"))) int64
+pmetrics_delete_metrics(const char *name_str)
+{
+	validate_inputs(name_str);
+	return delete_metrics_by_name(name_str);
+}
+
+__attribute__((visibility("default"))) int64
+pmetrics_delete_metrics_matching(Jsonb *labels_jsonb)
+{
+	if (labels_jsonb == NULL)
+		elog(ERROR, "null input not allowed");
+
+	return delete_metrics_matching_labels(labels_jsonb);
+}
+
+PG_FUNCTION_INFO_V1(delete_metric);
+Datum delete_metric(PG_FUNCTION_ARGS)
+{
+	int64 deleted_count;
+	Jsonb *labels_jsonb;
+	char *name_str = NULL;
+
+	if (!pmetrics_enabled)
+		PG_RETURN_NULL();
+
+	PG_TRY();
+	{
+		extract_metric_args(fcinfo, 0, 1, &name_str, &labels_jsonb);
+		deleted_count = delete_metrics_by_name_labels(name_str, labels_jsonb);
+	}
+	PG_CATCH();
+	{
+		if (name_str)
+			pfree(name_str);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pfree(name_str);
+	PG_RETURN_INT64(deleted_count);
+}
+
+/*
+ * delete_metric(name): all the series of a name, whatever their labels.
+ */
+PG_FUNCTION_INFO_V1(delete_metric_any_labels);
+Datum delete_metric_any_labels(PG_FUNCTION_ARGS)
+{
+	int64 deleted_count;
+	char *name_str;
+
+	if (!pmetrics_enabled)
+		PG_RETURN_NULL();
+
+	name_str = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	validate_inputs(name_str);
+
+	deleted_count = delete_metrics_by_name(name_str);
+
+	pfree(name_str);
+	PG_RETURN_INT64(deleted_count);
+}
+
+PG_FUNCTION_INFO_V1(delete_metrics_matching);
+Datum delete_metrics_matching(PG_FUNCTION_ARGS)
+{
+	if (!pmetrics_enabled)
+		PG_RETURN_NULL();
+
+	PG_RETURN_INT64(delete_metrics_matching_labels(PG_GETARG_JSONB_P(0)));
+}
+
+__attribute__((visibility("default"))) bool pmetrics_is_initialized(void)
+{
+	return shared_state != NULL && shared_state->initialized;
+}
+
+__attribute__((visibility("default"))) dsa_handle pmetrics_get_dsa_handle(void)
+{
+	if (shared_state == NULL || !shared_state->initialized)
+		elog(ERROR, "pmetrics not initialized");
+
+	return shared_state->dsa;
+}
+
+__attribute__((visibility("default"))) dsa_area *pmetrics_get_dsa(void)
+{
+	if (local_dsa == NULL)
+		get_metrics_table();
+
+	return local_dsa;
+}
+
+__attribute__((visibility("default"))) bool pmetrics_is_enabled(void)
+{
+	return pmetrics_enabled;
+}
+
+__attribute__((visibility("default"))) void pmetrics_flush(void)
+{
+	flush_pending_deltas();
+}
+
+/*
+ * Age of the oldest update buffered in any backend and not yet merged into
+ * shared memory, in milliseconds. This bounds how stale list_metrics() output
+ * can be.
+ */
+__attribute__((visibility("default"))) int64 pmetrics_max_staleness_ms(void)
+{
+	TimestampTz oldest = 0;
+	int i;
+
+	if (backend_slots == NULL)
+		elog(ERROR, "pmetrics not initialized");
+
+	for (i = 0; i < num_backend_states(); i++) {
+		TimestampTz since = (TimestampTz)pg_atomic_read_u64(
+		    &backend_slots[i].state.pending_since);
+
+		if (since != 0 && (oldest == 0 || since < oldest))
+			oldest = since;
+	}
+
+	if (oldest == 0)
+		return 0;
+
+	return TimestampDifferenceMilliseconds(oldest, GetCurrentTimestamp());
+}
+
+PG_FUNCTION_INFO_V1(max_staleness_ms);
+Datum max_staleness_ms(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT64(pmetrics_max_staleness_ms());
+}
+
+/*
+ * Hash of every entry of a table, in the current memory context. Also sets
+ * the entry and partition counts of stats, as found by the scan: dshash
+ * scans partitions in order, reporting the one being scanned.
+ */
+static uint32 *collect_hashes(dshash_table *table,
+                              const dshash_parameters *params,
+                              HashTableStats *stats)
+{
+	dshash_seq_status status;
+	void *entry;
+	uint32 *hashes;
+	int64 capacity = 1024;
+	int partition = -1;
+	int64 in_partition = 0;
+
+	stats->entries = 0;
+	stats->used_partitions = 0;
+	stats->min_partition = 0;
+	stats->max_partition = 0;
+	hashes = (uint32 *)palloc(capacity * sizeof(uint32));
+
+	dshash_seq_init(&status, table, false);
+	while ((entry = dshash_seq_next(&status)) != NULL) {
+		if (status.curpartition != partition) {
+			count_partition(stats, in_partition);
+			partition = status.curpartition;
+			in_partition = 0;
+		}
+		in_partition++;
+
+		if (stats->entries == capacity) {
+			capacity *= 2;
+			hashes = (uint32 *)repalloc_huge(hashes,
+			                                 capacity * sizeof(uint32));
+		}
+		/* Entries start with their key */
+		hashes[stats->entries++] =
+		    params->hash_function(entry, params->key_size, NULL);
+	}
+	dshash_seq_term(&status);
+	count_partition(stats, in_partition);
+
+	return hashes;
+}
+
+/*
+ * Add the entry count of a partition to the partition figures of stats.
+ * Empty partitions are never reported by a scan, so are not counted.
+ */
+static void count_partition(HashTableStats *stats, int64 entries)
+{
+	if (entries == 0)
+		return;
+
+	if (stats->used_partitions == 0 || entries < stats->min_partition)
+		stats->min_partition = entries;
+	stats->max_partition = Max(stats->max_partition, entries);
+	stats->used_partitions++;
+}
+
+static int compare_hashes(const void *a, const void *b)
+{
+	uint32 h1 = *(const uint32 *)a;
+	uint32 h2 = *(const uint32 *)b;
+
+	if (h1 != h2)
+		return (h1 < h2) ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Distinct and colliding hashes among the stats->entries hashes of a table.
+ * Sorts them.
+ */
+static void count_hash_collisions(HashTableStats *stats, uint32 *hashes)
+{
+	int64 run = 0;
+	int64 i;
+
+	stats->distinct_hashes = 0;
+	stats->colliding_entries = 0;
+
+	/* Sorted, equal hashes are adjacent */
+	qsort(hashes, stats->entries, sizeof(uint32), compare_hashes);
+
+	for (i = 0; i < stats->entries; i++) {
+		if (i == 0 || hashes[i] != hashes[i - 1]) {
+			stats->distinct_hashes++;
+			run = 1;
+		} else {
+			/* The first entry of the run collides too */
+			stats->colliding_entries += (++run == 2) ? 2 : 1;
+		}
+	}
+}
+
+PG_FUNCTION_INFO_V1(hash_table_stats);
+Datum hash_table_stats(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	HashTableStats *stats;
+	int current_idx;
+
+	if (SRF_IS_FIRSTCALL()) {
+		MemoryContext oldcontext;
+		TupleDesc tupdesc;
+		dshash_table *table;
+		uint32 *hashes;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			ereport(ERROR,
+			        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			         errmsg("function returning record called in context "
+			                "that cannot accept type record")));
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		table = get_metrics_table();
+		stats = (HashTableStats *)palloc(3 * sizeof(HashTableStats));
+
+		hashes = collect_hashes(table, &metrics_params, &stats[0]);
+		stats[0].table = "metrics";
+		count_hash_collisions(&stats[0], hashes);
+		pfree(hashes);
+
+		hashes = collect_hashes(local_interned_table, &interned_params,
+		                        &stats[1]);
+		stats[1].table = "interned";
+		count_hash_collisions(&stats[1], hashes);
+		pfree(hashes);
+
+		funcctx->max_calls = 2;
+		if (local_label_pairs_table != NULL) {
+			hashes = collect_hashes(local_label_pairs_table,
+			                        &label_pairs_params, &stats[2]);
+			stats[2].table = "label_pairs";
+			count_hash_collisions(&stats[2], hashes);
+			pfree(hashes);
+			funcctx->max_calls = 3;
+		}
+
+		funcctx->user_fctx = stats;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	stats = (HashTableStats *)funcctx->user_fctx;
+	current_idx = funcctx->call_cntr;
+
+	if (current_idx < funcctx->max_calls) {
+		HashTableStats *row = &stats[current_idx];
+		Datum values[7];
+		bool nulls[7] = {false};
+		HeapTuple tuple;
+		Datum result;
+
+		values[0] = CStringGetTextDatum(row->table);
+		values[1] = Int64GetDatum(row->entries);
+		values[2] = Int64GetDatum(row->distinct_hashes);
+		values[3] = Int64GetDatum(row->colliding_entries);
+		values[4] = Int32GetDatum(row->used_partitions);
+		values[5] = Int64GetDatum(row->min_partition);
+		values[6] = Int64GetDatum(row->max_partition);
+
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+		result = HeapTupleGetDatum(tuple);
+		SRF_RETURN_NEXT(funcctx, result);
+	} else {
+		SRF_RETURN_DONE(funcctx);
+	}
+}
+
+/*
+ * Series count and usage of every interned name, in the current memory
+ * context.
+ */
+static NameStats *collect_name_stats(int64 *count)
+{
+	dshash_seq_status status;
+	InternedEntry *entry;
+	NameStats *names;
+	int64 capacity;
+
+	*count = 0;
+	capacity = Max(
+	    pg_atomic_read_u64(&shared_state->memory[MEMORY_NAMES].entries), 16);
+	names = (NameStats *)palloc(capacity * sizeof(NameStats));
+
+	dshash_seq_init(&status, local_interned_table, false);
+	while ((entry = (InternedEntry *)dshash_seq_next(&status)) != NULL) {
+		NameStats *row;
+		NameUsage *usage;
+
+		if (entry->key.kind != INTERNED_NAME)
+			continue;
+
+		if (*count == capacity) {
+			capacity *= 2;
+			names = (NameStats *)repalloc_huge(names,
+			                                   capacity * sizeof(NameStats));
+		}
+
+		usage = (NameUsage *)dsa_get_address(local_dsa, entry->usage);
+		row = &names[(*count)++];
+		row->name = pstrdup(
+		    (const char *)dsa_get_address(local_dsa, entry->key.value.dsa_ptr));
+		row->series = entry->series.live;
+		row->label_bytes = (int64)pg_atomic_read_u64(&usage->label_bytes);
+		row->last_update = pg_atomic_read_u32(&usage->last_update);
+	}
+	dshash_seq_term(&status);
+
+	return names;
+}
+
+/*
+ * Add a row to memory_stats() output. name, entries and last_update are
+ * output as NULL when NULL, negative or 0.
+ */
+static void put_memory_row(ReturnSetInfo *rsinfo, const char *kind,
+                           const char *name, int64 entries, int64 bytes,
+                           uint32 last_update)
+{
+	Datum values[5];
+	bool nulls[5] = {false};
+
+	values[0] = CStringGetTextDatum(kind);
+	if (name != NULL)
+		values[1] = CStringGetTextDatum(name);
+	else
+		nulls[1] = true;
+	if (entries >= 0)
+		values[2] = Int64GetDatum(entries);
+	else
+		nulls[2] = true;
+	values[3] = Int64GetDatum(bytes);
+	if (last_update != 0)
+		values[4] = TimestampTzGetDatum(
+		    time_t_to_timestamptz((pg_time_t)last_update));
+	else
+		nulls[4] = true;
+
+	tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+}
+
+/*
+ * memory_stats(): shared memory used by pmetrics. Figures are kept up to
+ * date as series and interned values come and go, so this reads counters
+ * and walks the interned names, never the metrics table.
+ */
+PG_FUNCTION_INFO_V1(memory_stats);
+Datum memory_stats(PG_FUNCTION_ARGS)
+{
+	static const char *const memory_kinds[NUM_MEMORY_KINDS] = {
+	    "series", "names", "label_sets", "indexes"};
+	static const char *const table_names[NUM_SHARED_TABLES] = {
+	    "metrics", "interned", "label_pairs"};
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	NameStats *names;
+	int64 nnames;
+	int64 i;
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	(void)get_metrics_table();
+
+	put_memory_row(rsinfo, "dsa", NULL, -1,
+	               (int64)dsa_get_total_size(local_dsa), 0);
+
+	for (i = 0; i < NUM_SHARED_TABLES; i++) {
+		TableUsage *usage = &shared_state->tables[i];
+		uint32 size_log2 = pg_atomic_read_u32(&usage->size_log2);
+
+		if (i == TABLE_LABEL_PAIRS && local_label_pairs_table == NULL)
+			continue;
+
+		put_memory_row(rsinfo, "buckets", table_names[i],
+		               (int64)pg_atomic_read_u64(&usage->entries),
+		               (INT64CONST(1) << size_log2) * sizeof(dsa_pointer), 0);
+	}
+
+	for (i = 0; i < NUM_MEMORY_KINDS; i++) {
+		MemoryUsage *usage = &shared_state->memory[i];
+
+		put_memory_row(rsinfo, memory_kinds[i], NULL,
+		               (int64)pg_atomic_read_u64(&usage->entries),
+		               (int64)pg_atomic_read_u64(&usage->bytes), 0);
+	}
+
+	names = collect_name_stats(&nnames);
+	for (i = 0; i < nnames; i++)
+		put_memory_row(rsinfo, "name", names[i].name, names[i].series,
+		               names[i].label_bytes, names[i].last_update);
+
+	return (Datum)0;
+}
+
+/*
+ * Allocate a handle in TopMemoryContext and pin its entry.
+ */
+static PMetricsHandle *create_handle(const char *name_str, Jsonb *labels_jsonb,
+                                     MetricType type)
+{
+	PMetricsHandle *handle;
+	Jsonb *labels_copy = NULL;
+	MemoryContext oldcontext;
+
+	validate_inputs(name_str);
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+	if (labels_jsonb != NULL) {
+		labels_copy = (Jsonb *)palloc(VARSIZE(labels_jsonb));
+		memcpy(labels_copy, labels_jsonb, VARSIZE(labels_jsonb));
+	}
+
+	handle = (PMetricsHandle *)palloc0(sizeof(PMetricsHandle));
+	strlcpy(handle->search.name, name_str, NAMEDATALEN);
+	handle->search.labels = labels_copy;
+	/* Ids are resolved by pin_metric() */
+	handle->search.key.type = type;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_TRY();
+	{
+		handle->entry = pin_metric(get_metrics_table(), &handle->search);
+	}
+	PG_CATCH();
+	{
+		/* pin_metric() may have replaced the labels */
+		if (handle->search.labels != NULL)
+			pfree(handle->search.labels);
+		pfree(handle);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	dlist_push_tail(&handles, &handle->node);
+
+	return handle;
+}
+
+/*
+ * Get the pinned entry of a handle, reviving it if it was deleted since the
+ * last call, so writes through a handle always land on a visible series.
+ */
+static Metric *handle_entry(PMetricsHandle *handle)
+{
+	Metric *entry = handle->entry;
+	dshash_table *table;
+
+	/*
+	 * Unlocked read of the deleted flag. If we race with a delete, the write
+	 * lands on the tombstone and is discarded, as if it happened before the
+	 * delete.
+	 */
+	if (likely(!entry->deleted))
+		return entry;
+
+	table = get_metrics_table();
+
+	/* Pinned entries stay in the table, so this finds the tombstone */
+	entry = (Metric *)dshash_find(table, &handle->search.key, true);
+	Assert(entry == handle->entry);
+	if (entry->deleted)
+		revive_metric(entry);
+	dshash_release_lock(table, entry);
+
+	return entry;
+}
+
+__attribute__((visibility("default"))) PMetricsHandle *
+pmetrics_counter_handle(const char *name_str, Jsonb *labels_jsonb)
+{
+	return create_handle(name_str, labels_jsonb, METRIC_TYPE_COUNTER);
+}
+
+__attribute__((visibility("default"))) PMetricsHandle *
+pmetrics_gauge_handle(const char *name_str, Jsonb *labels_jsonb)
+{
+	return create_handle(name_str, labels_jsonb, METRIC_TYPE_GAUGE);
+}
+
+__attribute__((visibility("default"))) PMetricsHandle *
+pmetrics_histogram_handle(const char *name_str, Jsonb *labels_jsonb)
+{
+	return create_handle(name_str, labels_jsonb, METRIC_TYPE_HISTOGRAM);
+}
+
+__attribute__((visibility("default"))) int64
+pmetrics_counter_add(PMetricsHandle *handle, int64 amount)
+{
+	Metric *entry;
+
+	if (handle->search.key.type != METRIC_TYPE_COUNTER)
+		elog(ERROR, "pmetrics handle is not a counter");
+
+	if (amount <= 0)
+		elog(ERROR, "increment must be greater than 0");
+
+	entry = handle_entry(handle);
+	touch_metric(entry);
+
+	return metric_add(entry, 0, amount);
+}
+
+__attribute__((visibility("default"))) int64
+pmetrics_gauge_add(PMetricsHandle *handle, int64 amount)
+{
+	Metric *entry;
+
+	if (handle->search.key.type != METRIC_TYPE_GAUGE)
+		elog(ERROR, "pmetrics handle is not a gauge");
+
+	if (amount == 0)
+		elog(ERROR, "value can't be 0");
+
+	entry = handle_entry(handle);
+	touch_metric(entry);
+
+	return metric_add(entry, 0, amount);
+}
+
+__attribute__((visibility("default"))) int64
+pmetrics_gauge_set(PMetricsHandle *handle, int64 value)
+{
+	Metric *entry;
+
+	if (handle->search.key.type != METRIC_TYPE_GAUGE)
+		elog(ERROR, "pmetrics handle is not a gauge");
+
+	entry = handle_entry(handle);
+	touch_metric(entry);
+	metric_set(entry, value);
+
+	return value;
+}
+
+__attribute__((visibility("default"))) int64
+pmetrics_histogram_observe(PMetricsHandle *handle, double value)
+{
+	Metric *entry;
+	int64 bucket_count;
+
+	if (handle->search.key.type != METRIC_TYPE_HISTOGRAM)
+		elog(ERROR, "pmetrics handle is not a histogram");
+
+	entry = handle_entry(handle);
+	touch_metric(entry);
+	bucket_count =
+	    metric_add(entry, HISTOGRAM_BUCKET_CELL(bucket_index_for(value)), 1);
+	metric_add(entry, HISTOGRAM_SUM_CELL, (int64)value);
+
+	return bucket_count;
+}
+
+__attribute__((visibility("default"))) void
+pmetrics_release_handle(PMetricsHandle *handle)
+{
+	/* Unlink first so a failure below can't make us release it twice */
+	dlist_delete(&handle->node);
+
+	unpin_metric(get_metrics_table(), &handle->search);
+
+	if (handle->search.labels != NULL)
+		pfree(handle->search.labels);
+	pfree(handle);
+}
+
+/*
+ * Dump the metrics when postmaster shuts down, see pmetrics.save. Not after
+ * a crash, when shared memory can't be trusted.
+ */
+static void save_metrics_at_exit(int code, Datum arg)
+{
+	int64 count;
+
+	if (code != 0 || !save_metrics_on_shutdown || shared_state == NULL ||
+	    !shared_state->initialized)
+		return;
+
+	attach_shared_tables();
+	save_metrics(METRICS_DUMP_FILE, GetCurrentTimestamp(), 0, &count);
+	detach_shared_tables();
+}
+
+/*
+ * Entry point of the checkpointer background worker, see
+ * pmetrics.checkpoint_interval.
+ *
+ * An error while writing a checkpoint only loses that checkpoint: the worker
+ * reports it, cleans up and tries again at the next interval, keeping what
+ * it knows of the files already written.
+ */
+void pmetrics_checkpointer_main(Datum main_arg)
+{
+	sigjmp_buf local_sigjmp_buf;
+	CheckpointState state;
+	MemoryContext context;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	(void)get_metrics_table();
+	/* Deltas rely on it, see write_checkpoint() */
+	(void)track_changes();
+
+	memset(&state, 0, sizeof(state));
+	context = AllocSetContextCreate(TopMemoryContext, "pmetrics checkpoint",
+	                                ALLOCSET_DEFAULT_SIZES);
+
+	if (sigsetjmp(local_sigjmp_buf, 1) != 0) {
+		error_context_stack = NULL;
+		HOLD_INTERRUPTS();
+
+		EmitErrorReport();
+		LWLockReleaseAll();
+		/* Close the file being written, left for the next one to replace */
+		AtEOXact_Files(false);
+
+		MemoryContextSwitchTo(TopMemoryContext);
+		FlushErrorState();
+		MemoryContextReset(context);
+
+		RESUME_INTERRUPTS();
+	}
+	PG_exception_stack = &local_sigjmp_buf;
+
+	for (;;) {
+		int events = WL_LATCH_SET | WL_EXIT_ON_PM_DEATH;
+
+		if (checkpoint_interval > 0)
+			events |= WL_TIMEOUT;
+
+		(void)WaitLatch(MyLatch, events, checkpoint_interval * 1000L,
+		                PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending) {
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+			continue;
+		}
+
+		if (checkpoint_interval > 0) {
+			MemoryContext oldcontext = MemoryContextSwitchTo(context);
+
+			write_checkpoint(&state);
+			MemoryContextSwitchTo(oldcontext);
+			MemoryContextReset(context);
+		}
+	}
+}
+
+/*
+ * Write a checkpoint: a delta of the series updated since the last full
+ * checkpoint or, when a delta is not enough or no longer worth it, a new
+ * full one.
+ *
+ * Deltas hold current values, not differences, so each one replaces the
+ * previous. Series removed since the full checkpoint would come back from
+ * it, so removals force a full one.
+ */
+static void write_checkpoint(CheckpointState *state)
+{
+	TimestampTz start = GetCurrentTimestamp();
+	uint64 removed = pg_atomic_read_u64(&shared_state->series_removed);
+	uint64 generation;
+	int64 count;
+
+	if (state->checkpoint == 0 || removed != state->removed ||
+	    state->delta_series > state->full_series / 2) {
+		/*
+		 * Taken like a snapshot, so that updates the scan may miss are
+		 * stamped with this generation or a later one.
+		 */
+		generation =
+		    pg_atomic_add_fetch_u64(&shared_state->snapshot_generation, 1);
+		if (!save_metrics(CHECKPOINT_FILE, start, 0, &count))
+			return;
+
+		/* The delta belongs to the previous full checkpoint */
+		if (unlink(CHECKPOINT_DELTA_FILE) != 0 && errno != ENOENT)
+			ereport(LOG, (errcode_for_file_access(),
+			              errmsg("could not remove file \"%s\": %m",
+			                     CHECKPOINT_DELTA_FILE)));
+
+		state->checkpoint = start;
+		state->since = generation;
+		state->removed = removed;
+		state->full_series = count;
+		state->delta_series = 0;
+		return;
+	}
+
+	if (save_metrics(CHECKPOINT_DELTA_FILE, state->checkpoint, state->since,
+	                 &count))
+		state->delta_series = count;
+}
+
+/*
+ * Write the live series updated in snapshot generation since or later (see
+ * touch_metric(), 0 for all of them) to a dump file, with their names and
+ * label sets. checkpoint identifies the full dump, see DumpHeader. It is
+ * written to a temporary file first and renamed over path once complete. Sets
+ * count to the number of series written, or returns false after logging why
+ * the file couldn't be written.
+ *
+ * The keys of the series are collected by a scan first, then each series is
+ * looked up and encoded into memory under its own partition lock, taken in
+ * shared mode, which doesn't block updates of existing series. Records are
+ * written out in DUMP_BUFFER_SIZE chunks between lookups, with no partition
+ * lock held, and nothing is synced until the end.
+ */
+static bool save_metrics(const char *path, TimestampTz checkpoint,
+                         uint64 since, int64 *count)
+{
+	char tmp_path[MAXPGPATH];
+	DumpWriter writer;
+	DumpHeader header;
+	MetricFilter filter = {NULL, NULL, ALL_METRIC_TYPES, since, 0};
+	SeriesList series = {NULL, 0, 0};
+	Metric *entry;
+	int64 i;
+	bool failed;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	if (!open_dump(&writer, tmp_path))
+		return false;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = METRICS_DUMP_MAGIC;
+	header.version = METRICS_DUMP_VERSION;
+	header.bucket_variability = bucket_variability;
+	header.max_bucket_exp = max_bucket_exp;
+	header.checkpoint = checkpoint;
+	appendBinaryStringInfo(&writer.buf, &header, sizeof(header));
+
+	*count = 0;
+	scan_series_keys(local_metrics_table, &filter, &series);
+	for (i = 0; i < series.count; i++) {
+		entry = (Metric *)dshash_find(local_metrics_table, &series.keys[i],
+		                              false);
+		if (entry == NULL)
+			continue;
+
+		if (!entry->deleted &&
+		    pg_atomic_read_u64(&entry->modified) >= since) {
+			dump_series(&writer, entry);
+			(*count)++;
+		}
+		dshash_release_lock(local_metrics_table, entry);
+
+		if (writer.buf.len >= DUMP_BUFFER_SIZE)
+			dump_flush(&writer);
+	}
+	if (series.keys != NULL)
+		pfree(series.keys);
+
+	failed = !close_dump(&writer, tmp_path);
+	if (!failed && durable_rename(tmp_path, path, LOG) != 0)
+		failed = true;
+
+	if (failed) {
+		unlink(tmp_path);
+		return false;
+	}
+
+	elog(DEBUG1, "pmetrics: saved " INT64_FORMAT " series to \"%s\"", *count,
+	     path);
+
+	return true;
+}
+
+/*
+ * Create a dump file and set up a writer for it. Returns false after logging
+ * why if it can't be created.
+ */
+static bool open_dump(DumpWriter *writer, const char *path)
+{
+	HASHCTL ctl;
+
+	writer->file = AllocateFile(path, PG_BINARY_W);
+	if (writer->file == NULL) {
+		ereport(LOG,
+		        (errcode_for_file_access(),
+		         errmsg("could not open file \"%s\" for writing: %m", path)));
+		return false;
+	}
+
+	initStringInfo(&writer->buf);
+	enlargeStringInfo(&writer->buf, DUMP_BUFFER_SIZE);
+	writer->bucket_counts =
+	    (int64 *)palloc((max_bucket_exp + 1) * sizeof(int64));
+	INIT_CRC32C(writer->crc);
+
+	ctl.keysize = sizeof(uint64);
+	ctl.entrysize = sizeof(uint64);
+	ctl.hcxt = CurrentMemoryContext;
+	writer->written = hash_create("pmetrics dumped values", 1024, &ctl,
+	                              HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	return true;
+}
+
+/*
+ * End a dump with its trailer and close it. Returns false after logging why
+ * if anything failed to be written.
+ */
+static bool close_dump(DumpWriter *writer, const char *path)
+{
+	bool failed;
+
+	appendStringInfoChar(&writer->buf, DUMP_END);
+	dump_flush(writer);
+	FIN_CRC32C(writer->crc);
+	fwrite(&writer->crc, sizeof(pg_crc32c), 1, writer->file);
+
+	failed = ferror(writer->file) != 0;
+	if (FreeFile(writer->file) != 0)
+		failed = true;
+
+	pfree(writer->buf.data);
+	pfree(writer->bucket_counts);
+	hash_destroy(writer->written);
+
+	if (failed)
+		ereport(LOG, (errcode_for_file_access(),
+		              errmsg("could not write file \"%s\": %m", path)));
+
+	return !failed;
+}
+
+/*
+ * Write the records encoded so far to the file. Write errors are checked
+ * once, when the dump is closed.
+ */
+static void dump_flush(DumpWriter *writer)
+{
+	COMP_CRC32C(writer->crc, writer->buf.data, writer->buf.len);
+	if (writer->buf.len > 0)
+		fwrite(writer->buf.data, 1, writer->buf.len, writer->file);
+	resetStringInfo(&writer->buf);
+}
+
+/*
+ * Encode an unsigned value as a varint: 7 bits per byte, lowest first, with
+ * the high bit set on all bytes but the last.
+ */
+static void dump_put_varint(DumpWriter *writer, uint64 value)
+{
+	uint8 bytes[10];
+	int len = 0;
+
+	do {
+		bytes[len] = value & 0x7F;
+		value >>= 7;
+		if (value != 0)
+			bytes[len] |= 0x80;
+		len++;
+	} while (value != 0);
+
+	appendBinaryStringInfo(&writer->buf, bytes, len);
+}
+
+/*
+ * Encode a signed value, zigzag-encoded so small negative values stay short.
+ */
+static void dump_put_signed(DumpWriter *writer, int64 value)
+{
+	dump_put_varint(writer, ((uint64)value << 1) ^ (uint64)(value >> 63));
+}
+
+/*
+ * Encode a name or label set record, unless this dump already has it. The
+ * caller must hold a reference on the value.
+ */
+static void dump_interned(DumpWriter *writer, InternedKind kind, uint64 id,
+                          dsa_pointer value)
+{
+	const void *stored;
+	Size size;
+	bool found;
+
+	(void)hash_search(writer->written, &id, HASH_ENTER, &found);
+	if (found)
+		return;
+
+	stored = dsa_get_address(local_dsa, value);
+	size = interned_value_size(kind, stored);
+
+	appendStringInfoChar(&writer->buf,
+	                     kind == INTERNED_NAME ? DUMP_NAME : DUMP_LABELS);
+	dump_put_varint(writer, id);
+	dump_put_varint(writer, size);
+	appendBinaryStringInfo(&writer->buf, stored, size);
+}
+
+/*
+ * Encode a series record, preceded by its name and label set the first time
+ * they are used. Histograms are written sparsely, only non-empty buckets.
+ * Caller must hold the partition lock of the entry.
+ */
+static void dump_series(DumpWriter *writer, Metric *entry)
+{
+	int nbuckets = 0;
+	int i;
+
+	dump_interned(writer, INTERNED_NAME, entry->key.name_id, entry->name);
+	if (DsaPointerIsValid(entry->labels))
+		dump_interned(writer, INTERNED_LABELS, entry->key.labels_id,
+		              entry->labels);
+
+	appendStringInfoChar(&writer->buf, DUMP_SERIES);
+	dump_put_varint(writer, entry->key.name_id);
+	dump_put_varint(writer, entry->key.labels_id);
+	dump_put_varint(writer, entry->key.type);
+
+	if (entry->key.type != METRIC_TYPE_HISTOGRAM) {
+		dump_put_signed(writer, metric_cell_value(entry, 0));
+		return;
+	}
+
+	dump_put_signed(writer, metric_cell_value(entry, HISTOGRAM_SUM_CELL));
+
+	/* Read once, so the count matches the buckets written */
+	for (i = 0; i <= max_bucket_exp; i++) {
+		writer->bucket_counts[i] =
+		    metric_cell_value(entry, HISTOGRAM_BUCKET_CELL(i));
+		if (writer->bucket_counts[i] != 0)
+			nbuckets++;
+	}
+
+	dump_put_varint(writer, nbuckets);
+	for (i = 0; i <= max_bucket_exp; i++) {
+		if (writer->bucket_counts[i] != 0) {
+			dump_put_varint(writer, i);
+			dump_put_signed(writer, writer->bucket_counts[i]);
+		}
+	}
+}
+
+/*
+ * Load the saved series into the shared tables, in postmaster at startup
+ * before any backend can use them. After a clean shutdown that is the dump
+ * written by pmetrics.save, otherwise the last checkpoint, if any. Each is
+ * only loaded while its setting is on, and removed otherwise, so turning one
+ * back on later doesn't bring back old series. Missing files are not an
+ * error, unreadable or corrupt ones are logged and ignored.
+ */
+static void load_metrics(void)
+{
+	MemoryContext context;
+	MemoryContext oldcontext;
+	uint8 *data;
+	uint8 *delta;
+	Size size;
+	Size delta_size;
+	DumpHeader header;
+	DumpHeader delta_header;
+
+	context = AllocSetContextCreate(CurrentMemoryContext, "pmetrics load",
+	                                ALLOCSET_DEFAULT_SIZES);
+	oldcontext = MemoryContextSwitchTo(context);
+
+	if (!save_metrics_on_shutdown)
+		unlink(METRICS_DUMP_FILE);
+	if (checkpoint_interval == 0) {
+		unlink(CHECKPOINT_FILE);
+		unlink(CHECKPOINT_DELTA_FILE);
+	}
+
+	data = save_metrics_on_shutdown ? read_dump(METRICS_DUMP_FILE, &size)
+	                                : NULL;
+	if (data != NULL) {
+		if (valid_dump(data, size, METRICS_DUMP_FILE))
+			load_dump(data, size, METRICS_DUMP_FILE);
+
+		/*
+		 * Loaded only once, so a crash doesn't bring it back. The
+		 * checkpoints are older, so it replaces them until the checkpointer
+		 * writes a new one.
+		 */
+		if (checkpoint_interval > 0) {
+			(void)durable_rename(METRICS_DUMP_FILE, CHECKPOINT_FILE, LOG);
+			unlink(CHECKPOINT_DELTA_FILE);
+		} else {
+			unlink(METRICS_DUMP_FILE);
+		}
+	} else if (checkpoint_interval > 0) {
+		data = read_dump(CHECKPOINT_FILE, &size);
+		if (data != NULL && valid_dump(data, size, CHECKPOINT_FILE)) {
+			memcpy(&header, data, sizeof(DumpHeader));
+
+			/* Delta first, the full checkpoint doesn't replace its values */
+			delta = read_dump(CHECKPOINT_DELTA_FILE, &delta_size);
+			if (delta != NULL &&
+			    valid_dump(delta, delta_size, CHECKPOINT_DELTA_FILE)) {
+				memcpy(&delta_header, delta, sizeof(DumpHeader));
+				if (delta_header.checkpoint == header.checkpoint)
+					load_dump(delta, delta_size, CHECKPOINT_DELTA_FILE);
+			}
+
+			load_dump(data, size, CHECKPOINT_FILE);
+		}
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(context);
+
+	/* Backends are forked from postmaster, don't hand them its cache */
+	if (interned_cache_context != NULL) {
+		MemoryContextDelete(interned_cache_context);
+		interned_cache_context = NULL;
+		interned_cache = NULL;
+	}
+}
+
+/*
+ * Load the series of a valid dump read into memory. Series that already
+ * exist are kept as they are.
+ */
+static void load_dump(const uint8 *data, Size size, const char *path)
+{
+	DumpReader reader;
+	DumpHeader header;
+	HTAB *loaded;
+	HASHCTL ctl;
+	HASH_SEQ_STATUS seq;
+	LoadedInterned *value;
+	bool histograms;
+	bool complete = false;
+	int64 count = 0;
+	int64 limited = 0;
+
+	memcpy(&header, data, sizeof(DumpHeader));
+	histograms = header.max_bucket_exp == max_bucket_exp &&
+	             header.bucket_variability == bucket_variability;
+	if (!histograms)
+		ereport(LOG, (errmsg("pmetrics: histogram bucket settings changed, "
+		                     "not loading the histograms of \"%s\"",
+		                     path)));
+
+	ctl.keysize = sizeof(uint64);
+	ctl.entrysize = sizeof(LoadedInterned);
+	ctl.hcxt = CurrentMemoryContext;
+	loaded = hash_create("pmetrics loaded values", 1024, &ctl,
+	                     HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	/* Records lie between the header and the CRC */
+	reader.data = data + sizeof(DumpHeader);
+	reader.len = size - sizeof(DumpHeader) - sizeof(pg_crc32c);
+	reader.pos = 0;
+	reader.failed = false;
+
+	while (!reader.failed && !complete) {
+		const uint8 *tag = dump_get_bytes(&reader, 1);
+
+		if (tag == NULL)
+			break;
+
+		switch (*tag) {
+		case DUMP_NAME:
+			load_interned(&reader, INTERNED_NAME, loaded);
+			break;
+		case DUMP_LABELS:
+			load_interned(&reader, INTERNED_LABELS, loaded);
+			break;
+		case DUMP_SERIES:
+			if (load_series(&reader, loaded, histograms, &limited))
+				count++;
+			break;
+		case DUMP_END:
+			complete = true;
+			break;
+		default:
+			reader.failed = true;
+			break;
+		}
+	}
+
+	if (!complete)
+		ereport(LOG, (errmsg("pmetrics: invalid record in \"%s\", ignoring "
+		                     "the rest of it",
+		                     path)));
+
+	/* Drop the references held while loading, freeing unused values */
+	hash_seq_init(&seq, loaded);
+	while ((value = (LoadedInterned *)hash_seq_search(&seq)) != NULL)
+		unref_interned(value->kind, value->key.value.dsa_ptr);
+
+	hash_destroy(loaded);
+
+	ereport(LOG, (errmsg("pmetrics: loaded " INT64_FORMAT
+	                     " series from \"%s\"",
+	                     count, path)));
+	if (limited > 0)
+		ereport(LOG, (errmsg("pmetrics: dropped " INT64_FORMAT
+		                     " series of \"%s\" past the series limits",
+		                     limited, path)));
+}
+
+/*
+ * Read a whole dump file into CurrentMemoryContext. Returns NULL if it
+ * doesn't exist or can't be read, logging why in the latter case.
+ */
+static uint8 *read_dump(const char *path, Size *size)
+{
+	FILE *file;
+	struct stat st;
+	uint8 *data = NULL;
+
+	file = AllocateFile(path, PG_BINARY_R);
+	if (file == NULL) {
+		if (errno != ENOENT)
+			ereport(LOG, (errcode_for_file_access(),
+			              errmsg("could not read file \"%s\": %m", path)));
+		return NULL;
+	}
+
+	if (fstat(fileno(file), &st) == 0) {
+		*size = (Size)st.st_size;
+		data = (uint8 *)palloc_extended(Max(*size, 1), MCXT_ALLOC_HUGE);
+		if (fread(data, 1, *size, file) != *size) {
+			pfree(data);
+			data = NULL;
+		}
+	}
+
+	if (data == NULL)
+		ereport(LOG, (errcode_for_file_access(),
+		              errmsg("could not read file \"%s\": %m", path)));
+
+	FreeFile(file);
+
+	return data;
+}
+
+/*
+ * Check the header and CRC of a dump read into memory, logging why it is
+ * ignored if they don't match.
+ */
+static bool valid_dump(const uint8 *data, Size size, const char *path)
+{
+	DumpHeader header;
+	pg_crc32c crc;
+	pg_crc32c stored_crc;
+
+	if (size < sizeof(DumpHeader) + sizeof(pg_crc32c)) {
+		ereport(LOG,
+		        (errmsg("pmetrics: ignoring truncated file \"%s\"", path)));
+		return false;
+	}
+
+	memcpy(&header, data, sizeof(DumpHeader));
+	if (header.magic != METRICS_DUMP_MAGIC ||
+	    header.version != METRICS_DUMP_VERSION) {
+		ereport(LOG, (errmsg("pmetrics: ignoring file \"%s\" with unknown "
+		                     "format",
+		                     path)));
+		return false;
+	}
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, data, size - sizeof(pg_crc32c));
+	FIN_CRC32C(crc);
+	memcpy(&stored_crc, data + size - sizeof(pg_crc32c), sizeof(pg_crc32c));
+	if (!EQ_CRC32C(crc, stored_crc)) {
+		ereport(LOG, (errmsg("pmetrics: ignoring file \"%s\" with invalid "
+		                     "checksum",
+		                     path)));
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Decode a varint, see dump_put_varint().
+ */
+static uint64 dump_get_varint(DumpReader *reader)
+{
+	uint64 value = 0;
+	int shift = 0;
+
+	while (reader->pos < reader->len && shift < 64) {
+		uint8 byte = reader->data[reader->pos++];
+
+		value |= (uint64)(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0)
+			return value;
+		shift += 7;
+	}
+
+	reader->failed = true;
+	return 0;
+}
+
+static int64 dump_get_signed(DumpReader *reader)
+{
+	uint64 value = dump_get_varint(reader);
+
+	return (int64)(value >> 1) ^ -(int64)(value & 1);
+}
+
+/*
+ * Next len bytes of a dump, NULL if there are fewer left.
+ */
+static const uint8 *dump_get_bytes(DumpReader *reader, Size len)
+{
+	const uint8 *bytes;
+
+	if (len > reader->len - reader->pos) {
+		reader->failed = true;
+		return NULL;
+	}
+
+	bytes = reader->data + reader->pos;
+	reader->pos += len;
+
+	return bytes;
+}
+
+/*
+ * Intern a name or label set record, keeping a reference on it until the
+ * end of the load.
+ */
+static void load_interned(DumpReader *reader, InternedKind kind,
+                          HTAB *loaded)
+{
+	uint64 dump_id = dump_get_varint(reader);
+	uint64 size = dump_get_varint(reader);
+	const uint8 *bytes;
+	LoadedInterned *entry;
+	void *value;
+	bool found;
+
+	if (reader->failed || size == 0 || size > MaxAllocSize) {
+		reader->failed = true;
+		return;
+	}
+
+	bytes = dump_get_bytes(reader, size);
+	if (bytes == NULL)
+		return;
+
+	/* Copied, stored values are aligned */
+	value = palloc(size);
+	memcpy(value, bytes, size);
+
+	if (kind == INTERNED_NAME
+	        ? (size > NAMEDATALEN || strnlen(value, size) != size - 1)
+	        : (size < VARHDRSZ || VARSIZE(value) != size)) {
+		reader->failed = true;
+		pfree(value);
+		return;
+	}
+
+	entry = (LoadedInterned *)hash_search(loaded, &dump_id, HASH_ENTER,
+	                                      &found);
+	if (found) {
+		reader->failed = true;
+		pfree(value);
+		return;
+	}
+
+	entry->kind = kind;
+	init_interned_key(&entry->key, kind, value);
+	entry->key.location = INTERNED_DSA;
+	entry->key.value.dsa_ptr = ref_interned(kind, value, &entry->id);
+	entry->sharded = kind == INTERNED_NAME && name_is_sharded(value);
+
+	pfree(value);
+}
+
+/*
+ * Create a series from a series record. Returns false if it was skipped:
+ * histograms recorded with other bucket settings, a series that already
+ * exists, or one past pmetrics.max_series, max_memory or
+ * max_series_per_name, counted in limited. Loading doesn't evict series nor
+ * create overflow series.
+ */
+static bool load_series(DumpReader *reader, HTAB *loaded, bool histograms,
+                        int64 *limited)
+{
+	uint64 name_id = dump_get_varint(reader);
+	uint64 labels_id = dump_get_varint(reader);
+	uint64 type = dump_get_varint(reader);
+	LoadedInterned *name;
+	LoadedInterned *labels = NULL;
+	MetricKey key;
+	Metric *entry;
+	pg_atomic_uint64 *cells;
+	dsa_pointer cells_ptr;
+	dsa_pointer shards_ptr;
+	int64 value;
+	uint64 nbuckets;
+	uint64 i;
+	bool found;
+	bool skip;
+
+	if (reader->failed)
+		return false;
+
+	name = (LoadedInterned *)hash_search(loaded, &name_id, HASH_FIND, NULL);
+	if (labels_id != NO_LABELS_ID)
+		labels = (LoadedInterned *)hash_search(loaded, &labels_id, HASH_FIND,
+		                                       NULL);
+	if (name == NULL || name->kind != INTERNED_NAME ||
+	    (labels_id != NO_LABELS_ID &&
+	     (labels == NULL || labels->kind != INTERNED_LABELS)) ||
+	    type > METRIC_TYPE_HISTOGRAM) {
+		reader->failed = true;
+		return false;
+	}
+
+	value = dump_get_signed(reader);
+
+	skip = type == METRIC_TYPE_HISTOGRAM && !histograms;
+	if (!skip && (name_limit_reached(name->key.value.dsa_ptr) ||
+	              global_limit_reached())) {
+		(*limited)++;
+		skip = true;
+	}
+
+	if (skip) {
+		if (type == METRIC_TYPE_HISTOGRAM) {
+			nbuckets = dump_get_varint(reader);
+			for (i = 0; i < nbuckets && !reader->failed; i++) {
+				(void)dump_get_varint(reader);
+				(void)dump_get_signed(reader);
+			}
+		}
+		return false;
+	}
+
+	key.name_id = name->id;
+	key.labels_id = labels != NULL ? labels->id : NO_LABELS_ID;
+	key.type = (MetricType)type;
+
+	/* The new entry takes over these references */
+	ref_loaded(name);
+	if (labels != NULL)
+		ref_loaded(labels);
+
+	if (!alloc_metric_cells(key.type,
+	                        name->sharded && key.type != METRIC_TYPE_GAUGE,
+	                        &cells_ptr, &shards_ptr)) {
+		unref_metric_values(name->key.value.dsa_ptr,
+		                    labels != NULL ? labels->key.value.dsa_ptr
+		                                   : InvalidDsaPointer);
+		series_oom_error();
+	}
+
+	entry = (Metric *)dshash_find_or_insert(local_metrics_table, &key, &found);
+	if (found) {
+		dshash_release_lock(local_metrics_table, entry);
+		free_metric_cells(cells_ptr, shards_ptr);
+		unref_metric_values(name->key.value.dsa_ptr,
+		                    labels != NULL ? labels->key.value.dsa_ptr
+		                                   : InvalidDsaPointer);
+		return false;
 	}
-	PG_END_TRY();
 
-	pfree(name_str);
-	return new_value;
-}
+	init_metric(local_metrics_table, entry, name->key.value.dsa_ptr,
+	            labels != NULL ? labels->key.value.dsa_ptr
+	                           : InvalidDsaPointer,
+	            cells_ptr, shards_ptr);
 
-PG_FUNCTION_INFO_V1(increment_counter_by);
-Datum increment_counter_by(PG_FUNCTION_ARGS)
-{
-	Datum new_value;
-	Jsonb *labels_jsonb;
-	char *name_str = NULL;
-	int increment;
+	cells = metric_cells(entry, -1);
+	if (key.type != METRIC_TYPE_HISTOGRAM) {
+		pg_atomic_write_u64(&cells[0], (uint64)value);
+	} else {
+		pg_atomic_write_u64(&cells[HISTOGRAM_SUM_CELL], (uint64)value);
 
-	if (!pmetrics_enabled)
-		PG_RETURN_NULL();
+		nbuckets = dump_get_varint(reader);
+		for (i = 0; i < nbuckets && !reader->failed; i++) {
+			uint64 bucket = dump_get_varint(reader);
+			int64 count = dump_get_signed(reader);
 
-	PG_TRY();
-	{
-		extract_metric_args(fcinfo, 0, 1, &name_str, &labels_jsonb);
-		increment = PG_GETARG_INT32(2);
+			if (bucket > (uint64)max_bucket_exp) {
+				reader->failed = true;
+				break;
+			}
+			pg_atomic_write_u64(&cells[HISTOGRAM_BUCKET_CELL(bucket)],
+			                    (uint64)count);
+		}
+	}
 
-		if (increment <= 0)
-			elog(ERROR, "increment must be greater than 0");
+	dshash_release_lock(local_metrics_table, entry);
 
-		new_value = increment_by(name_str, labels_jsonb, METRIC_TYPE_COUNTER, 0,
-		                         increment);
-	}
-	PG_CATCH();
-	{
-		if (name_str)
-			pfree(name_str);
-		PG_RE_THROW();
-	}
-	PG_END_TRY();
+	return true;
+}
 
-	pfree(name_str);
-	return new_value;
+/*
+ * Take another reference on a value interned by load_interned(). Its stored
+ * key has the hash already, so this doesn't hash the value again.
+ */
+static void ref_loaded(const LoadedInterned *loaded)
+{
+	InternedEntry *entry;
+
+	entry = (InternedEntry *)dshash_find(local_interned_table, &loaded->key,
+	                                     true);
+	if (entry == NULL)
+		elog(ERROR, "pmetrics: interned value not found");
+
+	entry->refcount++;
+	dshash_release_lock(local_interned_table, entry);
 }
 
-PG_FUNCTION_INFO_V1(set_gauge);
-Datum set_gauge(PG_FUNCTION_ARGS)
+/*
+ * Compute the upper bound of every bucket index, which index collects the
+ * observations of each bound, and the tables used to find the bucket of a
+ * value. Called once in postmaster, backends inherit the tables.
+ */
+static void init_bucket_bounds(void)
 {
-	Jsonb *labels_jsonb;
-	char *name_str = NULL;
-	int64 new_value;
-	int64 result;
+	int i;
+	int max_binade;
 
-	if (!pmetrics_enabled)
-		PG_RETURN_NULL();
+	bucket_bounds = (int *)MemoryContextAlloc(
+	    TopMemoryContext, (max_bucket_exp + 1) * sizeof(int));
+	bucket_cells = (int *)MemoryContextAlloc(
+	    TopMemoryContext, (max_bucket_exp + 1) * sizeof(int));
 
-	PG_TRY();
-	{
-		extract_metric_args(fcinfo, 0, 1, &name_str, &labels_jsonb);
-		new_value = PG_GETARG_INT64(2);
+	for (i = 0; i <= max_bucket_exp; i++) {
+		bucket_bounds[i] = (int)pow(gamma_val, i);
 
-		result = pmetrics_set_gauge(name_str, labels_jsonb, new_value);
+		if (i > 0 && bucket_bounds[i] == bucket_bounds[i - 1])
+			bucket_cells[i] = bucket_cells[i - 1];
+		else
+			bucket_cells[i] = i;
 	}
-	PG_CATCH();
-	{
-		if (name_str)
-			pfree(name_str);
 
-		PG_RE_THROW();
+	/* Index 0 starts at 1.0, values below it are handled before lookup */
+	bucket_thresholds = (double *)MemoryContextAlloc(
+	    TopMemoryContext, (max_bucket_exp + 2) * sizeof(double));
+	bucket_thresholds[0] = 1.0;
+	for (i = 1; i <= max_bucket_exp + 1; i++)
+		bucket_thresholds[i] = bucket_threshold(i);
+
+	max_binade = binade_of(bucket_thresholds[max_bucket_exp + 1]);
+	binade_first = (int *)MemoryContextAlloc(TopMemoryContext,
+	                                         (max_binade + 1) * sizeof(int));
+	binade_last = (int *)MemoryContextAlloc(TopMemoryContext,
+	                                        (max_binade + 1) * sizeof(int));
+	for (i = 0; i <= max_binade; i++) {
+		double start = ldexp(1.0, i);
+
+		binade_first[i] = bucket_index_linear(start);
+		binade_last[i] = bucket_index_linear(nextafter(2 * start, 0));
 	}
-	PG_END_TRY();
+}
 
-	pfree(name_str);
-	PG_RETURN_INT64(result);
+/*
+ * Bucket index of a value >= 1.0 by definition, before clamping. The lookup
+ * tables are derived from this, and it is only called directly for values
+ * beyond the last bucket.
+ */
+static int bucket_index_reference(double value)
+{
+	return (int)fmax(ceil(log(value) / log_gamma), 0);
 }
 
-PG_FUNCTION_INFO_V1(add_to_gauge);
-Datum add_to_gauge(PG_FUNCTION_ARGS)
+/*
+ * Smallest double whose reference bucket index is at least index (> 0).
+ *
+ * The reference index never decreases as the value grows, so bisect over the
+ * bit patterns of positive doubles, which sort like the values. This makes
+ * the table agree with the reference on every double, including values right
+ * at a boundary where log() rounding decides the bucket.
+ */
+static double bucket_threshold(int index)
 {
-	Datum new_value;
-	Jsonb *labels_jsonb;
-	char *name_str = NULL;
-	int increment;
+	union {
+		double value;
+		uint64 bits;
+	} lo, hi, mid;
+
+	hi.value = 2 * pow(gamma_val, index);
+	while (bucket_index_reference(hi.value) < index)
+		hi.value *= 2;
+
+	lo.value = 1.0;
+	while (hi.bits - lo.bits > 1) {
+		mid.bits = lo.bits + (hi.bits - lo.bits) / 2;
+		if (bucket_index_reference(mid.value) >= index)
+			hi = mid;
+		else
+			lo = mid;
+	}
 
-	if (!pmetrics_enabled)
-		PG_RETURN_NULL();
+	return hi.value;
+}
 
-	PG_TRY();
-	{
-		extract_metric_args(fcinfo, 0, 1, &name_str, &labels_jsonb);
-		increment = PG_GETARG_INT32(2);
+/*
+ * Bucket index of a value >= 1.0 by scanning the thresholds, unclamped up to
+ * max_bucket_exp + 1. Only used to build the binade tables.
+ */
+static int bucket_index_linear(double value)
+{
+	int index = 0;
 
-		if (increment == 0)
-			elog(ERROR, "value can't be 0");
+	while (index <= max_bucket_exp && bucket_thresholds[index + 1] <= value)
+		index++;
+
+	return index;
+}
+
+/*
+ * Binary exponent of a normal, positive double, read from its bits.
+ */
+static int binade_of(double value)
+{
+	uint64 bits;
 
-		new_value = increment_by(name_str, labels_jsonb, METRIC_TYPE_GAUGE, 0,
-		                         increment);
+	memcpy(&bits, &value, sizeof(bits));
+
+	return (int)((bits >> 52) & 0x7FF) - 1023;
+}
+
+/*
+ * Exponential bucket index for a value, between 0 and max_bucket_exp, equal
+ * to ceil(log(value) / log(gamma)) clamped. Indexes sharing an upper bound
+ * are folded into the lowest one.
+ *
+ * The exponent of the value selects the few buckets its binade overlaps, and
+ * a binary search over their thresholds picks one, so recording doesn't call
+ * into libm.
+ */
+static int bucket_index_for(double value)
+{
+	int lo;
+	int hi;
+
+	/* Also true for NaN */
+	if (!(value >= bucket_thresholds[1]))
+		return bucket_cells[0];
+
+	if (value >= bucket_thresholds[max_bucket_exp + 1]) {
+		if (isinf(value) ||
+		    (int)pow(gamma_val, bucket_index_reference(value)) >
+		        buckets_upper_bound)
+			elog(NOTICE, "Histogram data truncated: value %f to %d", value,
+			     buckets_upper_bound);
+		return bucket_cells[max_bucket_exp];
 	}
-	PG_CATCH();
-	{
-		if (name_str)
-			pfree(name_str);
 
-		PG_RE_THROW();
+	lo = binade_first[binade_of(value)];
+	hi = binade_last[binade_of(value)];
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+
+		if (bucket_thresholds[mid] <= value)
+			lo = mid;
+		else
+			hi = mid - 1;
 	}
-	PG_END_TRY();
 
-	pfree(name_str);
-	return new_value;
+	return bucket_cells[lo];
 }
 
-PG_FUNCTION_INFO_V1(list_metrics);
-Datum list_metrics(PG_FUNCTION_ARGS)
+/*
+ * Upper bound of a bucket index, as reported in list_metrics().
+ */
+static int bucket_upper_bound(int index)
 {
-	FuncCallContext *funcctx;
-	Metric **metrics;
-	int current_idx;
-
-	if (SRF_IS_FIRSTCALL()) {
-		MemoryContext oldcontext;
-		TupleDesc tupdesc;
-		dshash_table *table;
-		dshash_seq_status status;
-		Metric *metric;
-		int capacity = 16;
-		int count = 0;
+	return bucket_bounds[index];
+}
 
-		funcctx = SRF_FIRSTCALL_INIT();
-		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+/*
+ * Id of an interned value, or UNKNOWN_INTERNED_ID if it isn't interned. With
+ * use_cache, the id may come from this backend's cache and be stale.
+ */
+static uint64 lookup_interned_id(InternedKind kind, const void *value,
+                                 bool use_cache)
+{
+	CachedInterned *cached;
+	InternedEntry *entry;
+	InternedKey search;
+	uint64 id;
+
+	init_interned_key(&search, kind, value);
+
+	if (use_cache && interned_cache != NULL) {
+		cached = (CachedInterned *)hash_search(interned_cache, &search,
+		                                       HASH_FIND, NULL);
+		if (cached != NULL)
+			return cached->id;
+	}
 
-		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-			ereport(ERROR,
-			        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-			         errmsg("function returning record called in context "
-			                "that cannot accept type record")));
+	(void)get_metrics_table();
 
-		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+	entry =
+	    (InternedEntry *)dshash_find(local_interned_table, &search, false);
+	if (entry == NULL)
+		return UNKNOWN_INTERNED_ID;
 
-		table = get_metrics_table();
+	id = entry->id;
+	dshash_release_lock(local_interned_table, entry);
 
-		/*
-		 * Materialize all metrics in the first call.
-		 * We can't use dshash_seq_next() across SRF calls because it holds
-		 * partition locks that must be released between iterations.
-		 */
-		metrics = (Metric **)palloc(capacity * sizeof(Metric *));
-
-		/* Scan the entire hash table and copy all entries */
-		dshash_seq_init(&status, table, false); /* false = shared lock */
-		while ((metric = (Metric *)dshash_seq_next(&status)) != NULL) {
-			Jsonb *labels_copy = NULL;
-
-			/* Expand array if needed */
-			if (count >= capacity) {
-				capacity *= 2;
-				metrics =
-				    (Metric **)repalloc(metrics, capacity * sizeof(Metric *));
-			}
+	cache_interned_id(&search, id);
 
-			/* Copy the metric to backend-local memory */
-			metrics[count] = (Metric *)palloc(sizeof(Metric));
-			memcpy(metrics[count], metric, sizeof(Metric));
+	return id;
+}
 
-			/* Copy JSONB labels to backend-local memory if they exist in DSA */
-			if (metric->key.labels_location == LABELS_DSA &&
-			    metric->key.labels.dsa_ptr != InvalidDsaPointer) {
-				Jsonb *dsa_labels = (Jsonb *)dsa_get_address(
-				    local_dsa, metric->key.labels.dsa_ptr);
-				size_t jsonb_size = VARSIZE(dsa_labels);
+/*
+ * Intern a value, or find it if already interned, and take a reference on
+ * it. Sets id and returns the interned copy.
+ *
+ * Values already interned are only looked up. Otherwise the NameUsage of a
+ * name is allocated before the name is inserted, so a name is never in the
+ * dictionary without it, and freed if another backend interned the name in
+ * between. Indexing the labels of a new label set can still fail once it is
+ * inserted, and is then resumed by the next reference.
+ */
+static dsa_pointer ref_interned(InternedKind kind, const void *value,
+                                uint64 *id)
+{
+	InternedEntry *entry;
+	InternedKey search;
+	dsa_pointer result;
+	dsa_pointer usage = InvalidDsaPointer;
+	bool found;
 
-				labels_copy = (Jsonb *)palloc(jsonb_size);
-				memcpy(labels_copy, dsa_labels, jsonb_size);
+	init_interned_key(&search, kind, value);
 
-				/* Update the copied metric to point to local copy */
-				metrics[count]->key.labels.local_ptr = labels_copy;
-				metrics[count]->key.labels_location = LABELS_LOCAL;
-			}
+	entry = (InternedEntry *)dshash_find(local_interned_table, &search, true);
+	if (entry == NULL) {
+		if (kind == INTERNED_NAME) {
+			NameUsage *counters;
 
-			count++;
+			usage = dsa_allocate(local_dsa, sizeof(NameUsage));
+			counters = (NameUsage *)dsa_get_address(local_dsa, usage);
+			pg_atomic_init_u64(&counters->label_bytes, 0);
+			pg_atomic_init_u32(&counters->last_update, 0);
 		}
-		dshash_seq_term(&status);
-
-		/* Store the materialized metrics and count */
-		funcctx->user_fctx = metrics;
-		funcctx->max_calls = count;
 
-		MemoryContextSwitchTo(oldcontext);
+		entry = (InternedEntry *)dshash_find_or_insert(local_interned_table,
+		                                               &search, &found);
+		if (!found) {
+			entry->id =
+			    pg_atomic_fetch_add_u64(&shared_state->next_interned_id, 1);
+			entry->refcount = 0;
+			init_slot_index(&entry->series);
+			entry->pair_slots = InvalidDsaPointer;
+			entry->indexed_pairs = 0;
+			entry->pairs_indexed = false;
+			entry->usage = usage;
+			count_table_entry(TABLE_INTERNED, (uint32)search.hash, 1);
+			account_memory(interned_memory_kind(kind), 1,
+			               sizeof(InternedEntry) +
+			                   interned_value_size(kind, value));
+			if (DsaPointerIsValid(usage))
+				account_memory(MEMORY_NAMES, 0, sizeof(NameUsage));
+		} else if (DsaPointerIsValid(usage)) {
+			dsa_free(local_dsa, usage);
+		}
 	}
 
-	funcctx = SRF_PERCALL_SETUP();
-	metrics = (Metric **)funcctx->user_fctx;
-	current_idx = funcctx->call_cntr;
+	if (kind == INTERNED_LABELS && local_label_pairs_table != NULL &&
+	    !entry->pairs_indexed)
+		index_label_pairs(entry);
 
-	if (current_idx < funcctx->max_calls) {
-		Metric *metric = metrics[current_idx];
-		Datum values[5];
-		bool nulls[5] = {false, false, false, false, false};
-		HeapTuple tuple;
-		Datum result;
-		const char *type_str;
+	entry->refcount++;
+	*id = entry->id;
+	result = entry->key.value.dsa_ptr;
 
-		/* Convert metric type enum to string */
-		switch (metric->key.type) {
-		case METRIC_TYPE_COUNTER:
-			type_str = "counter";
-			break;
-		case METRIC_TYPE_GAUGE:
-			type_str = "gauge";
-			break;
-		case METRIC_TYPE_HISTOGRAM:
-			type_str = "histogram";
-			break;
-		case METRIC_TYPE_HISTOGRAM_SUM:
-			type_str = "histogram_sum";
-			break;
-		default:
-			type_str = "unknown";
-			break;
-		}
+	dshash_release_lock(local_interned_table, entry);
 
-		values[0] = CStringGetTextDatum(metric->key.name);
+	cache_interned_id(&search, *id);
 
-		if (metric->key.labels_location == LABELS_LOCAL &&
-		    metric->key.labels.local_ptr != NULL) {
-			values[1] = JsonbPGetDatum(metric->key.labels.local_ptr);
-		} else {
-			nulls[1] = true;
-		}
+	return result;
+}
 
-		values[2] = CStringGetTextDatum(type_str);
-		values[3] = Int32GetDatum(metric->key.bucket);
-		values[4] = Int64GetDatum(metric->value);
-		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
-		result = HeapTupleGetDatum(tuple);
-		SRF_RETURN_NEXT(funcctx, result);
+/*
+ * Drop a reference on an interned value, freeing it with the last one.
+ */
+static void unref_interned(InternedKind kind, dsa_pointer value)
+{
+	InternedEntry *entry;
+	const void *stored;
+
+	entry = find_stored_interned(kind, value, true);
+
+	Assert(entry->refcount > 0);
+	entry->refcount--;
+
+	if (entry->refcount == 0) {
+		/* Series hold references, so their index has no live slot left */
+		free_slot_index(&entry->series);
+		if (kind == INTERNED_LABELS)
+			unindex_label_pairs(entry);
+		if (DsaPointerIsValid(entry->usage)) {
+			dsa_free(local_dsa, entry->usage);
+			account_memory(MEMORY_NAMES, 0, -(int64)sizeof(NameUsage));
+		}
+		stored = dsa_get_address(local_dsa, entry->key.value.dsa_ptr);
+		count_table_entry(TABLE_INTERNED, (uint32)entry->key.hash, -1);
+		account_memory(interned_memory_kind(kind), -1,
+		               -(int64)(sizeof(InternedEntry) +
+		                        interned_value_size(kind, stored)));
+		dsa_free(local_dsa, entry->key.value.dsa_ptr);
+		dshash_delete_entry(local_interned_table, entry);
 	} else {
-		/* All metrics returned */
-		SRF_RETURN_DONE(funcctx);
+		dshash_release_lock(local_interned_table, entry);
 	}
 }
 
 /*
- * C API functions for other extensions to call
- * These are marked with visibility("default") to be externally accessible
+ * Take another reference on an interned value from its stored copy, which
+ * the caller holds a reference on.
  */
-
-__attribute__((visibility("default"))) int64
-pmetrics_increment_counter(const char *name_str, Jsonb *labels_jsonb)
+static void ref_stored_interned(InternedKind kind, dsa_pointer value)
 {
-	validate_inputs(name_str);
-	return increment_by(name_str, labels_jsonb, METRIC_TYPE_COUNTER, 0, 1);
+	InternedEntry *entry = find_stored_interned(kind, value, true);
+
+	entry->refcount++;
+	dshash_release_lock(local_interned_table, entry);
 }
 
-__attribute__((visibility("default"))) int64 pmetrics_increment_counter_by(
-    const char *name_str, Jsonb *labels_jsonb, int64 amount)
+/*
+ * Find the entry of an interned value from its stored copy, which the caller
+ * holds a reference on. Returns it with its partition lock held.
+ */
+static InternedEntry *find_stored_interned(InternedKind kind,
+                                           dsa_pointer value, bool exclusive)
 {
-	validate_inputs(name_str);
+	InternedEntry *entry;
+	InternedKey search;
 
-	if (amount <= 0)
-		elog(ERROR, "increment must be greater than 0");
+	search.kind = kind;
+	search.location = INTERNED_DSA;
+	search.value.dsa_ptr = value;
+	search.hash =
+	    interned_value_hash(kind, dsa_get_address(local_dsa, value));
+
+	entry = (InternedEntry *)dshash_find(local_interned_table, &search,
+	                                     exclusive);
+	if (entry == NULL)
+		elog(ERROR, "pmetrics: interned value not found");
 
-	return increment_by(name_str, labels_jsonb, METRIC_TYPE_COUNTER, 0, amount);
+	return entry;
 }
 
-__attribute__((visibility("default"))) int64
-pmetrics_set_gauge(const char *name_str, Jsonb *labels_jsonb, int64 value)
+/*
+ * Add a new series to the series index of its interned name or label set.
+ * other_id is the id of the other half of its key. Returns its slot, which
+ * the entry keeps to be removed later, and sets usage to the NameUsage of
+ * names. Returns -1 if the index couldn't grow. Called with the partition
+ * lock of the series held, dictionary locks are always taken after metrics
+ * ones.
+ */
+static int index_series(InternedKind kind, dsa_pointer value, uint64 other_id,
+                        MetricType type, dsa_pointer *usage)
 {
-	Metric *entry;
-	MetricKey metric_key;
-	bool found;
-	dshash_table *table;
-	int64 result;
+	InternedEntry *entry;
+	int slot;
 
-	validate_inputs(name_str);
+	entry = find_stored_interned(kind, value, true);
+	slot = add_index_slot(&entry->series, other_id, InvalidDsaPointer,
+	                      (int)type);
+	if (usage != NULL)
+		*usage = entry->usage;
+	dshash_release_lock(local_interned_table, entry);
 
-	table = get_metrics_table();
-	if (table == NULL)
-		elog(ERROR, "pmetrics not initialized");
+	return slot;
+}
 
-	init_metric_key(&metric_key, name_str, labels_jsonb, METRIC_TYPE_GAUGE, 0);
+/*
+ * Remove a series from the series index of its name or label set.
+ */
+static void unindex_series(InternedKind kind, dsa_pointer value, int slot)
+{
+	InternedEntry *entry;
 
-	entry = (Metric *)dshash_find_or_insert(table, &metric_key, &found);
+	entry = find_stored_interned(kind, value, true);
+	remove_index_slot(&entry->series, slot);
+	dshash_release_lock(local_interned_table, entry);
+}
 
-	entry->value = value;
-	result = entry->value;
+/*
+ * Append the keys of the series of a name or label set to a list. Returns
+ * false if the value isn't interned, so has no series.
+ */
+static bool find_interned_series(InternedKind kind, const void *value,
+                                 SeriesList *series)
+{
+	InternedEntry *entry;
+	InternedKey search;
 
-	dshash_release_lock(table, entry);
+	init_interned_key(&search, kind, value);
 
-	return result;
-}
+	(void)get_metrics_table();
 
-__attribute__((visibility("default"))) int64
-pmetrics_add_to_gauge(const char *name_str, Jsonb *labels_jsonb, int64 amount)
-{
-	validate_inputs(name_str);
+	entry =
+	    (InternedEntry *)dshash_find(local_interned_table, &search, false);
+	if (entry == NULL)
+		return false;
 
-	if (amount == 0)
-		elog(ERROR, "value can't be 0");
+	append_interned_series(series, entry);
+	dshash_release_lock(local_interned_table, entry);
 
-	return increment_by(name_str, labels_jsonb, METRIC_TYPE_GAUGE, 0, amount);
+	return true;
 }
 
-__attribute__((visibility("default"))) int64 pmetrics_record_to_histogram(
-    const char *name_str, Jsonb *labels_jsonb, double value)
+/*
+ * Append the keys of the series in the index of a name or label set entry to
+ * a list, allocated in CurrentMemoryContext. Caller must hold the partition
+ * lock of the entry.
+ */
+static void append_interned_series(SeriesList *series,
+                                   const InternedEntry *entry)
 {
-	Datum bucket_count;
-	int bucket;
-
-	validate_inputs(name_str);
+	const IndexSlot *slots;
+	int i;
+
+	if (entry->series.live == 0)
+		return;
+
+	if (series->count + entry->series.live > series->capacity) {
+		int64 capacity = Max(series->capacity * 2,
+		                     series->count + entry->series.live);
+
+		if (series->keys == NULL)
+			series->keys = palloc(capacity * sizeof(MetricKey));
+		else
+			series->keys =
+			    repalloc(series->keys, capacity * sizeof(MetricKey));
+		series->capacity = capacity;
+	}
 
-	bucket = bucket_for(value);
+	slots = index_slots(&entry->series);
+	for (i = 0; i < entry->series.used; i++) {
+		MetricKey *key;
 
-	/* Increment the histogram bucket count */
-	bucket_count =
-	    increment_by(name_str, labels_jsonb, METRIC_TYPE_HISTOGRAM, bucket, 1);
+		if (slots[i].type == FREE_INDEX_SLOT)
+			continue;
 
-	/* Add to histogram sum (bucket is always 0 for sum type) */
-	increment_by(name_str, labels_jsonb, METRIC_TYPE_HISTOGRAM_SUM, 0,
-	             (int64)value);
+		key = &series->keys[series->count++];
+		if (entry->key.kind == INTERNED_NAME) {
+			key->name_id = entry->id;
+			key->labels_id = slots[i].id;
+		} else {
+			key->name_id = slots[i].id;
+			key->labels_id = entry->id;
+		}
+		key->type = (MetricType)slots[i].type;
+	}
+}
 
-	return bucket_count;
+static void init_slot_index(SlotIndex *index)
+{
+	index->slots = InvalidDsaPointer;
+	index->capacity = 0;
+	index->used = 0;
+	index->live = 0;
+	index->free_slot = -1;
 }
 
-PG_FUNCTION_INFO_V1(record_to_histogram);
-Datum record_to_histogram(PG_FUNCTION_ARGS)
+static IndexSlot *index_slots(const SlotIndex *index)
 {
-	int64 result;
-	Jsonb *labels_jsonb;
-	char *name_str = NULL;
-	double value;
+	return (IndexSlot *)dsa_get_address(local_dsa, index->slots);
+}
 
-	if (!pmetrics_enabled)
-		PG_RETURN_NULL();
+/*
+ * Add a slot, reusing a free one if any. Returns its number, or -1 with the
+ * index unchanged if it couldn't grow, so callers can undo their own work
+ * before raising an error.
+ */
+static int add_index_slot(SlotIndex *index, uint64 id, dsa_pointer value,
+                          int type)
+{
+	IndexSlot *slots;
+	int slot;
 
-	PG_TRY();
-	{
-		extract_metric_args(fcinfo, 0, 1, &name_str, &labels_jsonb);
-		value = PG_GETARG_FLOAT8(2);
-		result = pmetrics_record_to_histogram(name_str, labels_jsonb, value);
-	}
-	PG_CATCH();
-	{
-		if (name_str)
-			pfree(name_str);
+	if (index->free_slot >= 0) {
+		slots = index_slots(index);
+		slot = index->free_slot;
+		index->free_slot = (int)(int64)slots[slot].id;
+	} else {
+		if (index->used == index->capacity) {
+			int capacity = Max(index->capacity * 2, MIN_INDEX_SLOTS);
+			dsa_pointer grown = dsa_allocate_extended(
+			    local_dsa, capacity * sizeof(IndexSlot), DSA_ALLOC_NO_OOM);
+
+			if (!DsaPointerIsValid(grown))
+				return -1;
+			if (DsaPointerIsValid(index->slots)) {
+				memcpy(dsa_get_address(local_dsa, grown), index_slots(index),
+				       index->used * sizeof(IndexSlot));
+				dsa_free(local_dsa, index->slots);
+			}
+			index->slots = grown;
+			account_memory(MEMORY_INDEXES, 0,
+			               (int64)(capacity - index->capacity) *
+			                   sizeof(IndexSlot));
+			index->capacity = capacity;
+		}
 
-		PG_RE_THROW();
+		slots = index_slots(index);
+		slot = index->used++;
 	}
-	PG_END_TRY();
 
-	pfree(name_str);
-	PG_RETURN_INT64(result);
+	slots[slot].id = id;
+	slots[slot].value = value;
+	slots[slot].type = type;
+	index->live++;
+
+	return slot;
 }
 
-PG_FUNCTION_INFO_V1(list_histogram_buckets);
-Datum list_histogram_buckets(PG_FUNCTION_ARGS)
+/*
+ * Free a slot, putting it on the free list.
+ */
+static void remove_index_slot(SlotIndex *index, int slot)
 {
-	FuncCallContext *funcctx;
-	int *buckets;
-	int current_idx;
+	IndexSlot *slots = index_slots(index);
 
-	if (SRF_IS_FIRSTCALL()) {
-		MemoryContext oldcontext;
-		TupleDesc tupdesc;
-		int max_bucket_exp;
-		int num_buckets;
-		int i;
-		int count;
+	Assert(slot >= 0 && slot < index->used);
+	Assert(slots[slot].type != FREE_INDEX_SLOT);
 
-		funcctx = SRF_FIRSTCALL_INIT();
-		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+	slots[slot].id = (uint64)(int64)index->free_slot;
+	slots[slot].value = InvalidDsaPointer;
+	slots[slot].type = FREE_INDEX_SLOT;
+	index->free_slot = slot;
+	index->live--;
+}
 
-		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-			ereport(ERROR,
-			        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-			         errmsg("function returning record called in context "
-			                "that cannot accept type record")));
+static void free_slot_index(SlotIndex *index)
+{
+	if (DsaPointerIsValid(index->slots)) {
+		dsa_free(local_dsa, index->slots);
+		account_memory(MEMORY_INDEXES, 0,
+		               -(int64)index->capacity * sizeof(IndexSlot));
+	}
+	init_slot_index(index);
+}
 
-		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+/*
+ * One-label JSONB objects for the scalar labels of a label set, in label
+ * order, allocated in CurrentMemoryContext. Nested values aren't indexed.
+ */
+static Jsonb **label_pairs(Jsonb *labels, int *npairs)
+{
+	JsonbIterator *it;
+	JsonbIteratorToken token;
+	JsonbValue key;
+	JsonbValue value;
+	Jsonb **pairs;
+
+	*npairs = 0;
+	if (!JB_ROOT_IS_OBJECT(labels) || JB_ROOT_COUNT(labels) == 0)
+		return NULL;
 
-		max_bucket_exp = ceil(log(buckets_upper_bound) / log_gamma);
-		num_buckets = max_bucket_exp + 1;
+	pairs = palloc(JB_ROOT_COUNT(labels) * sizeof(Jsonb *));
 
-		buckets = (int *)palloc(num_buckets * sizeof(int));
+	it = JsonbIteratorInit(&labels->root);
+	while ((token = JsonbIteratorNext(&it, &key, true)) != WJB_DONE) {
+		JsonbParseState *state = NULL;
 
-		/* Generate unique bucket values */
-		count = 0;
-		buckets[count++] = 0;
-		for (i = 1; i <= max_bucket_exp; i++) {
-			int bucket_value = (int)pow(gamma_val, i);
-			if (bucket_value != buckets[count - 1])
-				buckets[count++] = bucket_value;
-		}
+		if (token != WJB_KEY)
+			continue;
 
-		funcctx->user_fctx = buckets;
-		funcctx->max_calls = count;
+		token = JsonbIteratorNext(&it, &value, true);
+		Assert(token == WJB_VALUE);
+		if (value.type == jbvBinary)
+			continue;
 
-		MemoryContextSwitchTo(oldcontext);
+		pushJsonbValue(&state, WJB_BEGIN_OBJECT, NULL);
+		pushJsonbValue(&state, WJB_KEY, &key);
+		pushJsonbValue(&state, WJB_VALUE, &value);
+		pairs[(*npairs)++] =
+		    JsonbValueToJsonb(pushJsonbValue(&state, WJB_END_OBJECT, NULL));
 	}
 
-	funcctx = SRF_PERCALL_SETUP();
-	buckets = (int *)funcctx->user_fctx;
-	current_idx = funcctx->call_cntr;
+	return pairs;
+}
 
-	if (current_idx < funcctx->max_calls) {
-		Datum values[1];
-		bool nulls[1] = {false};
-		HeapTuple tuple;
-		Datum result;
+/*
+ * Add a new label set to the posting lists of its scalar labels. Called with
+ * its dictionary partition lock held exclusively, label pair locks are
+ * always taken after dictionary ones.
+ *
+ * Each label counts as indexed once its slot is stored, so after an error
+ * the entry is consistent and a later call carries on from the next label.
+ */
+static void index_label_pairs(InternedEntry *entry)
+{
+	Jsonb **pairs;
+	int npairs;
+	int *slots;
+
+	pairs = label_pairs(
+	    (Jsonb *)dsa_get_address(local_dsa, entry->key.value.dsa_ptr),
+	    &npairs);
+	if (npairs == 0) {
+		entry->pairs_indexed = true;
+		return;
+	}
 
-		values[0] = Int32GetDatum(buckets[current_idx]);
+	if (!DsaPointerIsValid(entry->pair_slots)) {
+		entry->pair_slots = dsa_allocate(local_dsa, npairs * sizeof(int));
+		account_memory(MEMORY_INDEXES, 0, npairs * sizeof(int));
+	}
+	slots = (int *)dsa_get_address(local_dsa, entry->pair_slots);
+
+	while (entry->indexed_pairs < npairs) {
+		int i = entry->indexed_pairs;
+		LabelPairEntry *pair;
+		InternedKey search;
+		bool found;
+
+		init_interned_key(&search, INTERNED_LABEL_PAIR, pairs[i]);
+		pair = (LabelPairEntry *)dshash_find_or_insert(local_label_pairs_table,
+		                                               &search, &found);
+		if (!found) {
+			init_slot_index(&pair->postings);
+			count_table_entry(TABLE_LABEL_PAIRS, (uint32)search.hash, 1);
+			account_memory(MEMORY_INDEXES, 1,
+			               sizeof(LabelPairEntry) + VARSIZE(pairs[i]));
+		}
 
-		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
-		result = HeapTupleGetDatum(tuple);
-		SRF_RETURN_NEXT(funcctx, result);
-	} else {
-		SRF_RETURN_DONE(funcctx);
+		slots[i] = add_index_slot(&pair->postings, entry->id,
+		                          entry->key.value.dsa_ptr, 0);
+		dshash_release_lock(local_label_pairs_table, pair);
+		if (slots[i] < 0)
+			ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY),
+			                errmsg("out of shared memory")));
+		entry->indexed_pairs++;
 	}
+
+	entry->pairs_indexed = true;
 }
 
-__attribute__((visibility("default"))) int64 pmetrics_clear_metrics(void)
+/*
+ * Remove a label set about to be freed from the posting lists it is in,
+ * removing the label pairs left without any.
+ */
+static void unindex_label_pairs(InternedEntry *entry)
 {
-	dshash_table *metrics_table;
-	dshash_seq_status status;
-	Metric *entry;
-	int64 deleted_count = 0;
-
-	metrics_table = get_metrics_table();
-
-	dshash_seq_init(&status, metrics_table, true);
-	while ((entry = dshash_seq_next(&status)) != NULL) {
-		if (entry->key.labels_location == LABELS_DSA) {
-			dsa_free(local_dsa, entry->key.labels.dsa_ptr);
+	Jsonb **pairs;
+	int npairs;
+	int *slots;
+	int i;
+
+	if (!DsaPointerIsValid(entry->pair_slots))
+		return;
+
+	pairs = label_pairs(
+	    (Jsonb *)dsa_get_address(local_dsa, entry->key.value.dsa_ptr),
+	    &npairs);
+	slots = (int *)dsa_get_address(local_dsa, entry->pair_slots);
+
+	for (i = 0; i < entry->indexed_pairs; i++) {
+		LabelPairEntry *pair;
+		InternedKey search;
+
+		init_interned_key(&search, INTERNED_LABEL_PAIR, pairs[i]);
+		pair = (LabelPairEntry *)dshash_find(local_label_pairs_table, &search,
+		                                     true);
+		if (pair == NULL)
+			elog(ERROR, "pmetrics: label pair not found");
+
+		remove_index_slot(&pair->postings, slots[i]);
+
+		if (pair->postings.live == 0) {
+			free_slot_index(&pair->postings);
+			count_table_entry(TABLE_LABEL_PAIRS, (uint32)search.hash, -1);
+			account_memory(
+			    MEMORY_INDEXES, -1,
+			    -(int64)(sizeof(LabelPairEntry) + VARSIZE(pairs[i])));
+			dsa_free(local_dsa, pair->key.value.dsa_ptr);
+			dshash_delete_entry(local_label_pairs_table, pair);
+		} else {
+			dshash_release_lock(local_label_pairs_table, pair);
 		}
-		dshash_delete_current(&status);
-		deleted_count++;
 	}
-	dshash_seq_term(&status);
 
-	return deleted_count;
+	dsa_free(local_dsa, entry->pair_slots);
+	account_memory(MEMORY_INDEXES, 0, -(int64)(npairs * sizeof(int)));
+	entry->pair_slots = InvalidDsaPointer;
+	entry->indexed_pairs = 0;
+	entry->pairs_indexed = false;
 }
 
-PG_FUNCTION_INFO_V1(clear_metrics);
-Datum clear_metrics(PG_FUNCTION_ARGS)
+/*
+ * Sorted ids of the label sets in the posting list of a label pair, NULL
+ * if the pair isn't indexed.
+ */
+static uint64 *read_posting_ids(Jsonb *pair, int *count)
 {
-	int64 deleted_count;
+	LabelPairEntry *entry;
+	InternedKey search;
+	const IndexSlot *slots;
+	uint64 *ids;
+	int i;
+
+	*count = 0;
+
+	init_interned_key(&search, INTERNED_LABEL_PAIR, pair);
+	entry = (LabelPairEntry *)dshash_find(local_label_pairs_table, &search,
+	                                      false);
+	if (entry == NULL)
+		return NULL;
 
-	deleted_count = pmetrics_clear_metrics();
+	ids = palloc(entry->postings.live * sizeof(uint64));
+	slots = index_slots(&entry->postings);
+	for (i = 0; i < entry->postings.used; i++) {
+		if (slots[i].type != FREE_INDEX_SLOT)
+			ids[(*count)++] = slots[i].id;
+	}
 
-	PG_RETURN_INT64(deleted_count);
+	dshash_release_lock(local_label_pairs_table, entry);
+
+	qsort(ids, *count, sizeof(uint64), compare_ids);
+
+	return ids;
 }
 
-static int64 delete_metrics_by_name_labels(const char *name_str,
-                                           Jsonb *labels_jsonb)
+/*
+ * Copy the label sets of a posting list whose ids are in a sorted array.
+ * Label sets are only freed after leaving all their posting lists, so their
+ * values can be read under the lock of any of these. Returns their number.
+ */
+static int read_posting_values(Jsonb *pair, const uint64 *ids, int nids,
+                               Jsonb **values)
 {
-	dshash_table *metrics_table;
-	dshash_seq_status status;
-	Metric *entry;
-	int64 deleted_count = 0;
-	Jsonb *entry_labels;
+	LabelPairEntry *entry;
+	InternedKey search;
+	const IndexSlot *slots;
+	int count = 0;
+	int i;
+
+	init_interned_key(&search, INTERNED_LABEL_PAIR, pair);
+	entry = (LabelPairEntry *)dshash_find(local_label_pairs_table, &search,
+	                                      false);
+	if (entry == NULL)
+		return 0;
 
-	metrics_table = get_metrics_table();
-	if (metrics_table == NULL)
-		elog(ERROR, "pmetrics not initialized");
+	slots = index_slots(&entry->postings);
+	for (i = 0; i < entry->postings.used && count < nids; i++) {
+		const void *value;
 
-	dshash_seq_init(&status, metrics_table, true);
-	while ((entry = dshash_seq_next(&status)) != NULL) {
-		/* Check if name matches */
-		if (strcmp(entry->key.name, name_str) != 0)
+		if (slots[i].type == FREE_INDEX_SLOT ||
+		    bsearch(&slots[i].id, ids, nids, sizeof(uint64), compare_ids) ==
+		        NULL)
 			continue;
 
-		/* Check if labels match */
-		entry_labels = get_labels_jsonb(&entry->key, local_dsa);
+		value = dsa_get_address(local_dsa, slots[i].value);
+		values[count] = palloc(VARSIZE(value));
+		memcpy(values[count], value, VARSIZE(value));
+		count++;
+	}
 
-		/* Compare labels - both NULL means match */
-		if (labels_jsonb == NULL && entry_labels == NULL) {
-			/* Both are NULL, they match */
-		} else if (labels_jsonb != NULL && entry_labels != NULL) {
-			/* Both exist, compare them */
-			if (compareJsonbContainers(&labels_jsonb->root,
-			                           &entry_labels->root) != 0)
-				continue;
-		} else {
-			/* One is NULL, the other isn't - no match */
-			continue;
-		}
+	dshash_release_lock(local_label_pairs_table, entry);
+
+	return count;
+}
 
-		/* Free DSA-allocated labels before deleting */
-		if (entry->key.labels_location == LABELS_DSA) {
-			dsa_free(local_dsa, entry->key.labels.dsa_ptr);
+/*
+ * Intersect two sorted id arrays into the first one. Returns its new length.
+ */
+static int intersect_ids(uint64 *ids, int nids, const uint64 *other,
+                         int nother)
+{
+	int i = 0;
+	int j = 0;
+	int count = 0;
+
+	while (i < nids && j < nother) {
+		if (ids[i] < other[j])
+			i++;
+		else if (ids[i] > other[j])
+			j++;
+		else {
+			ids[count++] = ids[i];
+			i++;
+			j++;
 		}
-		dshash_delete_current(&status);
-		deleted_count++;
 	}
-	dshash_seq_term(&status);
 
-	return deleted_count;
+	return count;
 }
 
-__attribute__((visibility("default"))) int64
-pmetrics_delete_metric(const char *name_str, Jsonb *labels_jsonb)
+static int compare_ids(const void *a, const void *b)
 {
-	validate_inputs(name_str);
-	return delete_metrics_by_name_labels(name_str, labels_jsonb);
+	uint64 id1 = *(const uint64 *)a;
+	uint64 id2 = *(const uint64 *)b;
+
+	if (id1 < id2)
+		return -1;
+	if (id1 > id2)
+		return 1;
+	return 0;
 }
 
-PG_FUNCTION_INFO_V1(delete_metric);
-Datum delete_metric(PG_FUNCTION_ARGS)
+/*
+ * Append the keys of the series whose labels contain a JSONB object to a
+ * list.
+ *
+ * With pmetrics.index_labels, the posting lists of the scalar labels of the
+ * object are intersected, and only the label sets left are checked for
+ * containment (which nested values still need). Otherwise, or if the object
+ * has no scalar label, every label set is checked.
+ */
+static void match_labels(Jsonb *labels, SeriesList *series)
 {
-	int64 deleted_count;
-	Jsonb *labels_jsonb;
-	char *name_str = NULL;
+	Jsonb **pairs;
+	Jsonb **values;
+	uint64 *ids = NULL;
+	int npairs;
+	int nids = 0;
+	int smallest = 0;
+	int smallest_count = 0;
+	int i;
+
+	(void)get_metrics_table();
+
+	pairs = label_pairs(labels, &npairs);
+	if (local_label_pairs_table == NULL || npairs == 0) {
+		hash_destroy(match_interned_ids(INTERNED_LABELS, labels_contain,
+		                                PointerGetDatum(labels), series));
+		return;
+	}
 
-	if (!pmetrics_enabled)
-		PG_RETURN_NULL();
+	for (i = 0; i < npairs; i++) {
+		uint64 *pair_ids;
+		int npair_ids;
 
-	PG_TRY();
-	{
-		extract_metric_args(fcinfo, 0, 1, &name_str, &labels_jsonb);
-		deleted_count = delete_metrics_by_name_labels(name_str, labels_jsonb);
-	}
-	PG_CATCH();
-	{
-		if (name_str)
-			pfree(name_str);
-		PG_RE_THROW();
+		pair_ids = read_posting_ids(pairs[i], &npair_ids);
+		if (npair_ids == 0)
+			return;
+
+		/* All lists hold the intersection, values are read from the smallest */
+		if (ids == NULL || npair_ids < smallest_count) {
+			smallest = i;
+			smallest_count = npair_ids;
+		}
+
+		if (ids == NULL) {
+			ids = pair_ids;
+			nids = npair_ids;
+		} else {
+			nids = intersect_ids(ids, nids, pair_ids, npair_ids);
+			pfree(pair_ids);
+			if (nids == 0)
+				return;
+		}
 	}
-	PG_END_TRY();
 
-	pfree(name_str);
-	PG_RETURN_INT64(deleted_count);
-}
+	values = palloc(nids * sizeof(Jsonb *));
+	nids = read_posting_values(pairs[smallest], ids, nids, values);
 
-__attribute__((visibility("default"))) bool pmetrics_is_initialized(void)
-{
-	return shared_state != NULL && shared_state->initialized;
+	for (i = 0; i < nids; i++) {
+		if (labels_contain(values[i], PointerGetDatum(labels)))
+			(void)find_interned_series(INTERNED_LABELS, values[i], series);
+	}
 }
 
-__attribute__((visibility("default"))) dsa_handle pmetrics_get_dsa_handle(void)
+/*
+ * Remember the id of a value in this backend. key must be a local key.
+ */
+static void cache_interned_id(const InternedKey *key, uint64 id)
 {
-	if (shared_state == NULL || !shared_state->initialized)
-		elog(ERROR, "pmetrics not initialized");
+	CachedInterned *cached;
+	bool found;
 
-	return shared_state->dsa;
-}
+	Assert(key->location == INTERNED_LOCAL);
+
+	if (interned_cache == NULL) {
+		HASHCTL ctl;
+
+		if (interned_cache_context == NULL)
+			interned_cache_context = AllocSetContextCreate(
+			    TopMemoryContext, "pmetrics interned cache",
+			    ALLOCSET_DEFAULT_SIZES);
+
+		ctl.keysize = sizeof(InternedKey);
+		ctl.entrysize = sizeof(CachedInterned);
+		ctl.hash = interned_cache_hash;
+		ctl.match = interned_cache_match;
+		ctl.hcxt = interned_cache_context;
+		interned_cache = hash_create("pmetrics interned cache", 256, &ctl,
+		                             HASH_ELEM | HASH_FUNCTION | HASH_COMPARE |
+		                                 HASH_CONTEXT);
+	} else if (hash_get_num_entries(interned_cache) >= MAX_CACHED_INTERNED) {
+		hash_destroy(interned_cache);
+		interned_cache = NULL;
+		MemoryContextReset(interned_cache_context);
+		cache_interned_id(key, id);
+		return;
+	}
 
-__attribute__((visibility("default"))) dsa_area *pmetrics_get_dsa(void)
-{
-	if (local_dsa == NULL)
-		get_metrics_table();
+	cached = (CachedInterned *)hash_search(interned_cache, key, HASH_ENTER,
+	                                       &found);
+	if (!found) {
+		/* The key points to the caller's value, keep our own copy */
+		Size size = interned_value_size(key->kind, key->value.local_ptr);
+		void *copy = MemoryContextAlloc(interned_cache_context, size);
 
-	return local_dsa;
+		memcpy(copy, key->value.local_ptr, size);
+		cached->key.value.local_ptr = copy;
+	}
+	cached->id = id;
 }
 
-__attribute__((visibility("default"))) bool pmetrics_is_enabled(void)
+/* The cache is keyed by local keys, hashed and compared like stored ones */
+static uint32 interned_cache_hash(const void *key, Size keysize)
 {
-	return pmetrics_enabled;
+	return interned_hash_dshash(key, keysize, NULL);
 }
 
-static int bucket_for(double value)
+static int interned_cache_match(const void *key1, const void *key2,
+                                Size keysize)
 {
-	int bucket;
-	int this_bucket_upper_bound;
-
-	if (value < 1.0)
-		bucket = 0;
-	else
-		bucket = (int)fmax(ceil(log(value) / log_gamma), 0);
-
-	this_bucket_upper_bound = (int)pow(gamma_val, bucket);
-
-	if (this_bucket_upper_bound > buckets_upper_bound) {
-		elog(NOTICE, "Histogram data truncated: value %f to %d", value,
-		     buckets_upper_bound);
-		this_bucket_upper_bound = buckets_upper_bound;
-	}
+	return interned_compare_dshash(key1, key2, keysize, NULL);
+}
 
-	return this_bucket_upper_bound;
+/*
+ * Build the search key of a backend-local value.
+ */
+static void init_interned_key(InternedKey *key, InternedKind kind,
+                              const void *value)
+{
+	key->kind = kind;
+	key->location = INTERNED_LOCAL;
+	key->value.local_ptr = value;
+	key->hash = interned_value_hash(kind, value);
 }
 
 /*
- * Helper function to get JSONB from MetricKey, handling both local and DSA
- * locations.
+ * Helper function to get the value of an InternedKey, handling both local and
+ * DSA locations.
  */
-static Jsonb *get_labels_jsonb(const MetricKey *key, dsa_area *dsa)
+static const void *get_interned_value(const InternedKey *key, dsa_area *dsa)
 {
-	switch (key->labels_location) {
-	case LABELS_LOCAL:
-		return key->labels.local_ptr;
-	case LABELS_DSA:
-		if (key->labels.dsa_ptr != InvalidDsaPointer)
-			return (Jsonb *)dsa_get_address(dsa, key->labels.dsa_ptr);
-		return NULL;
-	case LABELS_NONE:
+	switch (key->location) {
+	case INTERNED_LOCAL:
+		return key->value.local_ptr;
+	case INTERNED_DSA:
+		return dsa_get_address(dsa, key->value.dsa_ptr);
 	default:
 		return NULL;
 	}
 }
 
 /*
- * Custom hash function for MetricKey (dshash signature).
- * Handles both local (search) keys and DSA (stored) keys.
+ * Size of an interned value: names include their terminator.
  */
-static uint32 metric_hash_dshash(const void *key, size_t key_size, void *arg)
+static Size interned_value_size(InternedKind kind, const void *value)
 {
-	const MetricKey *k = (const MetricKey *)key;
-	uint32 hash;
-	Jsonb *labels;
+	if (kind == INTERNED_NAME)
+		return strlen((const char *)value) + 1;
 
-	hash = string_hash(k->name, NAMEDATALEN);
-	hash ^= hash_bytes((const unsigned char *)&k->type, sizeof(MetricType));
-	hash ^= hash_uint32((uint32)k->bucket);
+	return VARSIZE(value);
+}
 
-	/* Hash JSONB labels if present */
-	labels = get_labels_jsonb(k, local_dsa);
-	if (labels != NULL)
-		hash ^= hash_bytes((unsigned char *)labels, VARSIZE(labels));
+/*
+ * 64-bit hash of a value, seeded with its kind.
+ */
+static uint64 interned_value_hash(InternedKind kind, const void *value)
+{
+	return hash_bytes_extended((const unsigned char *)value,
+	                           (int)interned_value_size(kind, value),
+	                           (uint64)kind);
+}
+
+/*
+ * Custom hash function for InternedKey (dshash signature).
+ * The hash was computed when the key was built.
+ */
+static uint32 interned_hash_dshash(const void *key, size_t key_size,
+                                   void *arg)
+{
+	const InternedKey *k = (const InternedKey *)key;
 
-	return hash;
+	return (uint32)k->hash;
 }
 
 /*
- * Custom compare function for MetricKey (dshash signature).
+ * Custom compare function for InternedKey (dshash signature).
  * Handles both local (search) keys and DSA (stored) keys.
  * Returns <0, 0, or >0 like strcmp.
  */
-static int metric_compare_dshash(const void *a, const void *b, size_t key_size,
-                                 void *arg)
+static int interned_compare_dshash(const void *a, const void *b,
+                                   size_t key_size, void *arg)
 {
-	const MetricKey *k1 = (const MetricKey *)a;
-	const MetricKey *k2 = (const MetricKey *)b;
-	Jsonb *labels1, *labels2;
-	int cmp;
-
-	/* Compare name */
-	cmp = strcmp(k1->name, k2->name);
-	if (cmp != 0)
-		return cmp;
-
-	/* Compare type */
-	if (k1->type != k2->type)
-		return (k1->type < k2->type) ? -1 : 1;
+	const InternedKey *k1 = (const InternedKey *)a;
+	const InternedKey *k2 = (const InternedKey *)b;
+	const void *value1;
+	const void *value2;
+	Size size1;
+	Size size2;
 
-	/* Compare bucket */
-	if (k1->bucket != k2->bucket)
-		return (k1->bucket < k2->bucket) ? -1 : 1;
+	if (k1->kind != k2->kind)
+		return (k1->kind < k2->kind) ? -1 : 1;
 
-	/* Compare JSONB labels */
-	labels1 = get_labels_jsonb(k1, local_dsa);
-	labels2 = get_labels_jsonb(k2, local_dsa);
+	/* Different hashes can't be equal values, skip reading them */
+	if (k1->hash != k2->hash)
+		return (k1->hash < k2->hash) ? -1 : 1;
 
-	if (labels1 == NULL && labels2 == NULL)
-		return 0;
-	if (labels1 == NULL)
-		return -1;
-	if (labels2 == NULL)
-		return 1;
+	value1 = get_interned_value(k1, local_dsa);
+	value2 = get_interned_value(k2, local_dsa);
+	size1 = interned_value_size(k1->kind, value1);
+	size2 = interned_value_size(k2->kind, value2);
 
 	/*
 	 * Use memcmp instead of compareJsonbContainers to avoid collation lookup.
@@ -1080,45 +8027,74 @@ static int metric_compare_dshash(const void *a, const void *b, size_t key_size,
 	 * - Identical JSON produces identical binary representations
 	 * - We only need equality checking, not locale-aware sorting
 	 */
-	{
-		Size size1 = VARSIZE(labels1);
-		Size size2 = VARSIZE(labels2);
+	if (size1 != size2)
+		return (size1 < size2) ? -1 : 1;
+
+	return memcmp(value1, value2, size1);
+}
+
+/*
+ * Custom copy function for InternedKey (dshash signature).
+ * When inserting a new value, copies the local value to DSA.
+ */
+static void interned_key_copy(void *dst, const void *src, size_t key_size,
+                              void *arg)
+{
+	InternedKey *dest_key = (InternedKey *)dst;
+	const InternedKey *src_key = (const InternedKey *)src;
+	Size size;
+
+	memcpy(dest_key, src_key, sizeof(InternedKey));
 
-		if (size1 != size2)
-			return (size1 < size2) ? -1 : 1;
+	if (src_key->location == INTERNED_LOCAL) {
+		size = interned_value_size(src_key->kind, src_key->value.local_ptr);
 
-		return memcmp(labels1, labels2, size1);
+		dest_key->value.dsa_ptr = dsa_allocate(local_dsa, size);
+		memcpy(dsa_get_address(local_dsa, dest_key->value.dsa_ptr),
+		       src_key->value.local_ptr, size);
+		dest_key->location = INTERNED_DSA;
 	}
 }
 
 /*
- * Custom copy function for MetricKey (dshash signature).
- * When inserting a new entry, allocates JSONB to DSA if source has local JSONB.
+ * Custom hash function for MetricKey (dshash signature).
+ * Name and labels are hashed through their interned ids. Ids are small
+ * sequential integers, so each part is mixed before being combined: a plain
+ * XOR would map swapped name and labels ids to the same hash.
  */
-static void metric_key_copy(void *dst, const void *src, size_t key_size,
-                            void *arg)
+static uint32 metric_hash_dshash(const void *key, size_t key_size, void *arg)
 {
-	MetricKey *dest_key = (MetricKey *)dst;
-	const MetricKey *src_key = (const MetricKey *)src;
-	Jsonb *src_labels;
-	Jsonb *dest_labels;
-	Size jsonb_size;
+	const MetricKey *k = (const MetricKey *)key;
+	uint64 hash;
+
+	hash = murmurhash64(k->name_id);
+	hash = hash_combine64(hash, murmurhash64(k->labels_id));
+	hash = hash_combine64(hash, murmurhash64((uint64)k->type));
 
-	memcpy(dest_key, src_key, sizeof(MetricKey));
+	return (uint32)(hash ^ (hash >> 32));
+}
+
+/*
+ * Custom compare function for MetricKey (dshash signature).
+ * Returns <0, 0, or >0 like strcmp.
+ */
+static int metric_compare_dshash(const void *a, const void *b, size_t key_size,
+                                 void *arg)
+{
+	const MetricKey *k1 = (const MetricKey *)a;
+	const MetricKey *k2 = (const MetricKey *)b;
 
-	if (src_key->labels_location == LABELS_LOCAL &&
-	    src_key->labels.local_ptr != NULL) {
-		src_labels = src_key->labels.local_ptr;
-		jsonb_size = VARSIZE(src_labels);
+	/* Compare labels */
+	if (k1->labels_id != k2->labels_id)
+		return (k1->labels_id < k2->labels_id) ? -1 : 1;
 
-		dest_key->labels.dsa_ptr = dsa_allocate(local_dsa, jsonb_size);
-		if (dest_key->labels.dsa_ptr == InvalidDsaPointer)
-			elog(ERROR, "out of dynamic shared memory for metric labels");
+	/* Compare type */
+	if (k1->type != k2->type)
+		return (k1->type < k2->type) ? -1 : 1;
 
-		dest_labels =
-		    (Jsonb *)dsa_get_address(local_dsa, dest_key->labels.dsa_ptr);
-		memcpy(dest_labels, src_labels, jsonb_size);
+	/* Compare name */
+	if (k1->name_id != k2->name_id)
+		return (k1->name_id < k2->name_id) ? -1 : 1;
 
-		dest_key->labels_location = LABELS_DSA;
-	}
+	return 0;
 }
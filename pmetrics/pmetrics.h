@@ -21,10 +21,28 @@
  *
  * **Gauges**: pmetrics_set_gauge(), pmetrics_add_to_gauge().
  *
- * **Histograms**: pmetrics_record_to_histogram().
+ * **Histograms**: pmetrics_record_to_histogram(), pmetrics_histogram_bucket().
+ *
+ * **Batches**: pmetrics_apply_batch().
+ *
+ * **Handles**: pmetrics_counter_handle(), pmetrics_gauge_handle(),
+ * pmetrics_histogram_handle(), pmetrics_counter_add(), pmetrics_gauge_add(),
+ * pmetrics_gauge_set(), pmetrics_histogram_observe(),
+ * pmetrics_release_handle().
  *
  * **Utilities**: pmetrics_is_initialized(), pmetrics_is_enabled(),
- * pmetrics_get_dsa(), pmetrics_clear_metrics(), pmetrics_delete_metric().
+ * pmetrics_get_dsa(), pmetrics_clear_metrics(), pmetrics_delete_metric(),
+ * pmetrics_delete_metrics(), pmetrics_delete_metrics_matching(),
+ * pmetrics_flush(), pmetrics_max_staleness_ms().
+ *
+ * When `pmetrics.flush_interval_ms` is set, counter increments, gauge
+ * additions and histogram observations are buffered per backend, and the
+ * functions above return the amount pending in the calling backend rather
+ * than the shared value.
+ *
+ * Series of metrics listed in `pmetrics.sharded_metrics` keep one slot per
+ * backend. Updating them returns the value of the calling backend's slot,
+ * while list_metrics() reports the sum of all slots.
  */
 
 #ifndef PMETRICS_H
@@ -102,7 +120,8 @@ extern int64 pmetrics_add_to_gauge(const char *name_str, Jsonb *labels_jsonb,
 /**
  * Record a value to a histogram.
  *
- * Creates both a histogram bucket entry and a histogram_sum entry.
+ * Increments the value's bucket and adds it to the histogram sum, both stored
+ * in a single series.
  * This is the recommended way to record histogram values from C code.
  *
  * @param name_str Metric name
@@ -113,6 +132,55 @@ extern int64 pmetrics_add_to_gauge(const char *name_str, Jsonb *labels_jsonb,
 extern int64 pmetrics_record_to_histogram(const char *name_str,
                                           Jsonb *labels_jsonb, double value);
 
+/**
+ * Get the histogram bucket a value is recorded in.
+ *
+ * Uses the same lookup as pmetrics_record_to_histogram(), without recording
+ * anything. Raises the same notice for values beyond the last bucket.
+ *
+ * @param value The value to look up
+ * @return Upper bound of the bucket, as reported by list_metrics()
+ */
+extern int pmetrics_histogram_bucket(double value);
+
+/**
+ * Kind of update in a batch, see pmetrics_apply_batch().
+ */
+typedef enum PMetricsBatchOpType {
+	PMETRICS_INCREMENT_COUNTER,   /**< Like pmetrics_increment_counter_by() */
+	PMETRICS_SET_GAUGE,           /**< Like pmetrics_set_gauge() */
+	PMETRICS_ADD_TO_GAUGE,        /**< Like pmetrics_add_to_gauge() */
+	PMETRICS_RECORD_TO_HISTOGRAM  /**< Like pmetrics_record_to_histogram() */
+} PMetricsBatchOpType;
+
+/**
+ * One update in a batch, see pmetrics_apply_batch().
+ */
+typedef struct PMetricsBatchOp {
+	PMetricsBatchOpType type;
+	const char *name_str; /**< Metric name */
+	Jsonb *labels_jsonb;  /**< JSONB labels (can be NULL for empty object) */
+	int64 value;          /**< Increment, gauge value or gauge addition */
+	double observation;   /**< Value recorded to a histogram */
+} PMetricsBatchOp;
+
+/**
+ * Apply several counter, gauge and histogram updates at once.
+ *
+ * The result is the same as making the calls one by one in order, but
+ * cheaper: names and labels are resolved once per distinct value (consecutive
+ * updates passing the same labels pointer share the lookup), updates are
+ * sorted by partition so locks are taken in order, and all updates to the
+ * same series are applied under a single lookup. All updates are validated
+ * before any is applied.
+ *
+ * Updates follow `pmetrics.flush_interval_ms` like the individual functions.
+ *
+ * @param ops Updates to apply
+ * @param nops Number of updates
+ */
+extern void pmetrics_apply_batch(const PMetricsBatchOp *ops, int nops);
+
 /**
  * Clear all metrics from the metrics table.
  *
@@ -124,9 +192,8 @@ extern int64 pmetrics_record_to_histogram(const char *name_str,
 extern int64 pmetrics_clear_metrics(void);
 
 /**
- * Delete all metrics with the specified name and labels.
- *
- * Note: This can be an expensive operation as it iterates through all metrics.
+ * Delete all metrics with the specified name and labels. Each type is looked
+ * up directly, the table isn't scanned.
  *
  * @param name_str Metric name
  * @param labels_jsonb JSONB labels (can be NULL for empty object)
@@ -134,10 +201,136 @@ extern int64 pmetrics_clear_metrics(void);
  */
 extern int64 pmetrics_delete_metric(const char *name_str, Jsonb *labels_jsonb);
 
+/**
+ * Delete all metrics with the specified name, whatever their labels. The
+ * series are found through a per-name index, the table isn't scanned.
+ *
+ * @param name_str Metric name
+ * @return Number of metrics deleted
+ */
+extern int64 pmetrics_delete_metrics(const char *name_str);
+
+/**
+ * Delete all metrics whose labels contain a JSONB object (as with `@>`).
+ * With pmetrics.index_labels, the label sets are found through an inverted
+ * index of their scalar labels, the table isn't scanned.
+ *
+ * @param labels_jsonb JSONB object the labels must contain
+ * @return Number of metrics deleted
+ */
+extern int64 pmetrics_delete_metrics_matching(Jsonb *labels_jsonb);
+
 /**
  * Check if metrics collection is currently enabled.
  * Returns the value of pmetrics.enabled configuration parameter.
  */
 extern bool pmetrics_is_enabled(void);
 
+/**
+ * Merge updates buffered in this backend into shared memory.
+ *
+ * Buffering only happens when `pmetrics.flush_interval_ms` is set. Buffered
+ * updates are flushed at transaction end and when they get older than the
+ * interval; background workers that don't run transactions can call this to
+ * publish them sooner.
+ */
+extern void pmetrics_flush(void);
+
+/**
+ * Age in milliseconds of the oldest update buffered in any backend and not
+ * yet merged into shared memory, or 0 if there is none.
+ */
+extern int64 pmetrics_max_staleness_ms(void);
+
+/**
+ * Opaque handle to a pre-resolved series.
+ *
+ * Resolving a handle does the name/labels lookup once and pins the series in
+ * shared memory. Updates through the handle then skip hashing, string copying
+ * and label comparison, and don't take the partition lock.
+ *
+ * Handles belong to the backend that created them and are released
+ * automatically on backend exit. Create them lazily (e.g. on first use), not
+ * in `_PG_init()`, since resolving needs shared memory to be attached.
+ *
+ * Deleting the series with pmetrics_delete_metric() or
+ * pmetrics_clear_metrics() is safe: the next update through the handle
+ * recreates it, starting from zero.
+ */
+typedef struct PMetricsHandle PMetricsHandle;
+
+/**
+ * Resolve a counter handle.
+ *
+ * @param name_str Metric name
+ * @param labels_jsonb JSONB labels (can be NULL for empty object)
+ * @return Handle, valid until pmetrics_release_handle() or backend exit
+ */
+extern PMetricsHandle *pmetrics_counter_handle(const char *name_str,
+                                               Jsonb *labels_jsonb);
+
+/**
+ * Resolve a gauge handle.
+ *
+ * @param name_str Metric name
+ * @param labels_jsonb JSONB labels (can be NULL for empty object)
+ * @return Handle, valid until pmetrics_release_handle() or backend exit
+ */
+extern PMetricsHandle *pmetrics_gauge_handle(const char *name_str,
+                                             Jsonb *labels_jsonb);
+
+/**
+ * Resolve a histogram handle.
+ *
+ * @param name_str Metric name
+ * @param labels_jsonb JSONB labels (can be NULL for empty object)
+ * @return Handle, valid until pmetrics_release_handle() or backend exit
+ */
+extern PMetricsHandle *pmetrics_histogram_handle(const char *name_str,
+                                                 Jsonb *labels_jsonb);
+
+/**
+ * Increment a counter through its handle.
+ *
+ * @param handle Counter handle
+ * @param amount Amount to increment (must be > 0)
+ * @return New counter value after increment
+ */
+extern int64 pmetrics_counter_add(PMetricsHandle *handle, int64 amount);
+
+/**
+ * Add to a gauge through its handle.
+ *
+ * @param handle Gauge handle
+ * @param amount Amount to add (can be negative; cannot be 0)
+ * @return New gauge value after addition
+ */
+extern int64 pmetrics_gauge_add(PMetricsHandle *handle, int64 amount);
+
+/**
+ * Set a gauge through its handle.
+ *
+ * @param handle Gauge handle
+ * @param value Value to set
+ * @return The value that was set
+ */
+extern int64 pmetrics_gauge_set(PMetricsHandle *handle, int64 value);
+
+/**
+ * Record a value to a histogram through its handle.
+ *
+ * @param handle Histogram handle
+ * @param value The value to record
+ * @return Bucket count after recording
+ */
+extern int64 pmetrics_histogram_observe(PMetricsHandle *handle, double value);
+
+/**
+ * Release a handle, unpinning its series. The handle must not be used
+ * afterwards.
+ *
+ * @param handle Handle to release
+ */
+extern void pmetrics_release_handle(PMetricsHandle *handle);
+
 #endif /* PMETRICS_H */
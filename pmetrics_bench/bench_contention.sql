@@ -0,0 +1 @@
+SELECT pmetrics_bench.bench_contention();
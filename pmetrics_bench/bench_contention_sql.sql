@@ -0,0 +1 @@
+SELECT count(pmetrics.increment_counter('bench_contended_counter', '{}'::jsonb)) FROM generate_series(1, 10000);
@@ -0,0 +1,71 @@
+#!/bin/bash
+set -e
+
+# Compare the single hot counter workload between two builds of pmetrics.
+#
+# Each ref's pmetrics is built from git, installed, and the server restarted
+# with RESTART_CMD before running bench_contention_sql.sql with 1 and 10
+# clients. The workload goes through SQL rather than bench_contention(), so
+# the same script runs against builds older than pmetrics_bench's functions.
+#
+# The server must preload only pmetrics: other extensions built against the
+# current pmetrics.h may not load with an older build.
+if [ -z "$1" ] || [ -z "$RESTART_CMD" ]; then
+    echo "Usage: RESTART_CMD=<command> $0 <before_ref> [after_ref]"
+    echo "Example: RESTART_CMD='pg_ctl -D \$PGDATA restart -w' $0 f34e439^ f34e439"
+    exit 1
+fi
+
+BEFORE_REF="$1"
+AFTER_REF="${2:-HEAD}"
+PG_CONFIG=${PG_CONFIG:-pg_config}
+DURATION=${DURATION:-30}
+SUDO=${SUDO:-}
+PGHOST=${PGHOST:-localhost}
+PGPORT=${PGPORT:-5432}
+PGUSER=${PGUSER:-$(whoami)}
+PGDATABASE=${PGDATABASE:-postgres}
+export PGHOST PGPORT PGUSER PGDATABASE
+
+ROOT=$(git rev-parse --show-toplevel)
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+declare -A TPS
+
+run_ref() {
+    local ref="$1"
+    local build
+
+    build=$(mktemp -d)
+    git -C "$ROOT" archive "$ref" pmetrics | tar -x -C "$build"
+    make -C "$build/pmetrics" PG_CONFIG="$PG_CONFIG" USE_PGXS=1 >/dev/null
+    $SUDO make -C "$build/pmetrics" PG_CONFIG="$PG_CONFIG" USE_PGXS=1 install >/dev/null
+    rm -rf "$build"
+
+    eval "$RESTART_CMD"
+    for i in {1..30}; do
+        psql -XAtq -c "SELECT 1" >/dev/null 2>&1 && break
+        sleep 1
+    done
+
+    psql -XAtq -c "DROP EXTENSION IF EXISTS pmetrics CASCADE;"
+    psql -XAtq -c "CREATE EXTENSION pmetrics;"
+
+    for clients in 1 10; do
+        psql -XAtq -c "SELECT pmetrics.clear_metrics();" >/dev/null
+        TPS[$ref,$clients]=$(pgbench -n -c "$clients" -j "$clients" \
+            -T "$DURATION" -f "$BENCH_DIR/bench_contention_sql.sql" |
+            awk '/^tps = / { print $3 }')
+        echo "$ref, $clients client(s): ${TPS[$ref,$clients]} tps" >&2
+    done
+}
+
+run_ref "$BEFORE_REF"
+run_ref "$AFTER_REF"
+
+echo "Each transaction is 10k increments of one counter, ${DURATION}s per run."
+echo ""
+echo "| Clients | Before (tps) | After (tps) |"
+echo "|---------|--------------|-------------|"
+for clients in 1 10; do
+    echo "| $clients | ${TPS[$BEFORE_REF,$clients]} | ${TPS[$AFTER_REF,$clients]} |"
+done
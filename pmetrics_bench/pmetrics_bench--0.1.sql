@@ -23,3 +23,40 @@ CREATE FUNCTION bench_new_metrics ()
     RETURNS BIGINT
     AS '$libdir/pmetrics_bench'
     LANGUAGE C STRICT;
+
+/**
+ * Benchmark function that reuses a small set of metrics through handles.
+ * Same workload as bench_metrics(), with names resolved once per call.
+ *
+ * Returns the number of operations completed.
+ * Compare with bench_metrics() to measure the cost of per-call lookups.
+ */
+CREATE FUNCTION bench_handles ()
+    RETURNS BIGINT
+    AS '$libdir/pmetrics_bench'
+    LANGUAGE C STRICT;
+
+/**
+ * Benchmark function that updates a single hot counter.
+ * Increments one counter 1M times, so concurrent clients contend on the
+ * same series and dshash partition.
+ *
+ * Returns the number of operations completed.
+ */
+CREATE FUNCTION bench_contention ()
+    RETURNS BIGINT
+    AS '$libdir/pmetrics_bench'
+    LANGUAGE C STRICT;
+
+/**
+ * Checks and times the histogram bucket lookup.
+ * Compares pmetrics_histogram_bucket() with the original log()/pow()
+ * formula on values around every bucket boundary and 1M spread values,
+ * erroring on any mismatch, and reports the time per value of both.
+ *
+ * Returns the number of values checked.
+ */
+CREATE FUNCTION bench_histogram_buckets ()
+    RETURNS BIGINT
+    AS '$libdir/pmetrics_bench'
+    LANGUAGE C STRICT;
@@ -5,8 +5,15 @@
  */
 
 #include "postgres.h"
+#include "common/pg_prng.h"
 #include "fmgr.h"
 #include "miscadmin.h"
+#include "portability/instr_time.h"
+#include "utils/fmgrprotos.h"
+#include "utils/guc.h"
+#include "utils/jsonb.h"
+
+#include <math.h>
 
 #include "extension/pmetrics/pmetrics.h"
 
@@ -14,6 +21,9 @@ PG_MODULE_MAGIC;
 
 PG_FUNCTION_INFO_V1(bench_metrics);
 PG_FUNCTION_INFO_V1(bench_new_metrics);
+PG_FUNCTION_INFO_V1(bench_handles);
+PG_FUNCTION_INFO_V1(bench_contention);
+PG_FUNCTION_INFO_V1(bench_histogram_buckets);
 
 /*
  * bench_metrics() -> BIGINT
@@ -75,6 +85,185 @@ bench_new_metrics(PG_FUNCTION_ARGS)
 	PG_RETURN_INT64(total_ops);
 }
 
+/*
+ * bench_handles() -> BIGINT
+ *
+ * Same workload as bench_metrics(), but through pre-resolved handles.
+ * Handles are resolved once per call and released at the end.
+ * Returns the number of operations completed.
+ */
+Datum
+bench_handles(PG_FUNCTION_ARGS)
+{
+	int64 i;
+	char metric_name[64];
+	const int num_counters = 10;
+	const int iterations_per_counter = 100000;
+	const int64 total_ops = num_counters * iterations_per_counter;
+	PMetricsHandle *handles[10];
+
+	if (!pmetrics_is_initialized())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pmetrics is not initialized")));
+
+	for (i = 0; i < num_counters; i++) {
+		snprintf(metric_name, sizeof(metric_name), "bench_counter_%d", (int) i);
+		handles[i] = pmetrics_counter_handle(metric_name, NULL);
+	}
+
+	for (i = 0; i < total_ops; i++)
+		pmetrics_counter_add(handles[i % num_counters], 1);
+
+	for (i = 0; i < num_counters; i++)
+		pmetrics_release_handle(handles[i]);
+
+	PG_RETURN_INT64(total_ops);
+}
+
+/*
+ * bench_contention() -> BIGINT
+ *
+ * Increments a single counter, labeled '{}', 1M times. With concurrent
+ * clients, every update lands on the same dshash partition, so this measures
+ * how well updates to one hot series scale. The labels are those of
+ * bench_contention_sql.sql, so both take the same key path.
+ * Returns the number of operations completed.
+ */
+Datum
+bench_contention(PG_FUNCTION_ARGS)
+{
+	int64 i;
+	const int64 total_ops = 1000000;
+	Jsonb *labels;
+
+	if (!pmetrics_is_initialized())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pmetrics is not initialized")));
+
+	labels = DatumGetJsonbP(DirectFunctionCall1(jsonb_in,
+												CStringGetDatum("{}")));
+
+	for (i = 0; i < total_ops; i++)
+		pmetrics_increment_counter("bench_contended_counter", labels);
+
+	PG_RETURN_INT64(total_ops);
+}
+
+/*
+ * Bucket of a value computed the original way, with log(), ceil() and pow()
+ * on every call, clamped to the last bucket.
+ */
+static int
+reference_bucket(double value, double gamma, double log_gamma, int upper_bound)
+{
+	int bucket;
+
+	if (value < 1.0)
+		bucket = 0;
+	else
+		bucket = (int) fmax(ceil(log(value) / log_gamma), 0);
+
+	return Min((int) pow(gamma, bucket), upper_bound);
+}
+
+/*
+ * bench_histogram_buckets() -> BIGINT
+ *
+ * Checks that pmetrics_histogram_bucket() maps every value exactly like the
+ * original formula, then times both over the same values and reports the
+ * cost per value in a NOTICE.
+ * Values within a few ulps of every bucket boundary are checked, plus 1M
+ * values spread log-uniformly up to pmetrics.buckets_upper_bound. Errors out
+ * on the first mismatch.
+ * Returns the number of values checked.
+ */
+Datum
+bench_histogram_buckets(PG_FUNCTION_ARGS)
+{
+	const int num_random = 1000000;
+	const int ulps = 8;
+	double variability;
+	double gamma;
+	double log_gamma;
+	int upper_bound;
+	int max_exp;
+	double *values;
+	int num_values = 0;
+	int i;
+	int j;
+	volatile int64 sink = 0;
+	instr_time start;
+	instr_time reference_time;
+	instr_time table_time;
+
+	if (!pmetrics_is_initialized())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pmetrics is not initialized")));
+
+	variability = strtod(GetConfigOption("pmetrics.bucket_variability",
+										 false, false), NULL);
+	upper_bound = atoi(GetConfigOption("pmetrics.buckets_upper_bound",
+									   false, false));
+	gamma = (1 + variability) / (1 - variability);
+	log_gamma = log(gamma);
+	max_exp = (int) ceil(log(upper_bound) / log_gamma);
+
+	values = (double *) palloc((num_random + (max_exp + 1) * (2 * ulps + 1)) *
+							   sizeof(double));
+
+	/* Around every boundary, where log() rounding decides the bucket */
+	for (i = 0; i <= max_exp; i++) {
+		double value = pow(gamma, i);
+
+		for (j = 0; j < ulps; j++)
+			value = nextafter(value, 0);
+		for (j = 0; j < 2 * ulps + 1; j++) {
+			if (value <= upper_bound)
+				values[num_values++] = value;
+			value = nextafter(value, INFINITY);
+		}
+	}
+
+	for (i = 0; i < num_random; i++)
+		values[num_values++] =
+			exp(pg_prng_double(&pg_global_prng_state) * log(upper_bound)) - 0.5;
+
+	for (i = 0; i < num_values; i++) {
+		int expected = reference_bucket(values[i], gamma, log_gamma,
+										upper_bound);
+		int actual = pmetrics_histogram_bucket(values[i]);
+
+		if (expected != actual)
+			ereport(ERROR,
+					(errmsg("bucket mismatch for %.17g: expected %d, got %d",
+							values[i], expected, actual)));
+	}
+
+	INSTR_TIME_SET_CURRENT(start);
+	for (i = 0; i < num_values; i++)
+		sink += reference_bucket(values[i], gamma, log_gamma, upper_bound);
+	INSTR_TIME_SET_CURRENT(reference_time);
+	INSTR_TIME_SUBTRACT(reference_time, start);
+
+	INSTR_TIME_SET_CURRENT(start);
+	for (i = 0; i < num_values; i++)
+		sink += pmetrics_histogram_bucket(values[i]);
+	INSTR_TIME_SET_CURRENT(table_time);
+	INSTR_TIME_SUBTRACT(table_time, start);
+
+	ereport(NOTICE,
+			(errmsg("reference: %.1f ns/value, table: %.1f ns/value",
+					(double) INSTR_TIME_GET_NANOSEC(reference_time) / num_values,
+					(double) INSTR_TIME_GET_NANOSEC(table_time) / num_values)));
+
+	pfree(values);
+
+	PG_RETURN_INT64(num_values);
+}
+
 void
 _PG_init(void)
 {
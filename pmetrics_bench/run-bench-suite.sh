@@ -2,9 +2,9 @@
 set -e
 
 # First argument is the output filename (required)
-# Second argument is the workload type: "reuse" or "create" (optional, defaults to "reuse")
+# Second argument is the workload type: "reuse", "create", "handles" or "contention" (optional, defaults to "reuse")
 if [ -z "$1" ]; then
-    echo "Usage: $0 <output_file> [reuse|create]"
+    echo "Usage: $0 <output_file> [reuse|create|handles|contention]"
     echo "Example: $0 results_reuse.txt reuse"
     echo "Example: $0 results_create.txt create"
     exit 1
@@ -22,8 +22,14 @@ if [ "$WORKLOAD_TYPE" = "create" ]; then
 elif [ "$WORKLOAD_TYPE" = "reuse" ]; then
     BENCH_SQL="bench.sql"
     CASE_DESCRIPTION="reusing existing metrics (bench_metrics)"
+elif [ "$WORKLOAD_TYPE" = "handles" ]; then
+    BENCH_SQL="bench_handles.sql"
+    CASE_DESCRIPTION="reusing existing metrics through handles (bench_handles)"
+elif [ "$WORKLOAD_TYPE" = "contention" ]; then
+    BENCH_SQL="bench_contention.sql"
+    CASE_DESCRIPTION="updating a single hot counter (bench_contention)"
 else
-    echo "Error: Workload type must be 'reuse' or 'create'"
+    echo "Error: Workload type must be 'reuse', 'create', 'handles' or 'contention'"
     exit 1
 fi
 
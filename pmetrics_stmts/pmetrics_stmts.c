@@ -130,6 +130,9 @@ static PlannedStmt *pmetrics_stmts_planner_hook(Query *parse,
 static void pmetrics_stmts_ExecutorStart_hook(QueryDesc *queryDesc, int eflags);
 static void pmetrics_stmts_ExecutorEnd_hook(QueryDesc *queryDesc);
 static Jsonb *build_query_labels(uint64 queryid, Oid userid, Oid dbid);
+static void add_histogram_op(PMetricsBatchOp *ops, int *nops,
+                             const char *name, Jsonb *labels_jsonb,
+                             double value);
 
 /* Background worker functions */
 void pmetrics_stmts_cleanup_worker_main(Datum main_arg);
@@ -629,6 +632,22 @@ static void pmetrics_stmts_ExecutorStart_hook(QueryDesc *queryDesc, int eflags)
 	}
 }
 
+/*
+ * Append a histogram observation to a batch of updates.
+ */
+static void add_histogram_op(PMetricsBatchOp *ops, int *nops,
+                             const char *name, Jsonb *labels_jsonb,
+                             double value)
+{
+	PMetricsBatchOp *op = &ops[(*nops)++];
+
+	op->type = PMETRICS_RECORD_TO_HISTOGRAM;
+	op->name_str = name;
+	op->labels_jsonb = labels_jsonb;
+	op->value = 0;
+	op->observation = value;
+}
+
 /*
  * ExecutorEnd hook: collect execution metrics (time, row count, and optionally
  * buffer usage).
@@ -637,9 +656,8 @@ static void pmetrics_stmts_ExecutorEnd_hook(QueryDesc *queryDesc)
 {
 	uint64 queryid = queryDesc->plannedstmt->queryId;
 	Jsonb *labels_jsonb;
-	char metric_name[NAMEDATALEN];
-	double total_time_ms;
-	uint64 rows_processed;
+	PMetricsBatchOp ops[4];
+	int nops = 0;
 
 	if (queryid != UINT64CONST(0) && queryDesc->totaltime &&
 	    pmetrics_is_enabled() &&
@@ -652,33 +670,28 @@ static void pmetrics_stmts_ExecutorEnd_hook(QueryDesc *queryDesc)
 		labels_jsonb = build_query_labels(queryid, GetUserId(), MyDatabaseId);
 
 		/* Track execution time if enabled */
-		if (pmetrics_stmts_track_times) {
-			total_time_ms = queryDesc->totaltime->total * 1000.0;
-			snprintf(metric_name, NAMEDATALEN, "query_execution_time_ms");
-			pmetrics_record_to_histogram(metric_name, labels_jsonb,
-			                             total_time_ms);
-		}
+		if (pmetrics_stmts_track_times)
+			add_histogram_op(ops, &nops, "query_execution_time_ms",
+			                 labels_jsonb,
+			                 queryDesc->totaltime->total * 1000.0);
 
 		/* Track row count if enabled */
-		if (pmetrics_stmts_track_rows) {
-			rows_processed = queryDesc->estate->es_processed;
-			snprintf(metric_name, NAMEDATALEN, "query_rows_returned");
-			pmetrics_record_to_histogram(metric_name, labels_jsonb,
-			                             (double)rows_processed);
-		}
+		if (pmetrics_stmts_track_rows)
+			add_histogram_op(ops, &nops, "query_rows_returned", labels_jsonb,
+			                 (double)queryDesc->estate->es_processed);
 
 		/* Track buffer usage if enabled */
 		if (pmetrics_stmts_track_buffers) {
 			BufferUsage *bufusage = &queryDesc->totaltime->bufusage;
 
-			snprintf(metric_name, NAMEDATALEN, "query_shared_blocks_hit");
-			pmetrics_record_to_histogram(metric_name, labels_jsonb,
-			                             (double)bufusage->shared_blks_hit);
-
-			snprintf(metric_name, NAMEDATALEN, "query_shared_blocks_read");
-			pmetrics_record_to_histogram(metric_name, labels_jsonb,
-			                             (double)bufusage->shared_blks_read);
+			add_histogram_op(ops, &nops, "query_shared_blocks_hit",
+			                 labels_jsonb, (double)bufusage->shared_blks_hit);
+			add_histogram_op(ops, &nops, "query_shared_blocks_read",
+			                 labels_jsonb, (double)bufusage->shared_blks_read);
 		}
+
+		/* All updates share the labels, so they are resolved once */
+		pmetrics_apply_batch(ops, nops);
 	}
 
 	if (prev_ExecutorEnd_hook)
@@ -797,8 +810,9 @@ int64 pmetrics_stmts_cleanup_old_metrics(int64 max_age_seconds)
 	/* Find queries with last execution timestamp older than max_age_seconds */
 	snprintf(query_sql, sizeof(query_sql),
 	         "SELECT labels "
-	         "FROM pmetrics.list_metrics() "
-	         "WHERE name = 'query_last_exec_timestamp' AND value < %lld",
+	         "FROM pmetrics.list_metrics('query_last_exec_timestamp', NULL, "
+	         "ARRAY['gauge']) "
+	         "WHERE value < %lld",
 	         (long long)cutoff_seconds);
 
 	if (SPI_connect() != SPI_OK_CONNECT)
@@ -1,6 +1,7 @@
 defmodule PmetricsTest do
   use ExUnit.Case, async: false
   import PmetricsTest.TestHelpers
+  alias PmetricsTest.Repo
 
   setup_all do
     setup_extensions()
@@ -36,6 +37,27 @@ defmodule PmetricsTest do
       assert 2 = get_metric_value("http_requests", "counter", %{"status" => 200})
       assert 1 = get_metric_value("http_requests", "counter", %{"status" => 404})
     end
+
+    test "increment_counters applies every element" do
+      result =
+        query(
+          "SELECT pmetrics.increment_counters(ARRAY['jobs', 'jobs', 'errors'], ARRAY['{\"q\": 1}', '{\"q\": 1}', '{}']::jsonb[], ARRAY[2, 3, 1])"
+        )
+
+      assert [[3]] = result.rows
+      assert 5 = get_metric_value("jobs", "counter", %{"q" => 1})
+      assert 1 = get_metric_value("errors", "counter")
+    end
+
+    test "increment_counters rejects arrays of different lengths" do
+      assert_raise Postgrex.Error, fn ->
+        query(
+          "SELECT pmetrics.increment_counters(ARRAY['jobs', 'errors'], ARRAY['{}']::jsonb[], ARRAY[1, 1])"
+        )
+      end
+
+      assert is_nil(get_metric_value("jobs", "counter"))
+    end
   end
 
   describe "gauges" do
@@ -86,6 +108,26 @@ defmodule PmetricsTest do
       [%{bucket: 101, value: 3}] = list_metrics("request_time", "histogram")
     end
 
+    test "histogram_quantile estimates quantiles from the buckets" do
+      query(
+        "SELECT pmetrics.record_to_histogram_many('quantile_latency', '{\"db\": \"a\"}'::jsonb, array_agg(i::float8)) FROM generate_series(1, 100) AS i"
+      )
+
+      result =
+        query("SELECT pmetrics.histogram_quantile('quantile_latency', '{\"db\": \"a\"}'::jsonb, ARRAY[0.5, 0.99])")
+
+      assert [[[p50, p99]]] = result.rows
+      # Within one bucket of the exact values, 50 and 99
+      assert p50 > 40 and p50 < 62
+      assert p99 > 81 and p99 < 122
+
+      result = query("SELECT labels, count, quantiles FROM pmetrics.histogram_quantile('quantile_latency', ARRAY[0.5])")
+      assert [[%{"db" => "a"}, 100, [^p50]]] = result.rows
+
+      result = query("SELECT pmetrics.histogram_quantile('quantile_latency', '{}'::jsonb, ARRAY[0.5])")
+      assert [[nil]] = result.rows
+    end
+
     test "histograms with labels are independent" do
       query(
         "SELECT pmetrics.record_to_histogram('api_latency', '{\"endpoint\": \"/users\"}'::jsonb, 50.0)"
@@ -98,6 +140,26 @@ defmodule PmetricsTest do
       assert 50 = get_histogram_sum("api_latency", %{"endpoint" => "/users"})
       assert 150 = get_histogram_sum("api_latency", %{"endpoint" => "/posts"})
     end
+
+    test "small values sharing a bucket bound are reported once" do
+      query("SELECT pmetrics.record_to_histogram('small_values', '{}'::jsonb, 0.5)")
+      query("SELECT pmetrics.record_to_histogram('small_values', '{}'::jsonb, 1.0)")
+      result = query("SELECT pmetrics.record_to_histogram('small_values', '{}'::jsonb, 1.5)")
+
+      assert [[3]] = result.rows
+      [%{bucket: 1, value: 3}] = list_metrics("small_values", "histogram")
+    end
+
+    test "record_to_histogram_many records every value" do
+      result =
+        query(
+          "SELECT pmetrics.record_to_histogram_many('batch_latency', '{}'::jsonb, ARRAY[100.0, 100.0, 50.0])"
+        )
+
+      assert [[3]] = result.rows
+      assert 250 = get_histogram_sum("batch_latency")
+      assert [%{value: 1}, %{bucket: 101, value: 2}] = list_metrics("batch_latency", "histogram")
+    end
   end
 
   describe "type safety" do
@@ -151,6 +213,124 @@ defmodule PmetricsTest do
 
       assert 2 = count_metrics("filter_test", "counter")
     end
+
+    test "snapshots carry a generation shared by their rows" do
+      query("SELECT pmetrics.increment_counter('snap_a', '{}'::jsonb)")
+      query("SELECT pmetrics.record_to_histogram('snap_h', '{}'::jsonb, 3.0)")
+
+      result =
+        query(
+          "SELECT count(DISTINCT generation), min(generation) FROM pmetrics.list_metrics_snapshot() WHERE name LIKE 'snap_%'"
+        )
+
+      assert [[1, first]] = result.rows
+
+      result =
+        query("SELECT min(generation) FROM pmetrics.list_metrics_snapshot() WHERE name = 'snap_a'")
+
+      assert [[second]] = result.rows
+      assert second > first
+    end
+
+    test "lists the series changed and removed since a generation" do
+      query("SELECT pmetrics.increment_counter('since_changed', '{}'::jsonb)")
+      query("SELECT pmetrics.set_gauge('since_unchanged', '{}'::jsonb, 1)")
+      query("SELECT pmetrics.increment_counter('since_removed', '{\"a\": 1}'::jsonb)")
+
+      # Changes are tracked from the first call, which lists every series
+      query("SELECT count(*) FROM pmetrics.list_metrics_since(0)")
+      result = query("SELECT DISTINCT generation FROM pmetrics.list_metrics_since(0)")
+      assert [[generation]] = result.rows
+
+      query("SELECT pmetrics.increment_counter('since_changed', '{}'::jsonb)")
+      query("SELECT pmetrics.delete_metric('since_removed', '{\"a\": 1}'::jsonb)")
+
+      result =
+        query(
+          "SELECT name, labels, type, value, removed FROM pmetrics.list_metrics_since($1) WHERE name LIKE 'since_%' ORDER BY name",
+          [generation]
+        )
+
+      assert [
+               ["since_changed", %{}, "counter", 2, false],
+               ["since_removed", %{"a" => 1}, "counter", nil, true]
+             ] = result.rows
+    end
+
+    test "rejects a generation from before a bulk removal" do
+      query("SELECT pmetrics.increment_counter('since_cleared', '{}'::jsonb)")
+
+      result = query("SELECT DISTINCT generation FROM pmetrics.list_metrics_since(0)")
+      assert [[generation]] = result.rows
+
+      query("SELECT pmetrics.delete_metric('since_cleared')")
+
+      assert_raise Postgrex.Error, ~r/are no longer known/, fn ->
+        query("SELECT count(*) FROM pmetrics.list_metrics_since($1)", [generation])
+      end
+    end
+
+    test "rejects a generation not taken yet" do
+      query("SELECT pmetrics.increment_counter('since_future', '{}'::jsonb)")
+      result = query("SELECT DISTINCT generation FROM pmetrics.list_metrics_since(0)")
+      assert [[generation]] = result.rows
+
+      assert_raise Postgrex.Error, ~r/was not taken yet/, fn ->
+        query("SELECT count(*) FROM pmetrics.list_metrics_since($1)", [generation + 1_000_000])
+      end
+    end
+
+    test "lists series whose labels contain an object" do
+      query("SELECT pmetrics.increment_counter('match_a', '{\"env\": \"prod\", \"az\": 1, \"tags\": [\"x\", \"y\"]}'::jsonb)")
+      query("SELECT pmetrics.increment_counter('match_b', '{\"env\": \"prod\", \"az\": 2}'::jsonb)")
+      query("SELECT pmetrics.set_gauge('match_c', '{\"env\": \"dev\", \"az\": 1}'::jsonb, 3)")
+      query("SELECT pmetrics.increment_counter('match_d', '{}'::jsonb)")
+
+      result =
+        query(
+          "SELECT name FROM pmetrics.list_metrics_matching('{\"env\": \"prod\"}'::jsonb) ORDER BY name"
+        )
+
+      assert [["match_a"], ["match_b"]] = result.rows
+
+      result =
+        query("SELECT name FROM pmetrics.list_metrics_matching('{\"env\": \"prod\", \"az\": 1}'::jsonb)")
+
+      assert [["match_a"]] = result.rows
+
+      result =
+        query("SELECT name FROM pmetrics.list_metrics_matching('{\"az\": 1, \"tags\": [\"y\"]}'::jsonb)")
+
+      assert [["match_a"]] = result.rows
+
+      result = query("SELECT count(*) FROM pmetrics.list_metrics_matching('{\"env\": \"qa\"}'::jsonb)")
+      assert [[0]] = result.rows
+    end
+
+    test "filters by name pattern, labels and type in the scan" do
+      query("SELECT pmetrics.increment_counter('scan_a', '{\"env\": \"prod\", \"az\": 1}'::jsonb)")
+      query("SELECT pmetrics.increment_counter('scan_b', '{\"env\": \"dev\"}'::jsonb)")
+      query("SELECT pmetrics.increment_counter('scan_c', '{}'::jsonb)")
+      query("SELECT pmetrics.record_to_histogram('scan_h', '{\"env\": \"prod\"}'::jsonb, 10.0)")
+      query("SELECT pmetrics.set_gauge('other_scan', '{\"env\": \"prod\"}'::jsonb, 5)")
+
+      result =
+        query(
+          "SELECT name FROM pmetrics.list_metrics('scan_%', '{\"env\": \"prod\"}'::jsonb, NULL) ORDER BY name, type"
+        )
+
+      assert [["scan_a"], ["scan_h"], ["scan_h"]] = result.rows
+
+      result =
+        query(
+          "SELECT name, type FROM pmetrics.list_metrics('scan_h', NULL, ARRAY['histogram_sum'])"
+        )
+
+      assert [["scan_h", "histogram_sum"]] = result.rows
+
+      result = query("SELECT count(*) FROM pmetrics.list_metrics('no_such_metric', NULL, NULL)")
+      assert [[0]] = result.rows
+    end
   end
 
   describe "configuration" do
@@ -161,6 +341,65 @@ defmodule PmetricsTest do
     end
   end
 
+  describe "export_binary" do
+    test "exports dictionaries, then value and bucket arrays" do
+      query("SELECT pmetrics.increment_counter_by('export_counter', '{\"job\": \"a\"}'::jsonb, 3)")
+      query("SELECT pmetrics.record_to_histogram('export_histogram', '{}'::jsonb, 1.0)")
+      query("SELECT pmetrics.record_to_histogram('export_histogram', '{}'::jsonb, 100.0)")
+
+      [[data]] = query("SELECT string_agg(chunk, ''::bytea) FROM pmetrics.export_binary() AS chunk").rows
+      series = decode_export(data)
+
+      assert %{labels: %{"job" => "a"}, type: 0, value: 3} = series["export_counter"]
+      assert %{labels: %{}, type: 2, value: 101, buckets: buckets} = series["export_histogram"]
+      assert Enum.sum(buckets) == 2
+    end
+  end
+
+  describe "prometheus_text" do
+    test "renders counters, gauges and cumulative histograms" do
+      query("SELECT pmetrics.increment_counter_by('prom_requests', '{\"path\": \"/a\\\"b\"}'::jsonb, 3)")
+      query("SELECT pmetrics.set_gauge('prom_connections', '{}'::jsonb, 7)")
+      query("SELECT pmetrics.record_to_histogram('prom_latency', '{\"db\": 1}'::jsonb, 1.0)")
+      query("SELECT pmetrics.record_to_histogram('prom_latency', '{\"db\": 1}'::jsonb, 100.0)")
+
+      [[text]] = query("SELECT pmetrics.prometheus_text()").rows
+      lines = String.split(text, "\n")
+
+      assert "# TYPE prom_requests counter" in lines
+      assert ~S(prom_requests{path="/a\"b"} 3) in lines
+      assert "# TYPE prom_connections gauge" in lines
+      assert "prom_connections 7" in lines
+      assert "# TYPE prom_latency histogram" in lines
+      assert ~S(prom_latency_bucket{db="1",le="1"} 1) in lines
+      assert ~S(prom_latency_bucket{db="1",le="101"} 2) in lines
+      assert ~S(prom_latency_bucket{db="1",le="+Inf"} 2) in lines
+      assert ~S(prom_latency_count{db="1"} 2) in lines
+      assert ~S(prom_latency_sum{db="1"} 101) in lines
+    end
+
+    test "writes labels that are the same once sanitized only once" do
+      query("SELECT pmetrics.increment_counter('prom_dupes', '{\"a-b\": 1, \"a_b\": 2}'::jsonb)")
+
+      [[text]] = query("SELECT pmetrics.prometheus_text()").rows
+      lines = String.split(text, "\n")
+
+      assert ~S(prom_dupes{a_b="1"} 1) in lines
+    end
+
+    test "renames a le label of histograms" do
+      query("SELECT pmetrics.record_to_histogram('prom_le', '{\"le\": \"x\"}'::jsonb, 1.0)")
+      query("SELECT pmetrics.increment_counter('prom_le_counter', '{\"le\": \"x\"}'::jsonb)")
+
+      [[text]] = query("SELECT pmetrics.prometheus_text()").rows
+      lines = String.split(text, "\n")
+
+      assert ~S(prom_le_bucket{exported_le="x",le="1"} 1) in lines
+      assert ~S(prom_le_count{exported_le="x"} 1) in lines
+      assert ~S(prom_le_counter{le="x"} 1) in lines
+    end
+  end
+
   describe "list_histogram_buckets" do
     test "returns available bucket values" do
       result =
@@ -173,6 +412,271 @@ defmodule PmetricsTest do
     end
   end
 
+  describe "max_staleness_ms" do
+    test "is zero when updates are not buffered" do
+      query("SELECT pmetrics.increment_counter('staleness_test', '{}'::jsonb)")
+
+      assert [[0]] = query("SELECT pmetrics.max_staleness_ms()").rows
+    end
+  end
+
+  # Requires pmetrics.flush_interval_ms = 60000, run with mix test --only buffering
+  describe "buffered updates" do
+    @describetag :buffering
+
+    test "counter, gauge and histogram updates are merged at transaction end" do
+      # Series are created in shared memory, only known ones are buffered
+      query("SELECT pmetrics.increment_counter('buffered_counter', '{}'::jsonb)")
+      query("SELECT pmetrics.add_to_gauge('buffered_gauge', '{}'::jsonb, 5)")
+      query("SELECT pmetrics.record_to_histogram('buffered_histogram', '{}'::jsonb, 1.0)")
+
+      Repo.checkout(fn ->
+        Repo.transaction(fn ->
+          # Buffered updates don't know the shared value
+          assert [[nil]] =
+                   query("SELECT pmetrics.increment_counter_by('buffered_counter', '{}'::jsonb, 2)").rows
+
+          assert [[nil]] = query("SELECT pmetrics.add_to_gauge('buffered_gauge', '{}'::jsonb, 3)").rows
+
+          assert [[nil]] =
+                   query("SELECT pmetrics.record_to_histogram('buffered_histogram', '{}'::jsonb, 100.0)").rows
+
+          # Other backends only see shared memory until then
+          shared =
+            Task.async(fn ->
+              {get_metric_value("buffered_counter", "counter"),
+               get_metric_value("buffered_gauge", "gauge"),
+               get_histogram_sum("buffered_histogram")}
+            end)
+            |> Task.await()
+
+          assert {1, 5, 1} = shared
+        end)
+      end)
+
+      assert 3 = get_metric_value("buffered_counter", "counter")
+      assert 8 = get_metric_value("buffered_gauge", "gauge")
+      assert 101 = get_histogram_sum("buffered_histogram")
+
+      assert [%{bucket: 1, value: 1}, %{bucket: 101, value: 1}] =
+               list_metrics("buffered_histogram", "histogram")
+    end
+
+    test "max_staleness_ms is positive while updates are pending" do
+      query("SELECT pmetrics.increment_counter('buffered_staleness', '{}'::jsonb)")
+
+      Repo.checkout(fn ->
+        Repo.transaction(fn ->
+          query("SELECT pmetrics.increment_counter('buffered_staleness', '{}'::jsonb)")
+          Process.sleep(20)
+
+          assert [[staleness]] = query("SELECT pmetrics.max_staleness_ms()").rows
+          assert staleness > 0
+        end)
+      end)
+
+      assert 2 = get_metric_value("buffered_staleness", "counter")
+    end
+
+    test "set_gauge overrides the additions still pending" do
+      query("SELECT pmetrics.set_gauge('buffered_set', '{}'::jsonb, 10)")
+
+      Repo.checkout(fn ->
+        Repo.transaction(fn ->
+          query("SELECT pmetrics.add_to_gauge('buffered_set', '{}'::jsonb, 5)")
+          query("SELECT pmetrics.set_gauge('buffered_set', '{}'::jsonb, 100)")
+          query("SELECT pmetrics.add_to_gauge('buffered_set', '{}'::jsonb, 1)")
+        end)
+      end)
+
+      assert 101 = get_metric_value("buffered_set", "gauge")
+    end
+  end
+
+  describe "hash_table_stats" do
+    test "reports the metrics, interned and label index tables" do
+      for i <- 1..20 do
+        query("SELECT pmetrics.increment_counter('hash_stats', '{\"i\": #{i}}'::jsonb)")
+      end
+
+      result =
+        query(
+          "SELECT table_name, entries, distinct_hashes, used_partitions, min_partition_entries, max_partition_entries FROM pmetrics.hash_table_stats() ORDER BY table_name"
+        )
+
+      assert [
+               ["interned", interned, _, _, _, _],
+               ["label_pairs", pairs, _, _, _, _],
+               ["metrics", entries, distinct, used, min, max]
+             ] = result.rows
+
+      # 20 label sets and the name, each label set with its own pair
+      assert interned >= 21
+      assert pairs >= 20
+      assert entries >= 20
+      assert distinct <= entries
+      assert used >= 1 and used <= entries
+      assert min >= 1 and min <= max
+      assert max * used >= entries
+    end
+  end
+
+  describe "memory_stats" do
+    test "reports memory use and the series of each name" do
+      query("SELECT pmetrics.increment_counter('memory_stats', '{\"a\": 1}'::jsonb)")
+      query("SELECT pmetrics.increment_counter('memory_stats', '{\"a\": 2}'::jsonb)")
+      query("SELECT pmetrics.set_gauge('memory_stats', '{}'::jsonb, 5)")
+
+      result =
+        query(
+          "SELECT entries, bytes, last_update IS NOT NULL FROM pmetrics.memory_stats() WHERE kind = 'name' AND name = 'memory_stats'"
+        )
+
+      assert [[3, label_bytes, true]] = result.rows
+      assert label_bytes > 0
+
+      result = query("SELECT kind, entries, bytes FROM pmetrics.memory_stats() WHERE kind = 'series'")
+      assert [["series", series, bytes]] = result.rows
+      assert series >= 3
+      assert bytes > 0
+
+      query("SELECT pmetrics.delete_metric('memory_stats')")
+
+      result = query("SELECT count(*) FROM pmetrics.memory_stats() WHERE kind = 'name' AND name = 'memory_stats'")
+      assert [[0]] = result.rows
+    end
+  end
+
+  # Requires pmetrics.sharded_metrics = 'sharded_counter,sharded_histogram'
+  describe "sharded metrics" do
+    test "counter sums updates from all backends" do
+      1..10
+      |> Task.async_stream(fn _ ->
+        query("SELECT pmetrics.increment_counter_by('sharded_counter', '{}'::jsonb, 5)")
+      end)
+      |> Stream.run()
+
+      assert 50 = get_metric_value("sharded_counter", "counter")
+    end
+
+    test "histogram sums buckets and sum from all backends" do
+      1..4
+      |> Task.async_stream(fn _ ->
+        query("SELECT pmetrics.record_to_histogram('sharded_histogram', '{}'::jsonb, 100.0)")
+      end)
+      |> Stream.run()
+
+      assert [%{value: 4}] = list_metrics("sharded_histogram", "histogram")
+      assert 400 = get_histogram_sum("sharded_histogram")
+    end
+
+    test "deleted series start over from zero" do
+      query("SELECT pmetrics.increment_counter_by('sharded_counter', '{}'::jsonb, 3)")
+      query("SELECT pmetrics.delete_metric('sharded_counter', '{}'::jsonb)")
+      query("SELECT pmetrics.increment_counter('sharded_counter', '{}'::jsonb)")
+
+      assert 1 = get_metric_value("sharded_counter", "counter")
+    end
+  end
+
+  # Requires pmetrics.max_series_per_name = 1000
+  describe "series limits" do
+    test "series past the per-name limit go to the overflow series" do
+      query("""
+      SELECT count(pmetrics.increment_counter('limited_counter', jsonb_build_object('id', i)))
+      FROM generate_series(1, 1003) AS i
+      """)
+
+      assert 1001 = count_metrics("limited_counter", "counter")
+      assert 3 = get_metric_value("limited_counter", "counter", %{pmetrics_overflow: true})
+
+      # Series that exist keep being updated
+      query("SELECT pmetrics.increment_counter('limited_counter', '{\"id\": 1}'::jsonb)")
+      assert 2 = get_metric_value("limited_counter", "counter", %{id: 1})
+    end
+  end
+
+  # Requires pmetrics.http_port = 9190
+  describe "http endpoint" do
+    test "serves prometheus_text() at /metrics" do
+      query("SELECT pmetrics.increment_counter('http_counter', '{\"job\": \"a\"}'::jsonb)")
+
+      response = http_request(9190, "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n")
+
+      assert response =~ ~r{^HTTP/1.1 200 OK\r\n}
+      assert response =~ "Content-Type: text/plain; version=0.0.4"
+      assert response =~ ~s(http_counter{job="a"} 1\n)
+    end
+
+    test "answers other paths with 404" do
+      response = http_request(9190, "GET / HTTP/1.1\r\n\r\n")
+
+      assert response =~ ~r{^HTTP/1.1 404 Not Found\r\n}
+    end
+  end
+
+  # Requires pmetrics.checkpoint_interval = 1
+  describe "checkpointer" do
+    test "writes checkpoints in the background" do
+      query("SELECT pmetrics.increment_counter('checkpointed_counter', '{}'::jsonb)")
+
+      result = query("SELECT count(*) FROM pg_stat_activity WHERE backend_type = 'pmetrics checkpointer'")
+      assert [[1]] = result.rows
+
+      # The first full checkpoint is written one interval after startup
+      assert Enum.any?(1..20, fn _ ->
+               result = query("SELECT size FROM pg_stat_file('pg_stat/pmetrics.checkpoint', true)")
+               written = match?([[size]] when is_integer(size), result.rows)
+               unless written, do: Process.sleep(250)
+               written
+             end)
+    end
+  end
+
+  # Requires pmetrics_txn in shared_preload_libraries, which counts
+  # transactions through handles resolved on the first one of each backend
+  describe "handles" do
+    test "keep counting across delete_metric(), hiding the deleted series" do
+      Repo.checkout(fn ->
+        # Resolves the handle of this backend
+        query("SELECT 1")
+
+        Repo.transaction(fn ->
+          result = query("SELECT pmetrics.delete_metric('pg_transactions_commit', '{}'::jsonb)")
+          assert [[1]] = result.rows
+
+          # Pinned by handles, the series is kept as a tombstone readers don't see
+          assert is_nil(get_metric_value("pg_transactions_commit", "counter"))
+
+          result = query("SELECT count(*) FROM pmetrics.list_metrics('pg_transactions_commit', NULL, NULL)")
+          assert [[0]] = result.rows
+        end)
+
+        # The commit above revived it from zero
+        query("SELECT 1")
+      end)
+
+      assert get_metric_value("pg_transactions_commit", "counter") >= 2
+    end
+
+    test "keep counting across clear_metrics()" do
+      Repo.checkout(fn ->
+        query("SELECT 1")
+
+        Repo.transaction(fn ->
+          query("SELECT pmetrics.clear_metrics()")
+          assert is_nil(get_metric_value("pg_transactions_commit", "counter"))
+        end)
+
+        query("SELECT 1")
+        Repo.transaction(fn -> Repo.rollback(:aborted) end)
+      end)
+
+      assert get_metric_value("pg_transactions_commit", "counter") >= 2
+      assert get_metric_value("pg_transactions_abort", "counter") >= 1
+    end
+  end
+
   describe "delete_metric" do
     test "deletes counter" do
       query("SELECT pmetrics.increment_counter('test_counter', '{}'::jsonb)")
@@ -184,6 +688,37 @@ defmodule PmetricsTest do
       assert is_nil(get_metric_value("test_counter", "counter"))
     end
 
+    test "keeps labels shared with other metrics" do
+      query("SELECT pmetrics.increment_counter('shared_a', '{\"db\": \"main\"}'::jsonb)")
+      query("SELECT pmetrics.increment_counter('shared_b', '{\"db\": \"main\"}'::jsonb)")
+
+      result = query("SELECT pmetrics.delete_metric('shared_a', '{\"db\": \"main\"}'::jsonb)")
+      assert [[1]] = result.rows
+
+      assert 1 = get_metric_value("shared_b", "counter", %{"db" => "main"})
+
+      query("SELECT pmetrics.increment_counter('shared_a', '{\"db\": \"main\"}'::jsonb)")
+      assert 1 = get_metric_value("shared_a", "counter", %{"db" => "main"})
+    end
+
+    test "returns 0 for labels never used" do
+      result = query("SELECT pmetrics.delete_metric('test_counter', '{\"never\": true}'::jsonb)")
+      assert [[0]] = result.rows
+    end
+
+    test "recreates a metric after its name is freed" do
+      query("SELECT pmetrics.increment_counter_by('renamed_counter', '{}'::jsonb, 5)")
+
+      result = query("SELECT pmetrics.delete_metric('renamed_counter', '{}'::jsonb)")
+      assert [[1]] = result.rows
+
+      result = query("SELECT pmetrics.delete_metric('renamed_counter', '{}'::jsonb)")
+      assert [[0]] = result.rows
+
+      query("SELECT pmetrics.increment_counter('renamed_counter', '{}'::jsonb)")
+      assert 1 = get_metric_value("renamed_counter", "counter")
+    end
+
     test "deletes all histogram metrics (buckets and sum)" do
       query("SELECT pmetrics.record_to_histogram('response_time', '{}'::jsonb, 100.0)")
       query("SELECT pmetrics.record_to_histogram('response_time', '{}'::jsonb, 200.0)")
@@ -201,5 +736,39 @@ defmodule PmetricsTest do
       metrics = query("SELECT * FROM pmetrics.list_metrics() WHERE name = 'response_time'")
       assert length(metrics.rows) == 0
     end
+
+    test "deletes all series whose labels contain an object" do
+      query("SELECT pmetrics.increment_counter('tenant_a', '{\"dbid\": 16384, \"op\": \"read\"}'::jsonb)")
+      query("SELECT pmetrics.record_to_histogram('tenant_b', '{\"dbid\": 16384}'::jsonb, 5.0)")
+      query("SELECT pmetrics.increment_counter('tenant_a', '{\"dbid\": 16385, \"op\": \"read\"}'::jsonb)")
+
+      # Counted in list_metrics() rows: the counter, and the bucket and sum
+      # of the histogram
+      result = query("SELECT pmetrics.delete_metrics_matching('{\"dbid\": 16384}'::jsonb)")
+      assert [[3]] = result.rows
+
+      result = query("SELECT labels FROM pmetrics.list_metrics_matching('{\"op\": \"read\"}'::jsonb)")
+      assert [[%{"dbid" => 16385, "op" => "read"}]] = result.rows
+      assert 1 = get_metric_value("tenant_a", "counter", %{"dbid" => 16385, "op" => "read"})
+      assert [] = list_metrics("tenant_b", "histogram")
+    end
+
+    test "deletes all series of a name, whatever their labels" do
+      query("SELECT pmetrics.increment_counter('by_name', '{\"a\": 1}'::jsonb)")
+      query("SELECT pmetrics.increment_counter('by_name', '{\"a\": 2}'::jsonb)")
+      query("SELECT pmetrics.set_gauge('by_name', '{}'::jsonb, 7)")
+      query("SELECT pmetrics.increment_counter('by_name_kept', '{\"a\": 1}'::jsonb)")
+
+      result = query("SELECT pmetrics.delete_metric('by_name')")
+      assert [[3]] = result.rows
+
+      result = query("SELECT count(*) FROM pmetrics.list_metrics('by_name', NULL, NULL)")
+      assert [[0]] = result.rows
+      assert 1 = get_metric_value("by_name_kept", "counter", %{"a" => 1})
+
+      query("SELECT pmetrics.increment_counter('by_name', '{\"a\": 2}'::jsonb)")
+      result = query("SELECT labels FROM pmetrics.list_metrics('by_name', NULL, NULL)")
+      assert [[%{"a" => 2}]] = result.rows
+    end
   end
 end
@@ -1,4 +1,6 @@
-ExUnit.start()
+# Tests tagged :buffering need pmetrics.flush_interval_ms set, see the CI
+# workflow, and run on their own with mix test --only buffering
+ExUnit.start(exclude: [:buffering])
 
 defmodule PmetricsTest.TestHelpers do
   import Ecto.Query
@@ -52,6 +54,87 @@ defmodule PmetricsTest.TestHelpers do
     |> Repo.all()
   end
 
+  # Send a raw HTTP request and read the response until the server closes
+  def http_request(port, request) do
+    {:ok, socket} = :gen_tcp.connect(~c"localhost", port, [:binary, active: false])
+    :ok = :gen_tcp.send(socket, request)
+    {:ok, response} = read_until_closed(socket, "")
+    :gen_tcp.close(socket)
+    response
+  end
+
+  defp read_until_closed(socket, acc) do
+    case :gen_tcp.recv(socket, 0, 5000) do
+      {:ok, data} -> read_until_closed(socket, acc <> data)
+      {:error, :closed} -> {:ok, acc}
+      error -> error
+    end
+  end
+
+  # Decode the output of export_binary() into a map of series by name
+  def decode_export(data) do
+    <<"PMX1", 1::little-32, _generation::little-64, nnames::little-32, nlabel_sets::little-32,
+      nseries::little-32, nbounds::little-32, rest::binary>> = data
+
+    <<_bounds::binary-size(nbounds * 4), rest::binary>> = rest
+    {names, rest} = decode_many(rest, nnames, &decode_string/1)
+    {label_sets, rest} = decode_many(rest, nlabel_sets, &decode_label_set/1)
+    rest = skip_padding(data, rest)
+
+    <<values::binary-size(nseries * 8), name_ids::binary-size(nseries * 4),
+      label_ids::binary-size(nseries * 4), types::binary-size(nseries), rest::binary>> = rest
+
+    rest = skip_padding(data, rest)
+    values = for <<value::little-signed-64 <- values>>, do: value
+    name_ids = for <<id::little-32 <- name_ids>>, do: id
+    label_ids = for <<id::little-32 <- label_ids>>, do: id
+    types = for <<type <- types>>, do: type
+
+    {series, _} =
+      [values, name_ids, label_ids, types]
+      |> Enum.zip()
+      |> Enum.map_reduce(rest, fn {value, name_id, label_id, type}, rest ->
+        {buckets, rest} =
+          if type == 2 do
+            <<buckets::binary-size(nbounds * 8), rest::binary>> = rest
+            {for(<<count::little-signed-64 <- buckets>>, do: count), rest}
+          else
+            {nil, rest}
+          end
+
+        labels = if label_id == 0xFFFFFFFF, do: nil, else: Enum.at(label_sets, label_id)
+
+        {{Enum.at(names, name_id), %{labels: labels, type: type, value: value, buckets: buckets}},
+         rest}
+      end)
+
+    Map.new(series)
+  end
+
+  defp decode_many(data, count, decode) do
+    Enum.map_reduce(List.duplicate(nil, count), data, fn _, rest -> decode.(rest) end)
+  end
+
+  defp decode_string(<<len::little-32, string::binary-size(len), rest::binary>>), do: {string, rest}
+
+  defp decode_label_set(<<count::little-32, rest::binary>>) do
+    {pairs, rest} =
+      decode_many(rest, count, fn rest ->
+        {key, rest} = decode_string(rest)
+        {value, rest} = decode_string(rest)
+        {{key, value}, rest}
+      end)
+
+    {Map.new(pairs), rest}
+  end
+
+  defp skip_padding(data, rest) do
+    offset = byte_size(data) - byte_size(rest)
+    padding = rem(8 - rem(offset, 8), 8)
+    <<_::binary-size(padding), rest::binary>> = rest
+    rest
+  end
+
   # Get histogram sum
   def get_histogram_sum(name, labels \\ %{}) do
     get_metric_value(name, "histogram_sum", labels)